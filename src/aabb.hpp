@@ -19,6 +19,23 @@ public:
     Point3 min() const { return min_p; }
     Point3 max() const { return max_p; }
 
+    Point3 centroid() const { return 0.5 * (min_p + max_p); }
+
+    double surfaceArea() const
+    {
+        auto d = max_p - min_p;
+        return 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+    }
+
+    // the axis with the largest extent
+    int maxExtent() const
+    {
+        auto d = max_p - min_p;
+        if (d.x() > d.y() && d.x() > d.z())
+            return 0;
+        return d.y() > d.z() ? 1 : 2;
+    }
+
     bool hit(const Ray &r, double t_min, double t_max) const
     {
         for (int i = 0; i < 3; ++i)
@@ -35,6 +52,42 @@ public:
         }
         return true;
     }
+
+    // same test with the reciprocal of the ray direction precomputed
+    bool hit(const Ray &r, const Vec3 &inv_d,
+             double t_min, double t_max) const
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            auto t0 = (min_p[i] - r.origin()[i]) * inv_d[i];
+            auto t1 = (max_p[i] - r.origin()[i]) * inv_d[i];
+            if (inv_d[i] < 0)
+                std::swap(t0, t1);
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+            if (t_max <= t_min)
+                return false;
+        }
+        return true;
+    }
+
+    // same test, narrowing [t_min, t_max] to the part inside the box
+    bool clipRay(const Ray &r, const Vec3 &inv_d,
+                 double &t_min, double &t_max) const
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            auto t0 = (min_p[i] - r.origin()[i]) * inv_d[i];
+            auto t1 = (max_p[i] - r.origin()[i]) * inv_d[i];
+            if (inv_d[i] < 0)
+                std::swap(t0, t1);
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+            if (t_max < t_min)
+                return false;
+        }
+        return true;
+    }
 };
 
 AABB surroundingBox(AABB box0, AABB box1)
@@ -47,3 +100,23 @@ AABB surroundingBox(AABB box0, AABB box1)
                fmax(box0.max().z(), box1.max().z()));
     return AABB(small, big);
 }
+
+AABB surroundingBox(AABB box, const Point3 &p)
+{
+    return surroundingBox(box, AABB(p, p));
+}
+
+// the common part of two boxes, false if they do not overlap
+bool overlapBox(const AABB &box0, const AABB &box1, AABB &output_box)
+{
+    Point3 small(fmax(box0.min().x(), box1.min().x()),
+                 fmax(box0.min().y(), box1.min().y()),
+                 fmax(box0.min().z(), box1.min().z()));
+    Point3 big(fmin(box0.max().x(), box1.max().x()),
+               fmin(box0.max().y(), box1.max().y()),
+               fmin(box0.max().z(), box1.max().z()));
+    if (small.x() > big.x() || small.y() > big.y() || small.z() > big.z())
+        return false;
+    output_box = AABB(small, big);
+    return true;
+}
@@ -3,7 +3,7 @@
 #include "hittable.h"
 #include "aabb.hpp"
 
-class XYRect : public Hittable
+class XYRect final : public Hittable
 {
 private:
     double x0, x1, y0, y1, k;
@@ -40,6 +40,17 @@ public:
         return true;
     }
 
+    bool occluded(const Ray &r, double t0, double t1) const override
+    {
+        auto t = (k - r.origin().z()) / r.direction().z();
+        if (t < t0 || t > t1)
+            return false;
+
+        auto x = r.origin().x() + t * r.direction().x();
+        auto y = r.origin().y() + t * r.direction().y();
+        return !(x < x0 || x > x1 || y < y0 || y > y1);
+    }
+
     bool boundingBox(double t0, double t1,
                      AABB &output_box) const override
     {
@@ -51,7 +62,7 @@ public:
     }
 };
 
-class XZRect : public Hittable
+class XZRect final : public Hittable
 {
 private:
     double x0, x1, z0, z1, k;
@@ -88,6 +99,17 @@ public:
         return true;
     }
 
+    bool occluded(const Ray &r, double t0, double t1) const override
+    {
+        auto t = (k - r.origin().y()) / r.direction().y();
+        if (t < t0 || t > t1)
+            return false;
+
+        auto x = r.origin().x() + t * r.direction().x();
+        auto z = r.origin().z() + t * r.direction().z();
+        return !(x < x0 || x > x1 || z < z0 || z > z1);
+    }
+
     bool boundingBox(double t0, double t1,
                      AABB &output_box) const override
     {
@@ -97,7 +119,7 @@ public:
     }
 };
 
-class YZRect : public Hittable
+class YZRect final : public Hittable
 {
 private:
     double y0, y1, z0, z1, k;
@@ -134,6 +156,17 @@ public:
         return true;
     }
 
+    bool occluded(const Ray &r, double t0, double t1) const override
+    {
+        auto t = (k - r.origin().x()) / r.direction().x();
+        if (t < t0 || t > t1)
+            return false;
+
+        auto y = r.origin().y() + t * r.direction().y();
+        auto z = r.origin().z() + t * r.direction().z();
+        return !(y < y0 || y > y1 || z < z0 || z > z1);
+    }
+
     bool boundingBox(double t0, double t1,
                      AABB &output_box) const override
     {
@@ -0,0 +1,98 @@
+// Acceleration structures: a Hittable over many objects that can
+//  report its own size. Scenes build them with makeAccelerator()
+//  (see accelerators.hpp), so the backend can be swapped without
+//  touching the scene code.
+
+#pragma once
+
+#include <cstring>
+
+#include "raytracer.h"
+#include "hittable.h"
+#include "aabb.hpp"
+
+class Accelerator : public Hittable
+{
+public:
+    // bytes held by the structure itself: nodes, cells, references
+    //  and packed leaf copies, but not the objects it points to
+    virtual size_t memoryUsage() const = 0;
+};
+
+// Intersects primitives[first + k] for every boxes[k] the ray hits,
+//  shrinking t_max to each hit; for the few primitives a grid or a
+//  kd-tree keeps out of its cells.
+inline bool hitBoxed(const std::vector<shared_ptr<Hittable>> &primitives,
+                     size_t first, const std::vector<AABB> &boxes,
+                     const Ray &r, double t_min, double &t_max, HitRecord &rec)
+{
+    HitRecord temp_rec;
+    bool hit_anything = false;
+    for (size_t k = 0; k < boxes.size(); ++k)
+        if (boxes[k].hit(r, t_min, t_max) &&
+            primitives[first + k]->hit(r, t_min, t_max, temp_rec))
+        {
+            hit_anything = true;
+            t_max = temp_rec.t;
+            rec = temp_rec;
+        }
+    return hit_anything;
+}
+
+inline bool occludedBoxed(const std::vector<shared_ptr<Hittable>> &primitives,
+                          size_t first, const std::vector<AABB> &boxes,
+                          const Ray &r, double t_min, double t_max)
+{
+    for (size_t k = 0; k < boxes.size(); ++k)
+        if (boxes[k].hit(r, t_min, t_max) &&
+            primitives[first + k]->occluded(r, t_min, t_max))
+            return true;
+    return false;
+}
+
+enum class AcceleratorType
+{
+    BVH,     // binary BVHNode
+    BVH4,    // WideBVH<4>
+    BVH8,    // WideBVH<8>
+    Grid,    // UniformGrid
+    KdTree,  // SAH kd-tree
+    LazyBVH  // built on first hit
+};
+
+const AcceleratorType ACCELERATOR_TYPES[] = {
+    AcceleratorType::BVH, AcceleratorType::BVH4, AcceleratorType::BVH8,
+    AcceleratorType::Grid, AcceleratorType::KdTree, AcceleratorType::LazyBVH};
+
+inline const char *acceleratorName(AcceleratorType type)
+{
+    switch (type)
+    {
+    case AcceleratorType::BVH:
+        return "bvh";
+    case AcceleratorType::BVH4:
+        return "bvh4";
+    case AcceleratorType::BVH8:
+        return "bvh8";
+    case AcceleratorType::Grid:
+        return "grid";
+    case AcceleratorType::KdTree:
+        return "kdtree";
+    default:
+        return "lazy";
+    }
+}
+
+// The backend named by the RT_ACCELERATOR environment variable,
+//  BVH4 if it is not set.
+inline AcceleratorType acceleratorType()
+{
+    const char *name = std::getenv("RT_ACCELERATOR");
+    if (!name || !*name)
+        return AcceleratorType::BVH4;
+    for (auto type : ACCELERATOR_TYPES)
+        if (std::strcmp(name, acceleratorName(type)) == 0)
+            return type;
+    std::cerr << "[ERROR]: Unknown accelerator " << name << ", using bvh4.\n";
+    return AcceleratorType::BVH4;
+}
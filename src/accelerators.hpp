@@ -0,0 +1,102 @@
+// Every acceleration structure behind one factory, so that a scene can
+//  be rendered with any of them: the backend is picked by the
+//  RT_ACCELERATOR environment variable (see accelerator.h).
+//
+// Compiled with -DACCEL_BENCH, every structure built records its build
+//  time and size, and reportAcceleratorBench() adds the trace rate.
+// `make bench` in scenes/ runs each scene with every backend.
+
+#pragma once
+
+#include <chrono>
+
+#include "raytracer.h"
+#include "hittable.h"
+#include "accelerator.h"
+#include "hittable_list.hpp"
+#include "bvh.hpp"
+#include "bvh_wide.hpp"
+#include "grid.hpp"
+#include "kdtree.hpp"
+#include "lazy_bvh.hpp"
+#include "bvh_report.hpp"
+
+struct AcceleratorBuild
+{
+    double build_ms;
+    size_t memory_bytes;
+};
+
+// every structure built so far, in build order
+inline std::vector<AcceleratorBuild> &acceleratorBuilds()
+{
+    static std::vector<AcceleratorBuild> builds;
+    return builds;
+}
+
+shared_ptr<Accelerator> makeAccelerator(
+    HittableList &list, double time0, double time1,
+    AcceleratorType type = acceleratorType(),
+    const BVHBuildOptions &options = BVHBuildOptions())
+{
+#ifdef ACCEL_BENCH
+    auto start = std::chrono::steady_clock::now();
+#endif
+    shared_ptr<Accelerator> accelerator;
+    switch (type)
+    {
+    case AcceleratorType::BVH:
+        accelerator = make_shared<BVHNode>(list, time0, time1, options);
+        break;
+    case AcceleratorType::BVH4:
+        accelerator = make_shared<BVH4>(list, time0, time1, options);
+        break;
+    case AcceleratorType::BVH8:
+        accelerator = make_shared<BVH8>(list, time0, time1, options);
+        break;
+    case AcceleratorType::Grid:
+        accelerator = make_shared<UniformGrid>(list, time0, time1);
+        break;
+    case AcceleratorType::KdTree:
+        accelerator = make_shared<KdTree>(list, time0, time1);
+        break;
+    default:
+        accelerator = make_shared<LazyBVH>(list, time0, time1, options);
+    }
+#ifdef ACCEL_BENCH
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+#pragma omp critical(accelerator_builds)
+    acceleratorBuilds().push_back({elapsed.count(), accelerator->memoryUsage()});
+#endif
+    return accelerator;
+}
+
+// Prints one line of JSON for the scene: the structures built for it
+//  by the current backend, their total build time and size, and the
+//  rate of n_paths camera paths traced as in reportBVHStats().
+int reportAcceleratorBench(const char *scene, const Hittable &world, const Camera &cam,
+                           int max_depth, int n_paths = 1 << 16)
+{
+    double build_ms = 0;
+    size_t memory_bytes = 0;
+    for (const auto &build : acceleratorBuilds())
+    {
+        build_ms += build.build_ms;
+        memory_bytes += build.memory_bytes;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t n_rays = traceBVHStatsPaths(world, cam, max_depth, n_paths);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << "{\"scene\": \"" << scene << "\""
+              << ", \"accelerator\": \"" << acceleratorName(acceleratorType()) << "\""
+              << ", \"structures\": " << acceleratorBuilds().size()
+              << std::setprecision(6)
+              << ", \"build_ms\": " << build_ms
+              << ", \"memory_bytes\": " << memory_bytes
+              << ", \"rays\": " << n_rays
+              << ", \"rays_per_s\": " << n_rays / elapsed.count() << "}\n";
+    return 0;
+}
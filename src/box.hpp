@@ -1,44 +1,102 @@
 #pragma once
 
 #include "raytracer.h"
-#include "hittable_list.hpp"
-#include "aarect.hpp"
+#include "hittable.h"
+#include "aabb.hpp"
 
-class Box : public Hittable
+// An axis-aligned box, intersected as one slab test: the face hit and
+//  its normal follow from the axis the ray enters or leaves by, so the
+//  box needs no rect per face. Faces get the u and v their rect would.
+class Box final : public Hittable
 {
 private:
     Point3 box_min;
     Point3 box_max;
-    HittableList sides;
+    shared_ptr<Material> mat_ptr;
+
+    // The nearest distance in [t0, t1] at which the ray crosses a face,
+    //  the face's axis, and whether it is the face at box_min.
+    bool nearestFace(const Ray &r, double t0, double t1,
+                     double &t, int &axis, bool &at_min) const
+    {
+        const auto &o = r.origin(), &d = r.direction();
+        double enter = -INF, exit = INF;
+        int enter_axis = 0, exit_axis = 0;
+        for (int a = 0; a < 3; ++a)
+        {
+            auto near = (box_min[a] - o[a]) / d[a];
+            auto far = (box_max[a] - o[a]) / d[a];
+            if (d[a] < 0)
+                std::swap(near, far);
+            // a ray along a face gives NaN, and leaves the interval as is
+            if (near > enter)
+            {
+                enter = near;
+                enter_axis = a;
+            }
+            if (far < exit)
+            {
+                exit = far;
+                exit_axis = a;
+            }
+        }
+        if (enter > exit)
+            return false;
+        // from outside the box the ray enters first, from inside it leaves
+        if (enter >= t0 && enter <= t1)
+        {
+            t = enter;
+            axis = enter_axis;
+            at_min = d[axis] > 0;
+            return true;
+        }
+        if (exit >= t0 && exit <= t1)
+        {
+            t = exit;
+            axis = exit_axis;
+            at_min = d[axis] < 0;
+            return true;
+        }
+        return false;
+    }
 
 public:
     Box() {}
 
     Box(const Point3 &p0, const Point3 &p1, shared_ptr<Material> ptr)
-    {
-        box_min = p0;
-        box_max = p1;
-
-        sides.add(make_shared<XYRect>(
-            p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr));
-        sides.add(make_shared<FlipFace>(
-            make_shared<XYRect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr)));
-
-        sides.add(make_shared<XZRect>(
-            p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr));
-        sides.add(make_shared<FlipFace>(
-            make_shared<XZRect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr)));
-
-        sides.add(make_shared<YZRect>(
-            p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr));
-        sides.add(make_shared<FlipFace>(
-            make_shared<YZRect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr)));
-    }
+        : box_min(p0), box_max(p1), mat_ptr(ptr) {}
 
     bool hit(const Ray &r, double t0,
              double t1, HitRecord &rec) const override
     {
-        return sides.hit(r, t0, t1, rec);
+        double t;
+        int axis;
+        bool at_min;
+        if (!nearestFace(r, t0, t1, t, axis, at_min))
+            return false;
+
+        rec.t = t;
+        rec.p = r.at(t);
+        Vec3 outward_normal;
+        outward_normal[axis] = at_min ? -1 : 1;
+        rec.setFaceNormal(r, outward_normal);
+
+        // the rects' u and v: along the lower remaining axis, then
+        //  the other, counted from the top on the z faces
+        int ua = axis == 0 ? 1 : 0, va = axis == 2 ? 1 : 2;
+        rec.u = (rec.p[ua] - box_min[ua]) / (box_max[ua] - box_min[ua]);
+        rec.v = axis == 2 ? (box_max[va] - rec.p[va]) / (box_max[va] - box_min[va])
+                          : (rec.p[va] - box_min[va]) / (box_max[va] - box_min[va]);
+        rec.mat_ptr = mat_ptr;
+        return true;
+    }
+
+    bool occluded(const Ray &r, double t0, double t1) const override
+    {
+        double t;
+        int axis;
+        bool at_min;
+        return nearestFace(r, t0, t1, t, axis, at_min);
     }
 
     bool boundingBox(double t0, double t1,
@@ -1,94 +1,673 @@
 #pragma once
 
+#include <functional>
+#include <queue>
+#include <unordered_set>
+
 #include "raytracer.h"
 #include "hittable.h"
+#include "accelerator.h"
 #include "hittable_list.hpp"
 #include "aabb.hpp"
+#include "bvh_build.hpp"
+#include "lbvh.hpp"
+#include "sbvh.hpp"
+#include "bvh_cache.hpp"
+#include "bvh_stats.hpp"
+#include "typed_leaves.hpp"
+
+const uint32_t BVH_NO_NODE = 0xffffffff;
 
-class BVHNode : public Hittable
+class BVHNode : public Accelerator
 {
+    template <int N>
+    friend class WideBVH;
+
 private:
-    shared_ptr<Hittable> left;
-    shared_ptr<Hittable> right;
-    AABB box;
+    AlignedVector<BVHLinearNode> nodes;
+    // in leaf order; slots freed by remove() are null
+    std::vector<shared_ptr<Hittable>> primitives;
+    TypedLeaves typed;
+    BVHBuildOptions options;
+    double built_cost = 0; // sahCost() right after building
+    double time0 = 0, time1 = 0;
+
+    // what insert() and remove() need besides the tree,
+    //  set up by the first of them
+    std::vector<uint32_t> parents;    // BVH_NO_NODE for the root
+    std::vector<uint8_t> heights;     // longest path down to a leaf
+    std::vector<uint32_t> leaf_of;    // leaf of every primitive slot
+    std::vector<uint32_t> free_pairs; // first of two unused nodes
+    std::vector<uint32_t> free_slots; // unused primitive slots
+
+    // after building or loading the tree
+    void finishBuild();
+    void refitNode(uint32_t index, double time0, double time1, int depth);
+
+    void prepareEdits();
+    // point the children or primitives of a node back at it
+    void adopt(uint32_t index);
+    void swapNodes(uint32_t a, uint32_t b);
+    // box, height and split axis of an interior node from its children
+    void updateNode(uint32_t index);
+    void rotate(uint32_t index);
+    void refitUpwards(uint32_t index);
+    uint32_t findSibling(const AABB &box) const;
+    uint32_t findSlot(const Hittable *object, const AABB &box) const;
+    void removeSlot(uint32_t slot);
+
+    // the primitives once each, spatial splits may repeat them
+    static std::vector<shared_ptr<Hittable>>
+    uniquePrimitives(const std::vector<shared_ptr<Hittable>> &primitives);
 
 public:
     BVHNode() {}
 
-    BVHNode(HittableList &list, double time0, double time1)
-        : BVHNode(list.objects, 0, list.objects.size(), time0, time1) {}
+    BVHNode(HittableList &list, double time0, double time1,
+            const BVHBuildOptions &options = BVHBuildOptions())
+        : BVHNode(list.objects, 0, list.objects.size(),
+                  time0, time1, options) {}
 
     BVHNode(
         std::vector<shared_ptr<Hittable>> &objects,
-        size_t start, size_t end, double time0, double time1);
+        size_t start, size_t end, double time0, double time1,
+        const BVHBuildOptions &options = BVHBuildOptions());
+
+    // expected cost of a random ray that hits the root box
+    double sahCost() const;
+
+    // shape and quality of the tree, see bvh_stats.hpp
+    BVHTreeStats stats() const;
+
+    // Recompute the boxes for another shutter interval, keeping the tree.
+    // Rebuilds from scratch instead, and returns true, once the SAH cost
+    //  has grown past options.refit_tolerance times the built cost.
+    bool refit(double time0, double time1);
+
+    // Adds an object as a leaf of its own, next to the node that adds
+    //  the least box area to the tree (Bittner et al., "Fast
+    //  Insertion-Based Optimization of Bounding Volume Hierarchies",
+    //  2013), then refits the boxes above it, rotating subtrees where
+    //  that shrinks them (Kopta et al., "Fast, Effective BVH Updates
+    //  for Animated Scenes", 2012). Costs O(log n) for most trees.
+    // Rebuilds from scratch instead if the tree gets too deep to traverse.
+    void insert(const shared_ptr<Hittable> &object);
+
+    // Removes every reference to the object, found by its bounding box:
+    //  to move an object, remove it, change it, then insert it again.
+    // Returns false if the object is not in the tree.
+    bool remove(const shared_ptr<Hittable> &object);
 
     bool hit(const Ray &r, double t_min,
              double t_max, HitRecord &rec) const override
     {
-        if (!box.hit(r, t_min, t_max))
+        if (nodes.empty())
             return false;
 
-        bool hit_left = left->hit(r, t_min, t_max, rec);
-        bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+        Vec3 inv_d(1 / r.direction().x(),
+                   1 / r.direction().y(),
+                   1 / r.direction().z());
+        bool dir_neg[3] = {inv_d.x() < 0, inv_d.y() < 0, inv_d.z() < 0};
+
+        uint32_t stack[BVH_STACK_SIZE];
+        int top = 0;
+        uint32_t current = 0;
+        bool hit_anything = false;
 
-        return hit_left | hit_right;
+        while (true)
+        {
+            const auto &node = nodes[current];
+            BVH_STATS_COUNT(node_tests);
+            BVH_STATS_TOUCH(node);
+            if (node.box.hit(r, inv_d, t_min, t_max))
+            {
+                if (node.count > 0)
+                {
+                    if (typed.hit(primitives, node.offset, node.count,
+                                  r, t_min, t_max, rec))
+                        hit_anything = true;
+                    if (top == 0)
+                        break;
+                    current = stack[--top];
+                }
+                else if (dir_neg[node.axis])
+                {
+                    // the second child is nearer, visit it first
+                    stack[top++] = node.offset;
+                    current = node.offset + 1;
+                }
+                else
+                {
+                    stack[top++] = node.offset + 1;
+                    current = node.offset;
+                }
+            }
+            else
+            {
+                if (top == 0)
+                    break;
+                current = stack[--top];
+            }
+        }
+
+        return hit_anything;
+    }
+
+    // Depth-first like hit(), but without ordering the children:
+    //  any hit ends the traversal.
+    bool occluded(const Ray &r, double t_min, double t_max) const override
+    {
+        if (nodes.empty())
+            return false;
+
+        Vec3 inv_d(1 / r.direction().x(),
+                   1 / r.direction().y(),
+                   1 / r.direction().z());
+
+        uint32_t stack[BVH_STACK_SIZE];
+        int top = 0;
+        uint32_t current = 0;
+        while (true)
+        {
+            const auto &node = nodes[current];
+            BVH_STATS_COUNT(node_tests);
+            BVH_STATS_TOUCH(node);
+            if (node.box.hit(r, inv_d, t_min, t_max))
+            {
+                if (node.count == 0)
+                {
+                    stack[top++] = node.offset + 1;
+                    current = node.offset;
+                    continue;
+                }
+                if (typed.occluded(primitives, node.offset, node.count,
+                                   r, t_min, t_max))
+                    return true;
+            }
+            if (top == 0)
+                return false;
+            current = stack[--top];
+        }
     }
 
     bool boundingBox(double t0, double t1,
                      AABB &output_box) const override
     {
-        output_box = box;
+        if (nodes.empty())
+            return false;
+        output_box = nodes[0].box;
         return true;
     }
+
+    size_t memoryUsage() const override
+    {
+        return nodes.capacity() * sizeof(BVHLinearNode) +
+               primitives.capacity() * sizeof(shared_ptr<Hittable>) +
+               typed.memoryUsage();
+    }
 };
 
-// 1. randomly choose an axis
-// 2. sort the primitives (using std::sort)
-// 3. put half in each subtree
 BVHNode::BVHNode(
     std::vector<shared_ptr<Hittable>> &objects,
-    size_t start, size_t end, double time0, double time1)
+    size_t start, size_t end, double time0, double time1,
+    const BVHBuildOptions &options)
+    : options(options), time0(time0), time1(time1)
 {
-    int axis = randomInt(0, 2);
-    auto comparator = [=](const shared_ptr<Hittable> &lhs,
-                          const shared_ptr<Hittable> &rhs)
+    std::vector<BVHPrimitive> prims(end - start);
+#pragma omp parallel for if (prims.size() >= options.parallel_threshold)
+    for (size_t i = start; i < end; ++i)
     {
-        AABB box_left, box_right;
-        if (!lhs->boundingBox(0, 0, box_left) ||
-            !rhs->boundingBox(0, 0, box_right))
+        AABB prim_box;
+        // in case you sent in something like an infinite plane
+        if (!objects[i]->boundingBox(time0, time1, prim_box))
+#pragma omp critical
             std::cerr << "[ERROR]: No bounding box in BVHnode constructor.\n";
-        return box_left.min()[axis] < box_right.min()[axis];
-    };
-    size_t object_span = end - start;
+        prims[i - start] = {prim_box, prim_box.centroid(), i};
+    }
+    if (prims.empty())
+        return;
 
-    if (object_span == 1)
+    uint64_t hash = 0;
+    std::string cache_path;
+    if (!options.cache_dir.empty())
     {
-        left = right = objects[start];
+        hash = bvhContentHash(prims, objects, options);
+        cache_path = bvhCachePath(options.cache_dir, hash);
+
+        std::vector<uint32_t> order;
+        if (loadBVHCache(cache_path, hash, end - start, nodes, order))
+        {
+            primitives.resize(order.size());
+#pragma omp parallel for if (order.size() >= options.parallel_threshold)
+            for (size_t i = 0; i < order.size(); ++i)
+                primitives[i] = objects[start + order[i]];
+            finishBuild();
+            return;
+        }
     }
-    else if (object_span == 2)
+
+    if (options.method == BVHBuildMethod::Morton)
+        LBVHBuilder(prims, options).build(nodes);
+    else if (options.method == BVHBuildMethod::Spatial)
+        SBVHBuilder(
+            prims, [&](size_t index, const AABB &clip, AABB &output_box)
+            { return objects[index]->clippedBox(time0, time1, clip, output_box); },
+            options)
+            .build(nodes);
+    else
+        BVHBuilder(prims, options).build(nodes);
+    primitives.resize(prims.size());
+#pragma omp parallel for if (prims.size() >= options.parallel_threshold)
+    for (size_t i = 0; i < prims.size(); ++i)
+        primitives[i] = objects[prims[i].index];
+
+    if (!cache_path.empty())
     {
-        left = objects[start];
-        right = objects[start + 1];
-        if (!comparator(left, right))
-            std::swap(left, right);
+        std::vector<uint32_t> order(prims.size());
+        for (size_t i = 0; i < prims.size(); ++i)
+            order[i] = prims[i].index - start;
+        saveBVHCache(cache_path, hash, nodes, order);
+    }
+    finishBuild();
+}
+
+void BVHNode::finishBuild()
+{
+    if (options.typed_leaves)
+        typed = TypedLeaves(primitives, nodes);
+    built_cost = sahCost();
+#ifdef BVH_STATS
+    registerBVHStats(stats());
+#endif
+}
+
+double BVHNode::sahCost() const
+{
+    // sum of (node cost) * P(ray hits node | ray hits root)
+    double cost = 0;
+    for (const auto &node : nodes)
+        cost += node.box.surfaceArea() *
+                (node.count ? options.intersect_cost * node.count
+                            : options.traversal_cost);
+    return nodes.empty() ? 0 : cost / nodes[0].box.surfaceArea();
+}
+
+BVHTreeStats BVHNode::stats() const
+{
+    auto stats = bvhTreeStats(nodes);
+    stats.primitives = uniquePrimitives(primitives).size();
+    stats.references = primitives.size() - free_slots.size();
+    stats.sah_cost = sahCost();
+    return stats;
+}
+
+bool BVHNode::refit(double time0, double time1)
+{
+    this->time0 = time0;
+    this->time1 = time1;
+    if (nodes.empty())
+        return false;
+
+#pragma omp parallel if (primitives.size() >= options.parallel_threshold)
+#pragma omp single
+    refitNode(0, time0, time1, 0);
+
+    if (sahCost() <= built_cost * options.refit_tolerance)
+        return false;
+
+    auto objects = uniquePrimitives(primitives);
+    *this = BVHNode(objects, 0, objects.size(), time0, time1, options);
+    return true;
+}
+
+std::vector<shared_ptr<Hittable>>
+BVHNode::uniquePrimitives(const std::vector<shared_ptr<Hittable>> &primitives)
+{
+    std::vector<shared_ptr<Hittable>> objects;
+    std::unordered_set<const Hittable *> seen;
+    for (const auto &object : primitives)
+        if (object && seen.insert(object.get()).second)
+            objects.push_back(object);
+    return objects;
+}
+
+// recurses through child offsets, so it holds wherever insert() and
+//  remove() put the pairs; subtrees are refit as independent tasks
+//  before the parent merges their boxes
+void BVHNode::refitNode(uint32_t index, double time0, double time1, int depth)
+{
+    auto &node = nodes[index];
+    if (node.count > 0)
+    {
+        for (uint32_t i = 0; i < node.count; ++i)
+        {
+            AABB prim_box;
+            if (!primitives[node.offset + i]->boundingBox(time0, time1, prim_box))
+                std::cerr << "[ERROR]: No bounding box in BVHNode::refit.\n";
+            node.box = i ? surroundingBox(node.box, prim_box) : prim_box;
+        }
+        return;
+    }
+
+    if (depth < 8)
+    {
+#pragma omp task
+        refitNode(node.offset, time0, time1, depth + 1);
+        refitNode(node.offset + 1, time0, time1, depth + 1);
+#pragma omp taskwait
     }
     else
     {
-        std::sort(objects.begin() + start,
-                  objects.begin() + end,
-                  comparator);
+        refitNode(node.offset, time0, time1, depth + 1);
+        refitNode(node.offset + 1, time0, time1, depth + 1);
+    }
+    node.box = surroundingBox(nodes[node.offset].box, nodes[node.offset + 1].box);
+}
 
-        auto mid = start + object_span / 2;
-        left = make_shared<BVHNode>(objects, start, mid, time0, time1);
-        right = make_shared<BVHNode>(objects, mid, end, time0, time1);
+void BVHNode::insert(const shared_ptr<Hittable> &object)
+{
+    AABB box;
+    if (!object->boundingBox(time0, time1, box))
+    {
+        std::cerr << "[ERROR]: No bounding box in BVHNode::insert.\n";
+        return;
     }
+    prepareEdits();
 
-    AABB box_left, box_right;
+    uint32_t slot;
+    if (free_slots.empty())
+    {
+        slot = primitives.size();
+        primitives.push_back(object);
+        leaf_of.push_back(0);
+    }
+    else
+    {
+        slot = free_slots.back();
+        free_slots.pop_back();
+        primitives[slot] = object;
+    }
+    typed.updateLeaf(primitives, slot, slot + 1);
 
-    // in case you sent in something like an infinite plane
-    if (!left->boundingBox(time0, time1, box_left) ||
-        !right->boundingBox(time0, time1, box_right))
-        std::cerr << "[ERROR]: No bounding box in BVHnode constructor.\n";
+    BVHLinearNode leaf;
+    leaf.box = box;
+    leaf.offset = slot;
+    leaf.count = 1;
+    leaf.axis = 0;
+    if (nodes.empty())
+    {
+        nodes.push_back(leaf);
+        parents.push_back(BVH_NO_NODE);
+        heights.push_back(0);
+        leaf_of[slot] = 0;
+        return;
+    }
 
-    box = surroundingBox(box_left, box_right);
+    // the sibling keeps its place, as the parent of itself and the leaf
+    uint32_t sibling = findSibling(box);
+    uint32_t pair;
+    if (free_pairs.empty())
+    {
+        pair = nodes.size();
+        nodes.resize(pair + 2);
+        parents.resize(pair + 2);
+        heights.resize(pair + 2);
+    }
+    else
+    {
+        pair = free_pairs.back();
+        free_pairs.pop_back();
+    }
+    nodes[pair] = nodes[sibling];
+    heights[pair] = heights[sibling];
+    nodes[pair + 1] = leaf;
+    heights[pair + 1] = 0;
+    parents[pair] = parents[pair + 1] = sibling;
+    adopt(pair);
+    adopt(pair + 1);
+    nodes[sibling].offset = pair;
+    nodes[sibling].count = 0;
+    refitUpwards(sibling);
+
+    if (heights[0] >= BVH_STACK_SIZE - 1)
+    {
+        auto objects = uniquePrimitives(primitives);
+        *this = BVHNode(objects, 0, objects.size(), time0, time1, options);
+    }
+}
+
+bool BVHNode::remove(const shared_ptr<Hittable> &object)
+{
+    AABB box;
+    if (nodes.empty() || !object->boundingBox(time0, time1, box))
+        return false;
+    prepareEdits();
+
+    // spatial splits may have put it in several leaves
+    bool removed = false;
+    for (uint32_t slot; (slot = findSlot(object.get(), box)) != BVH_NO_NODE;)
+    {
+        removeSlot(slot);
+        removed = true;
+    }
+    return removed;
+}
+
+void BVHNode::prepareEdits()
+{
+    if (parents.size() == nodes.size())
+        return;
+
+    // children follow their parents until the first edit
+    parents.assign(nodes.size(), BVH_NO_NODE);
+    heights.assign(nodes.size(), 0);
+    leaf_of.assign(primitives.size(), 0);
+    free_pairs.clear();
+    free_slots.clear();
+    for (uint32_t i = nodes.size(); i-- > 0;)
+    {
+        const auto &node = nodes[i];
+        if (node.count > 0)
+            for (uint32_t s = node.offset; s < node.offset + node.count; ++s)
+                leaf_of[s] = i;
+        else
+        {
+            parents[node.offset] = parents[node.offset + 1] = i;
+            heights[i] = 1 + std::max(heights[node.offset], heights[node.offset + 1]);
+        }
+    }
+}
+
+void BVHNode::adopt(uint32_t index)
+{
+    const auto &node = nodes[index];
+    if (node.count > 0)
+        for (uint32_t s = node.offset; s < node.offset + node.count; ++s)
+            leaf_of[s] = index;
+    else
+        parents[node.offset] = parents[node.offset + 1] = index;
+}
+
+void BVHNode::swapNodes(uint32_t a, uint32_t b)
+{
+    std::swap(nodes[a], nodes[b]);
+    std::swap(heights[a], heights[b]);
+    adopt(a);
+    adopt(b);
+}
+
+void BVHNode::updateNode(uint32_t index)
+{
+    uint32_t first = nodes[index].offset, second = first + 1;
+    // split along the axis that separates the children most,
+    //  the first child below the second, as the builders do
+    auto d = nodes[second].box.centroid() - nodes[first].box.centroid();
+    int axis = std::fabs(d.x()) > std::fabs(d.y())
+                   ? (std::fabs(d.x()) > std::fabs(d.z()) ? 0 : 2)
+                   : (std::fabs(d.y()) > std::fabs(d.z()) ? 1 : 2);
+    if (d[axis] < 0)
+        swapNodes(first, second);
+
+    auto &node = nodes[index];
+    node.box = surroundingBox(nodes[first].box, nodes[second].box);
+    node.axis = axis;
+    heights[index] = 1 + std::max(heights[first], heights[second]);
+}
+
+// Swaps one child with a child of the other one, if that shrinks
+//  the box of the other one; the boxes of both must be up to date.
+void BVHNode::rotate(uint32_t index)
+{
+    uint32_t pair = nodes[index].offset;
+    double best = 0;
+    uint32_t moved = 0, grandchild = 0, middle = 0;
+    for (uint32_t k = 0; k < 2; ++k)
+    {
+        uint32_t child = pair + k, other = pair + 1 - k;
+        if (nodes[child].count > 0)
+            continue;
+        for (uint32_t g = 0; g < 2; ++g)
+        {
+            uint32_t kept = nodes[child].offset + 1 - g;
+            double change = surroundingBox(nodes[other].box, nodes[kept].box).surfaceArea() -
+                            nodes[child].box.surfaceArea();
+            if (change < best)
+            {
+                best = change;
+                moved = other;
+                grandchild = nodes[child].offset + g;
+                middle = child;
+            }
+        }
+    }
+    if (best < 0)
+    {
+        swapNodes(moved, grandchild);
+        updateNode(middle);
+    }
+}
+
+void BVHNode::refitUpwards(uint32_t index)
+{
+    for (; index != BVH_NO_NODE; index = parents[index])
+    {
+        rotate(index);
+        updateNode(index);
+    }
+}
+
+// the node whose box, grown by `box`, adds the least area summed over
+//  it and its ancestors; a branch and bound search, best first
+uint32_t BVHNode::findSibling(const AABB &box) const
+{
+    double area = box.surfaceArea();
+    uint32_t best = 0;
+    double best_cost = surroundingBox(nodes[0].box, box).surfaceArea();
+
+    // (lower bound on the cost in the subtree, growth of the ancestors)
+    using Candidate = std::pair<double, std::pair<uint32_t, double>>;
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> queue;
+    queue.push({area, {0, 0.0}});
+    while (!queue.empty())
+    {
+        auto bound = queue.top().first;
+        auto index = queue.top().second.first;
+        auto inherited = queue.top().second.second;
+        queue.pop();
+        if (bound >= best_cost)
+            break;
+
+        const auto &node = nodes[index];
+        double grown = surroundingBox(node.box, box).surfaceArea();
+        if (grown + inherited < best_cost)
+        {
+            best_cost = grown + inherited;
+            best = index;
+        }
+        inherited += grown - node.box.surfaceArea();
+        if (node.count == 0 && area + inherited < best_cost)
+        {
+            queue.push({area + inherited, {node.offset, inherited}});
+            queue.push({area + inherited, {node.offset + 1, inherited}});
+        }
+    }
+    return best;
+}
+
+// a slot holding the object in a leaf that overlaps its box
+uint32_t BVHNode::findSlot(const Hittable *object, const AABB &box) const
+{
+    if (nodes.empty())
+        return BVH_NO_NODE;
+
+    uint32_t stack[BVH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        const auto &node = nodes[stack[--top]];
+        AABB overlap;
+        if (!overlapBox(node.box, box, overlap))
+            continue;
+        if (node.count > 0)
+        {
+            for (uint32_t s = node.offset; s < node.offset + node.count; ++s)
+                if (primitives[s].get() == object)
+                    return s;
+        }
+        else
+        {
+            stack[top++] = node.offset;
+            stack[top++] = node.offset + 1;
+        }
+    }
+    return BVH_NO_NODE;
+}
+
+void BVHNode::removeSlot(uint32_t slot)
+{
+    uint32_t leaf = leaf_of[slot];
+    auto &node = nodes[leaf];
+    uint32_t last = node.offset + node.count - 1;
+    std::swap(primitives[slot], primitives[last]);
+    primitives[last] = nullptr;
+    free_slots.push_back(last);
+    // packed again without the last slot, even if that empties it
+    typed.updateLeaf(primitives, node.offset, last, last + 1);
+
+    if (--node.count > 0)
+    {
+        for (uint32_t s = node.offset; s < node.offset + node.count; ++s)
+        {
+            AABB prim_box;
+            primitives[s]->boundingBox(time0, time1, prim_box);
+            node.box = s > node.offset ? surroundingBox(node.box, prim_box) : prim_box;
+        }
+        refitUpwards(parents[leaf]);
+        return;
+    }
+
+    if (leaf == 0)
+    {
+        std::vector<shared_ptr<Hittable>> none;
+        *this = BVHNode(none, 0, 0, time0, time1, options);
+        return;
+    }
+
+    // the sibling takes the place of the parent, freeing both children
+    uint32_t parent = parents[leaf];
+    uint32_t pair = nodes[parent].offset;
+    uint32_t sibling = leaf == pair ? pair + 1 : pair;
+    nodes[parent] = nodes[sibling];
+    heights[parent] = heights[sibling];
+    adopt(parent);
+    for (uint32_t i = pair; i < pair + 2; ++i)
+    {
+        nodes[i] = BVHLinearNode();
+        nodes[i].box = AABB(Point3(0, 0, 0), Point3(0, 0, 0));
+        nodes[i].offset = 0;
+        nodes[i].count = 0;
+    }
+    free_pairs.push_back(pair);
+    refitUpwards(parents[parent]);
 }
@@ -0,0 +1,498 @@
+// BVH construction, shared by every BVH flavour
+
+#pragma once
+
+#include <cstdlib>
+#include <new>
+#include <string>
+
+#include "raytracer.h"
+#include "aabb.hpp"
+
+enum class BVHBuildMethod
+{
+    SAH,     // binned SAH, the best trees
+    Morton,  // linear BVH over sorted Morton codes, the fastest builds
+    Spatial  // SAH with spatial splits, for heavily overlapping boxes
+};
+
+struct BVHBuildOptions
+{
+    int n_bins = 16;             // SAH buckets per axis
+    int max_leaf_size = 4;       // larger ranges are always split
+    double traversal_cost = 1.0; // cost of visiting one node,
+    double intersect_cost = 1.0; //  relative to one primitive test
+
+    // ranges with at least this many primitives are binned and
+    //  partitioned by several OpenMP tasks, and their children
+    //  are built as separate tasks
+    size_t parallel_threshold = 4096;
+
+    BVHBuildMethod method = BVHBuildMethod::SAH;
+    int treelet_passes = 0; // Morton only: restructuring passes afterwards
+
+    // Spatial only: try a spatial split where the children of the best
+    //  object split overlap by more than this fraction of the root area,
+    //  as long as the references grow by at most spatial_budget times
+    //  the number of primitives
+    double spatial_alpha = 1e-5;
+    double spatial_budget = 1.0;
+
+    // refit() rebuilds once the SAH cost exceeds this many times
+    //  the cost right after the last build
+    double refit_tolerance = 1.5;
+
+    // if set, built trees are stored in and loaded from this directory
+    //  (see bvh_cache.hpp)
+    std::string cache_dir;
+
+    // copy spheres, rects and boxes into packed per-type leaf arrays
+    //  (see typed_leaves.hpp), at the cost of the memory for the copies
+    bool typed_leaves = true;
+};
+
+// bounds and centroid of one primitive, computed once before building
+struct BVHPrimitive
+{
+    AABB box;
+    Point3 centroid;
+    size_t index;
+};
+
+const size_t CACHE_LINE_SIZE = 64;
+
+// Allocates on cache line boundaries, so that a node array starts on
+//  a line; std::allocator only guarantees 16 bytes before C++17.
+template <typename T>
+struct CacheAlignedAllocator
+{
+    using value_type = T;
+
+    CacheAlignedAllocator() {}
+    template <typename U>
+    CacheAlignedAllocator(const CacheAlignedAllocator<U> &) {}
+
+    T *allocate(size_t n)
+    {
+        void *data = nullptr;
+        if (posix_memalign(&data, CACHE_LINE_SIZE, n * sizeof(T)) != 0)
+            throw std::bad_alloc();
+        return static_cast<T *>(data);
+    }
+
+    void deallocate(T *data, size_t) { free(data); }
+};
+
+template <typename T, typename U>
+bool operator==(const CacheAlignedAllocator<T> &, const CacheAlignedAllocator<U> &) { return true; }
+template <typename T, typename U>
+bool operator!=(const CacheAlignedAllocator<T> &, const CacheAlignedAllocator<U> &) { return false; }
+
+template <typename T>
+using AlignedVector = std::vector<T, CacheAlignedAllocator<T>>;
+
+// Nodes are stored depth-first in one array, with siblings adjacent:
+//  the children of an interior node are at `offset` and `offset + 1`,
+//  so a traversal step reads its two candidates from neighbouring lines.
+// A leaf refers to `count` primitives starting at `offset`.
+// Nodes are padded to one cache line each, and never straddle two.
+struct alignas(CACHE_LINE_SIZE) BVHLinearNode
+{
+    AABB box;
+    uint32_t offset;
+    uint16_t count; // 0 for interior nodes
+    uint8_t axis;   // split axis of interior nodes
+};
+
+const int BVH_STACK_SIZE = 64;
+
+// Builders produce a pointer tree first,
+//  because concurrent tasks cannot append to one array in order.
+// A node without children is a leaf of `count` primitives at `offset`.
+struct BVHBuildNode
+{
+    AABB box;
+    std::unique_ptr<BVHBuildNode> children[2];
+    uint32_t offset = 0, count = 0;
+    int axis = 0;
+    int height = 0;  // longest path down to a leaf
+    double cost = 0; // SAH cost of the subtree, times the box area
+
+    // recompute height and cost, given the box and the children
+    void update(const BVHBuildOptions &options)
+    {
+        if (!children[0])
+        {
+            height = 0;
+            cost = options.intersect_cost * count * box.surfaceArea();
+            return;
+        }
+        height = 1 + std::max(children[0]->height, children[1]->height);
+        cost = options.traversal_cost * box.surfaceArea() +
+               children[0]->cost + children[1]->cost;
+    }
+};
+
+// fill in the node at `index` and lay out its subtree after the end of `nodes`
+void flattenBVHNode(const BVHBuildNode *node, uint32_t index,
+                    AlignedVector<BVHLinearNode> &nodes)
+{
+    nodes[index].box = node->box;
+    if (!node->children[0])
+    {
+        nodes[index].offset = node->offset;
+        nodes[index].count = node->count;
+        return;
+    }
+
+    uint32_t first = nodes.size();
+    nodes.resize(first + 2);
+    nodes[index].offset = first;
+    nodes[index].count = 0;
+    nodes[index].axis = node->axis;
+    flattenBVHNode(node->children[0].get(), first, nodes);
+    flattenBVHNode(node->children[1].get(), first + 1, nodes);
+}
+
+// append the tree to `nodes` in depth-first order
+void flattenBVH(const BVHBuildNode *node, AlignedVector<BVHLinearNode> &nodes)
+{
+    uint32_t index = nodes.size();
+    nodes.emplace_back();
+    flattenBVHNode(node, index, nodes);
+}
+
+// binned SAH:
+// 1. bucket the centroids along each axis
+// 2. sweep the buckets to evaluate every candidate plane
+// 3. split at the cheapest plane, or make a leaf if that is cheaper
+//
+// Large ranges are binned and partitioned in chunks by OpenMP tasks,
+//  and both halves of a large range are built concurrently.
+// The tree does not depend on the number of threads.
+class BVHBuilder
+{
+private:
+    struct Bin
+    {
+        AABB box;
+        size_t count = 0;
+    };
+
+    struct Bounds
+    {
+        AABB box, centroid_box;
+    };
+
+    std::vector<BVHPrimitive> &prims;
+    std::vector<BVHPrimitive> scratch; // same size as prims
+    BVHBuildOptions options;
+    int n_bins;
+    size_t max_leaf_size;
+
+    static const size_t CHUNK_SIZE = 1024;
+
+    size_t chunkCount(size_t span) const
+    {
+        if (span < options.parallel_threshold)
+            return 1;
+        return std::min<size_t>(64, (span + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    }
+
+    Bounds computeBounds(size_t start, size_t end) const;
+    void computeBins(size_t start, size_t end, const AABB &centroid_box,
+                     std::vector<Bin> &bins) const;
+    template <typename Pred>
+    size_t partition(size_t start, size_t end, Pred pred);
+
+    std::unique_ptr<BVHBuildNode> buildRecursive(size_t start, size_t end, int depth);
+
+public:
+    BVHBuilder(std::vector<BVHPrimitive> &prims,
+               const BVHBuildOptions &options)
+        : prims(prims), options(options)
+    {
+        n_bins = std::max(options.n_bins, 2);
+        max_leaf_size = std::max(1, std::min(options.max_leaf_size, 0xffff));
+    }
+
+    // Appends the tree to `nodes` and reorders `prims` to leaf order.
+    void build(AlignedVector<BVHLinearNode> &nodes);
+};
+
+void BVHBuilder::build(AlignedVector<BVHLinearNode> &nodes)
+{
+    if (prims.empty())
+        return;
+    scratch.resize(prims.size());
+
+    std::unique_ptr<BVHBuildNode> root;
+#pragma omp parallel if (prims.size() >= options.parallel_threshold)
+#pragma omp single
+    root = buildRecursive(0, prims.size(), 0);
+
+    scratch.clear();
+    scratch.shrink_to_fit();
+    nodes.reserve(nodes.size() + 2 * prims.size());
+    flattenBVH(root.get(), nodes);
+}
+
+BVHBuilder::Bounds BVHBuilder::computeBounds(size_t start, size_t end) const
+{
+    size_t n_chunks = chunkCount(end - start);
+    std::vector<Bounds> partial(n_chunks);
+
+    for (size_t c = 0; c < n_chunks; ++c)
+    {
+#pragma omp task shared(partial) if (n_chunks > 1)
+        {
+            size_t lo = start + (end - start) * c / n_chunks;
+            size_t hi = start + (end - start) * (c + 1) / n_chunks;
+            Bounds b{prims[lo].box, AABB(prims[lo].centroid, prims[lo].centroid)};
+            for (size_t i = lo + 1; i < hi; ++i)
+            {
+                b.box = surroundingBox(b.box, prims[i].box);
+                b.centroid_box = surroundingBox(b.centroid_box, prims[i].centroid);
+            }
+            partial[c] = b;
+        }
+    }
+#pragma omp taskwait
+
+    Bounds result = partial[0];
+    for (size_t c = 1; c < n_chunks; ++c)
+    {
+        result.box = surroundingBox(result.box, partial[c].box);
+        result.centroid_box = surroundingBox(result.centroid_box, partial[c].centroid_box);
+    }
+    return result;
+}
+
+inline int binIndex(const BVHPrimitive &prim, const AABB &centroid_box,
+                    int axis, int n_bins)
+{
+    auto lo = centroid_box.min()[axis];
+    auto extent = centroid_box.max()[axis] - lo;
+    int b = static_cast<int>(n_bins * ((prim.centroid[axis] - lo) / extent));
+    return std::min(b, n_bins - 1);
+}
+
+// bins[axis * n_bins + b]: bucket b along axis
+void BVHBuilder::computeBins(size_t start, size_t end, const AABB &centroid_box,
+                             std::vector<Bin> &bins) const
+{
+    size_t n_chunks = chunkCount(end - start);
+    std::vector<std::vector<Bin>> partial(n_chunks);
+
+    for (size_t c = 0; c < n_chunks; ++c)
+    {
+#pragma omp task shared(partial) if (n_chunks > 1)
+        {
+            size_t lo = start + (end - start) * c / n_chunks;
+            size_t hi = start + (end - start) * (c + 1) / n_chunks;
+            auto &local = partial[c];
+            local.resize(3 * n_bins);
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                if (centroid_box.max()[axis] <= centroid_box.min()[axis])
+                    continue;
+                for (size_t i = lo; i < hi; ++i)
+                {
+                    auto &bin = local[axis * n_bins +
+                                      binIndex(prims[i], centroid_box, axis, n_bins)];
+                    bin.box = bin.count++ ? surroundingBox(bin.box, prims[i].box)
+                                          : prims[i].box;
+                }
+            }
+        }
+    }
+#pragma omp taskwait
+
+    bins = std::move(partial[0]);
+    for (size_t c = 1; c < n_chunks; ++c)
+        for (size_t b = 0; b < bins.size(); ++b)
+        {
+            const auto &other = partial[c][b];
+            if (!other.count)
+                continue;
+            bins[b].box = bins[b].count ? surroundingBox(bins[b].box, other.box)
+                                        : other.box;
+            bins[b].count += other.count;
+        }
+}
+
+// Large ranges are partitioned through the scratch buffer:
+//  count each chunk, then scatter both sides to their final place.
+// Which path runs depends only on the size of the range,
+//  never on the number of threads.
+template <typename Pred>
+size_t BVHBuilder::partition(size_t start, size_t end, Pred pred)
+{
+    size_t n_chunks = chunkCount(end - start);
+    if (n_chunks == 1)
+        return std::partition(prims.begin() + start, prims.begin() + end, pred) -
+               prims.begin();
+
+    std::vector<size_t> left_count(n_chunks + 1, 0);
+
+    auto chunkBegin = [&](size_t c)
+    { return start + (end - start) * c / n_chunks; };
+
+    for (size_t c = 0; c < n_chunks; ++c)
+    {
+#pragma omp task shared(left_count)
+        for (size_t i = chunkBegin(c); i < chunkBegin(c + 1); ++i)
+            left_count[c + 1] += pred(prims[i]);
+    }
+#pragma omp taskwait
+
+    // prefix sums: left side of chunk c starts at left_count[c]
+    for (size_t c = 0; c < n_chunks; ++c)
+        left_count[c + 1] += left_count[c];
+    size_t mid = start + left_count[n_chunks];
+
+    for (size_t c = 0; c < n_chunks; ++c)
+    {
+#pragma omp task shared(left_count)
+        {
+            size_t l = start + left_count[c];
+            size_t r = mid + (chunkBegin(c) - start) - left_count[c];
+            for (size_t i = chunkBegin(c); i < chunkBegin(c + 1); ++i)
+                scratch[pred(prims[i]) ? l++ : r++] = prims[i];
+        }
+    }
+#pragma omp taskwait
+
+    for (size_t c = 0; c < n_chunks; ++c)
+    {
+#pragma omp task
+        std::copy(scratch.begin() + chunkBegin(c), scratch.begin() + chunkBegin(c + 1),
+                  prims.begin() + chunkBegin(c));
+    }
+#pragma omp taskwait
+
+    return mid;
+}
+
+std::unique_ptr<BVHBuildNode>
+BVHBuilder::buildRecursive(size_t start, size_t end, int depth)
+{
+    std::unique_ptr<BVHBuildNode> node(new BVHBuildNode());
+    size_t object_span = end - start;
+
+    auto bounds = computeBounds(start, end);
+    const auto &centroid_box = bounds.centroid_box;
+    node->box = bounds.box;
+
+    double leaf_cost = options.intersect_cost * object_span;
+    int best_axis = -1, best_bin = 0;
+    double best_cost = INF;
+
+    if (object_span > 1)
+    {
+        std::vector<Bin> bins;
+        computeBins(start, end, centroid_box, bins);
+
+        std::vector<double> right_area(n_bins);
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (centroid_box.max()[axis] <= centroid_box.min()[axis])
+                continue;
+            const Bin *bin = &bins[axis * n_bins];
+
+            // right_area[b]: area of buckets (b, n_bins)
+            AABB acc;
+            bool empty = true;
+            for (int b = n_bins - 1; b > 0; --b)
+            {
+                if (bin[b].count)
+                {
+                    acc = empty ? bin[b].box : surroundingBox(acc, bin[b].box);
+                    empty = false;
+                }
+                right_area[b - 1] = empty ? 0 : acc.surfaceArea();
+            }
+
+            empty = true;
+            size_t left_count = 0;
+            for (int b = 0; b < n_bins - 1; ++b)
+            {
+                if (bin[b].count)
+                {
+                    acc = empty ? bin[b].box : surroundingBox(acc, bin[b].box);
+                    empty = false;
+                }
+                left_count += bin[b].count;
+                if (left_count == 0 || left_count == object_span)
+                    continue;
+
+                double split_cost =
+                    acc.surfaceArea() * left_count +
+                    right_area[b] * (object_span - left_count);
+                if (split_cost < best_cost)
+                {
+                    best_cost = split_cost;
+                    best_axis = axis;
+                    best_bin = b;
+                }
+            }
+        }
+    }
+
+    if (best_axis != -1)
+        best_cost = options.traversal_cost +
+                    options.intersect_cost * best_cost / node->box.surfaceArea();
+
+    if (object_span <= max_leaf_size && leaf_cost <= best_cost)
+    {
+        node->offset = start;
+        node->count = object_span;
+        node->update(options);
+        return node;
+    }
+
+    size_t mid;
+    if (depth >= BVH_STACK_SIZE - 32)
+    {
+        // too deep for the traversal stack,
+        //  halve the rest so that it needs at most 32 more levels
+        best_axis = centroid_box.maxExtent();
+        mid = start + object_span / 2;
+        std::nth_element(
+            prims.begin() + start, prims.begin() + mid, prims.begin() + end,
+            [=](const BVHPrimitive &lhs, const BVHPrimitive &rhs)
+            {
+                if (lhs.centroid[best_axis] != rhs.centroid[best_axis])
+                    return lhs.centroid[best_axis] < rhs.centroid[best_axis];
+                return lhs.index < rhs.index;
+            });
+    }
+    else if (best_axis != -1)
+    {
+        mid = partition(
+            start, end, [&](const BVHPrimitive &prim)
+            { return binIndex(prim, centroid_box, best_axis, n_bins) <= best_bin; });
+    }
+    else
+    {
+        // all centroids coincide, and there are too many for a leaf
+        best_axis = 0;
+        mid = start + object_span / 2;
+    }
+
+    node->axis = best_axis;
+    if (object_span >= options.parallel_threshold)
+    {
+#pragma omp task shared(node)
+        node->children[0] = buildRecursive(start, mid, depth + 1);
+        node->children[1] = buildRecursive(mid, end, depth + 1);
+#pragma omp taskwait
+    }
+    else
+    {
+        node->children[0] = buildRecursive(start, mid, depth + 1);
+        node->children[1] = buildRecursive(mid, end, depth + 1);
+    }
+    node->update(options);
+    return node;
+}
@@ -0,0 +1,229 @@
+// On-disk cache of built BVHs.
+//
+// The builders are deterministic, so a tree only depends on the primitive
+//  boxes and the build options (and, for spatial splits, on the primitive
+//  types). A hash of those names the file, which stores the node array
+//  and the leaf order of the primitives, ready to be used as they are.
+//
+// Layout: BVHCacheHeader, nodes, then one uint32_t index per reference,
+//  padded with zeros to a multiple of 8 bytes.
+// Files are written to a temporary name and renamed, so a concurrent
+//  reader never sees a partial file.
+
+#pragma once
+
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <typeinfo>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "raytracer.h"
+#include "hittable.h"
+#include "bvh_build.hpp"
+
+const uint32_t BVH_CACHE_VERSION = 2;
+const uint64_t BVH_HASH_SEED = 0xcbf29ce484222325ull; // FNV offset basis
+
+struct BVHCacheHeader
+{
+    char magic[8];       // "RTBVH" followed by zeros
+    uint32_t version;    // BVH_CACHE_VERSION
+    uint32_t byte_order; // 0x01020304 as written
+    uint32_t node_size;  // sizeof(BVHLinearNode)
+    uint32_t reserved;
+    uint64_t hash;
+    uint64_t n_nodes;
+    uint64_t n_refs;
+    uint64_t checksum; // hashWords() of everything after the header
+};
+
+// 64-bit FNV-1a, one word at a time
+inline uint64_t hashWords(uint64_t hash, const void *data, size_t n_words)
+{
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < n_words; ++i)
+    {
+        uint64_t word;
+        std::memcpy(&word, bytes + 8 * i, 8);
+        hash = (hash ^ word) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+inline uint64_t hashString(uint64_t hash, const char *s)
+{
+    for (; *s; ++s)
+        hash = (hash ^ static_cast<unsigned char>(*s)) * 0x100000001b3ull;
+    return hash;
+}
+
+// everything the tree built over prims depends on
+uint64_t bvhContentHash(const std::vector<BVHPrimitive> &prims,
+                        const std::vector<shared_ptr<Hittable>> &objects,
+                        const BVHBuildOptions &options)
+{
+    uint64_t hash = BVH_HASH_SEED;
+    uint64_t settings[] = {
+        BVH_CACHE_VERSION, sizeof(BVHLinearNode),
+        static_cast<uint64_t>(options.method),
+        static_cast<uint64_t>(options.n_bins),
+        static_cast<uint64_t>(options.max_leaf_size),
+        static_cast<uint64_t>(options.treelet_passes),
+        prims.size()};
+    double costs[] = {options.traversal_cost, options.intersect_cost,
+                      options.spatial_alpha, options.spatial_budget};
+    hash = hashWords(hash, settings, sizeof(settings) / 8);
+    hash = hashWords(hash, costs, sizeof(costs) / 8);
+
+    for (const auto &prim : prims)
+    {
+        double bounds[] = {prim.box.min().x(), prim.box.min().y(), prim.box.min().z(),
+                           prim.box.max().x(), prim.box.max().y(), prim.box.max().z()};
+        hash = hashWords(hash, bounds, 6);
+        // spatial splits clip the actual geometry
+        if (options.method == BVHBuildMethod::Spatial)
+            hash = hashString(hash, typeid(*objects[prim.index]).name());
+    }
+    return hash;
+}
+
+inline size_t bvhCachePayloadSize(size_t n_nodes, size_t n_refs)
+{
+    size_t size = n_nodes * sizeof(BVHLinearNode) + n_refs * sizeof(uint32_t);
+    return (size + 7) / 8 * 8;
+}
+
+inline std::string bvhCachePath(const std::string &dir, uint64_t hash)
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "/%016llx.bvh",
+                  static_cast<unsigned long long>(hash));
+    return dir + name;
+}
+
+// Maps the file and copies the nodes and leaf order out of it.
+// Returns false, leaving the output alone, if the file is missing,
+//  was written for other content or another version, or is malformed.
+bool loadBVHCache(const std::string &path, uint64_t hash, size_t n_prims,
+                  AlignedVector<BVHLinearNode> &nodes, std::vector<uint32_t> &order)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(BVHCacheHeader))
+    {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    const char *bytes = static_cast<const char *>(data);
+    BVHCacheHeader header;
+    std::memcpy(&header, bytes, sizeof(header));
+
+    bool valid = std::memcmp(header.magic, "RTBVH\0\0\0", 8) == 0 &&
+                 header.version == BVH_CACHE_VERSION &&
+                 header.byte_order == 0x01020304 &&
+                 header.node_size == sizeof(BVHLinearNode) &&
+                 header.hash == hash &&
+                 header.n_nodes > 0 && header.n_refs >= n_prims &&
+                 size == sizeof(header) + bvhCachePayloadSize(header.n_nodes, header.n_refs) &&
+                 hashWords(BVH_HASH_SEED, bytes + sizeof(header),
+                           (size - sizeof(header)) / 8) == header.checksum;
+
+    AlignedVector<BVHLinearNode> loaded_nodes;
+    std::vector<uint32_t> loaded_order;
+    if (valid)
+    {
+        loaded_nodes.resize(header.n_nodes);
+        loaded_order.resize(header.n_refs);
+        std::memcpy(loaded_nodes.data(), bytes + sizeof(header),
+                    header.n_nodes * sizeof(BVHLinearNode));
+        std::memcpy(loaded_order.data(),
+                    bytes + sizeof(header) + header.n_nodes * sizeof(BVHLinearNode),
+                    header.n_refs * sizeof(uint32_t));
+
+        // never trust an index that could send traversal out of bounds,
+        //  or back up the tree: children always follow their parent
+        //  (in 64 bits, so an offset near 2^32 cannot wrap past the check)
+        for (size_t i = 0; i < header.n_nodes; ++i)
+        {
+            const auto &node = loaded_nodes[i];
+            if (node.count ? static_cast<uint64_t>(node.offset) + node.count > header.n_refs
+                           : node.offset <= i || static_cast<uint64_t>(node.offset) + 1 >= header.n_nodes)
+                valid = false;
+        }
+        for (auto index : loaded_order)
+            if (index >= n_prims)
+                valid = false;
+
+        // nor a tree deeper than the traversal stack; as children follow
+        //  their parent, one pass in order sees every parent first
+        std::vector<uint32_t> depth(valid ? header.n_nodes : 0, 0);
+        for (size_t i = 0; valid && i < header.n_nodes; ++i)
+        {
+            const auto &node = loaded_nodes[i];
+            if (node.count)
+                continue;
+            if (depth[i] >= BVH_STACK_SIZE - 1)
+                valid = false;
+            for (uint32_t child = node.offset; child < node.offset + 2; ++child)
+                depth[child] = std::max(depth[child], depth[i] + 1);
+        }
+    }
+    munmap(data, size);
+
+    if (!valid)
+        return false;
+    nodes.swap(loaded_nodes);
+    order.swap(loaded_order);
+    return true;
+}
+
+bool saveBVHCache(const std::string &path, uint64_t hash,
+                  const AlignedVector<BVHLinearNode> &nodes,
+                  const std::vector<uint32_t> &order)
+{
+    BVHCacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "RTBVH", 5);
+    header.version = BVH_CACHE_VERSION;
+    header.byte_order = 0x01020304;
+    header.node_size = sizeof(BVHLinearNode);
+    header.hash = hash;
+    header.n_nodes = nodes.size();
+    header.n_refs = order.size();
+
+    std::vector<char> payload(bvhCachePayloadSize(nodes.size(), order.size()), 0);
+    std::memcpy(payload.data(), nodes.data(), nodes.size() * sizeof(BVHLinearNode));
+    std::memcpy(payload.data() + nodes.size() * sizeof(BVHLinearNode),
+                order.data(), order.size() * sizeof(uint32_t));
+    header.checksum = hashWords(BVH_HASH_SEED, payload.data(), payload.size() / 8);
+
+    auto temp_path = path + "." + std::to_string(getpid()) + ".tmp";
+    FILE *file = std::fopen(temp_path.c_str(), "wb");
+    if (!file)
+    {
+        std::cerr << "[ERROR]: Cannot write BVH cache " << temp_path << ".\n";
+        return false;
+    }
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+              std::fwrite(payload.data(), 1, payload.size(), file) == payload.size();
+    ok = std::fclose(file) == 0 && ok;
+    if (!ok || std::rename(temp_path.c_str(), path.c_str()) != 0)
+    {
+        std::remove(temp_path.c_str());
+        std::cerr << "[ERROR]: Cannot write BVH cache " << path << ".\n";
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,272 @@
+// Motion blur BVH: every child box is stored at shutter open and at
+//  shutter close, and traversal interpolates the two at the ray's time.
+// A moving primitive then only widens its ancestors by where it is at
+//  that time, not by everywhere it goes while the shutter is open.
+//
+// Interpolation is exact for primitives whose box moves linearly,
+//  like MovingSphere; others are not supported.
+
+#pragma once
+
+#include <cfloat>
+
+#include "raytracer.h"
+#include "hittable.h"
+#include "hittable_list.hpp"
+#include "aabb.hpp"
+#include "bvh_wide.hpp"
+
+// `bounds` at shutter open, laid out like WideBVHNode::bounds,
+//  and `delta` from there to shutter close.
+// Unused lanes have the inverted box (FLT_MAX, -FLT_MAX) and no delta.
+template <int N>
+struct alignas(CACHE_LINE_SIZE) MotionBVHNode
+{
+    float bounds[2][3][N];
+    float delta[2][3][N];
+    uint32_t child[N];
+    uint32_t count[N];
+};
+
+// Both times are pushed out by a few units in the last place of the
+//  larger one, which covers the rounding of delta and of the interpolation.
+template <int N>
+inline void setChildBox(MotionBVHNode<N> &node, int k,
+                        const AABB &open, const AABB &close)
+{
+    for (int a = 0; a < 3; ++a)
+    {
+        auto magnitude = roundUp(fmax(fmax(fabs(open.min()[a]), fabs(close.min()[a])),
+                                      fmax(fabs(open.max()[a]), fabs(close.max()[a]))));
+        double pad = 4.0 * (std::nextafter(magnitude, FLT_MAX) - magnitude);
+        node.bounds[0][a][k] = roundDown(open.min()[a] - pad);
+        node.bounds[1][a][k] = roundUp(open.max()[a] + pad);
+        node.delta[0][a][k] = roundDown(close.min()[a] - pad) - node.bounds[0][a][k];
+        node.delta[1][a][k] = roundUp(close.max()[a] + pad) - node.bounds[1][a][k];
+    }
+}
+
+template <int N>
+inline int intersectChildren(const MotionBVHNode<N> &node, const WideBVHRay &ray,
+                             float t_min, float t_max, float *t_near)
+{
+    int mask = 0;
+    for (int k = 0; k < N; ++k)
+    {
+        float t0 = t_min, t1 = t_max;
+        for (int a = 0; a < 3; ++a)
+        {
+            float bound[2];
+            for (int side = 0; side < 2; ++side)
+                bound[side] = node.bounds[side][a][k] + node.delta[side][a][k] * ray.time;
+            float near = (bound[ray.dir_neg[a]] - ray.origin[a]) * ray.inv_d[a];
+            float far = (bound[1 - ray.dir_neg[a]] - ray.origin[a]) * ray.inv_d[a] * WIDE_BVH_WIDEN;
+            t0 = near > t0 ? near : t0;
+            t1 = far < t1 ? far : t1;
+        }
+        t_near[k] = t0;
+        mask |= (t0 <= t1) << k;
+    }
+    return mask;
+}
+
+#if defined(__SSE__)
+template <>
+inline int intersectChildren<4>(const MotionBVHNode<4> &node, const WideBVHRay &ray,
+                                float t_min, float t_max, float *t_near)
+{
+    __m128 t0 = _mm_set1_ps(t_min);
+    __m128 t1 = _mm_set1_ps(t_max);
+    __m128 widen = _mm_set1_ps(WIDE_BVH_WIDEN);
+    __m128 time = _mm_set1_ps(ray.time);
+    for (int a = 0; a < 3; ++a)
+    {
+        __m128 bound[2];
+        for (int side = 0; side < 2; ++side)
+            bound[side] = _mm_add_ps(_mm_loadu_ps(node.bounds[side][a]),
+                                     _mm_mul_ps(_mm_loadu_ps(node.delta[side][a]), time));
+        __m128 o = _mm_set1_ps(ray.origin[a]);
+        __m128 inv_d = _mm_set1_ps(ray.inv_d[a]);
+        __m128 near = _mm_mul_ps(_mm_sub_ps(bound[ray.dir_neg[a]], o), inv_d);
+        __m128 far = _mm_mul_ps(_mm_mul_ps(
+            _mm_sub_ps(bound[1 - ray.dir_neg[a]], o), inv_d), widen);
+        t0 = _mm_max_ps(near, t0);
+        t1 = _mm_min_ps(far, t1);
+    }
+    _mm_storeu_ps(t_near, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+#endif
+
+template <int N>
+class MotionBVH : public Accelerator
+{
+private:
+    AlignedVector<MotionBVHNode<N>> nodes;
+    std::vector<shared_ptr<Hittable>> primitives; // in leaf order
+    TypedLeaves typed;
+    double time0 = 0, time1 = 0;
+    double inv_span = 0;
+    AABB box; // over the whole shutter interval
+    bool has_box = false;
+
+    // returns the boxes of the whole node at time0 and time1
+    void refitNode(uint32_t index, AABB &open, AABB &close, int depth);
+
+public:
+    MotionBVH() {}
+
+    // the tree is built over the boxes at mid-shutter
+    MotionBVH(HittableList &list, double time0, double time1,
+              const BVHBuildOptions &options = BVHBuildOptions())
+        : MotionBVH(WideBVH<N>(list, (time0 + time1) / 2, (time0 + time1) / 2, options),
+                    time0, time1) {}
+
+    MotionBVH(const WideBVH<N> &bvh, double time0, double time1);
+
+    // Recompute both sets of boxes for another shutter interval.
+    void refit(double time0, double time1);
+
+    bool hit(const Ray &r, double t_min,
+             double t_max, HitRecord &rec) const override
+    {
+        if (nodes.empty())
+            return false;
+
+        double time = (r.time() - time0) * inv_span;
+        if (time >= 0 && time <= 1)
+            return traverseWideBVH<N>(nodes, primitives, typed, r, t_min, t_max, rec,
+                                      static_cast<float>(time));
+
+        // the boxes only hold between the two times
+        bool hit_anything = false;
+        for (const auto &object : primitives)
+            if (object && object->hit(r, t_min, t_max, rec))
+            {
+                hit_anything = true;
+                t_max = rec.t;
+            }
+        return hit_anything;
+    }
+
+    bool occluded(const Ray &r, double t_min, double t_max) const override
+    {
+        if (nodes.empty())
+            return false;
+
+        double time = (r.time() - time0) * inv_span;
+        if (time >= 0 && time <= 1)
+            return occludedWideBVH<N>(nodes, primitives, typed, r, t_min, t_max,
+                                      static_cast<float>(time));
+
+        for (const auto &object : primitives)
+            if (object && object->occluded(r, t_min, t_max))
+                return true;
+        return false;
+    }
+
+    bool boundingBox(double t0, double t1,
+                     AABB &output_box) const override
+    {
+        output_box = box;
+        return has_box;
+    }
+
+    size_t memoryUsage() const override
+    {
+        return nodes.capacity() * sizeof(MotionBVHNode<N>) +
+               primitives.capacity() * sizeof(shared_ptr<Hittable>) +
+               typed.memoryUsage();
+    }
+};
+
+using MotionBVH4 = MotionBVH<4>;
+using MotionBVH8 = MotionBVH<8>;
+
+template <int N>
+MotionBVH<N>::MotionBVH(const WideBVH<N> &bvh, double time0, double time1)
+    : primitives(bvh.primitives), typed(bvh.typed)
+{
+    if (bvh.nodes.empty())
+        return;
+
+    nodes.resize(bvh.nodes.size());
+    for (size_t i = 0; i < nodes.size(); ++i)
+        for (int k = 0; k < N; ++k)
+        {
+            nodes[i].child[k] = bvh.nodes[i].child[k];
+            nodes[i].count[k] = bvh.nodes[i].count[k];
+        }
+    refit(time0, time1);
+}
+
+template <int N>
+void MotionBVH<N>::refit(double time0, double time1)
+{
+    this->time0 = time0;
+    this->time1 = time1;
+    inv_span = time1 > time0 ? 1 / (time1 - time0) : 0;
+    if (nodes.empty())
+        return;
+
+    AABB open, close;
+#pragma omp parallel if (primitives.size() >= BVHBuildOptions().parallel_threshold)
+#pragma omp single
+    refitNode(0, open, close, 0);
+    box = surroundingBox(open, close);
+    has_box = true;
+}
+
+template <int N>
+void MotionBVH<N>::refitNode(uint32_t index, AABB &open, AABB &close, int depth)
+{
+    auto &node = nodes[index];
+    AABB child_open[N], child_close[N];
+    bool used[N];
+    for (int k = 0; k < N; ++k)
+    {
+        // lane 0 of the root is never a child, so this marks unused lanes
+        used[k] = node.child[k] || node.count[k];
+        if (!used[k])
+            continue;
+
+        if (node.count[k] > 0)
+        {
+            for (uint32_t i = 0; i < node.count[k]; ++i)
+            {
+                AABB prim_open, prim_close;
+                const auto &object = primitives[node.child[k] + i];
+                if (!object->boundingBox(time0, time0, prim_open) ||
+                    !object->boundingBox(time1, time1, prim_close))
+                    std::cerr << "[ERROR]: No bounding box in MotionBVH::refit.\n";
+                child_open[k] = i ? surroundingBox(child_open[k], prim_open) : prim_open;
+                child_close[k] = i ? surroundingBox(child_close[k], prim_close) : prim_close;
+            }
+        }
+        else
+        {
+#pragma omp task shared(child_open, child_close) if (depth < 4)
+            refitNode(node.child[k], child_open[k], child_close[k], depth + 1);
+        }
+    }
+#pragma omp taskwait
+
+    bool first = true;
+    for (int k = 0; k < N; ++k)
+    {
+        if (!used[k])
+        {
+            for (int a = 0; a < 3; ++a)
+            {
+                node.bounds[0][a][k] = FLT_MAX;
+                node.bounds[1][a][k] = -FLT_MAX;
+                node.delta[0][a][k] = node.delta[1][a][k] = 0;
+            }
+            continue;
+        }
+        setChildBox(node, k, child_open[k], child_close[k]);
+        open = first ? child_open[k] : surroundingBox(open, child_open[k]);
+        close = first ? child_close[k] : surroundingBox(close, child_close[k]);
+        first = false;
+    }
+}
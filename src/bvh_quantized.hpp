@@ -0,0 +1,238 @@
+// Quantized wide BVH: child boxes are stored as 8- or 16-bit offsets
+//  on a grid spanning the parent box, after Ylitie et al.,
+//  "Efficient Incoherent Ray Traversal on GPUs Through Compressed
+//  Wide BVHs", 2017.
+//
+// A QuantizedBVH<4> node is 64 bytes, half of a WideBVHNode<4>.
+// The tree is a converted WideBVH and has no refit of its own:
+//  refit the WideBVH and convert it again.
+
+#pragma once
+
+#include <cstring>
+
+#include "raytracer.h"
+#include "hittable.h"
+#include "hittable_list.hpp"
+#include "aabb.hpp"
+#include "bvh_wide.hpp"
+
+// Child k covers origin + lo * 2^exponent .. origin + hi * 2^exponent
+//  along each axis, rounded outwards; a power of two step makes
+//  q * step exact, so the box decodes the same way everywhere.
+// Unused lanes have lo > hi and never hit.
+// Nodes are not padded to whole cache lines, which would undo most of
+//  the compression; the 4-wide 8-bit node fills exactly one.
+template <int N, typename Q>
+struct QuantizedBVHNode
+{
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t pad;
+    Q lo[3][N];
+    Q hi[3][N];
+    uint32_t child[N];
+    uint16_t count[N];
+};
+
+// 2^exponent as a float, built from its bits
+inline float exp2Float(int exponent)
+{
+    uint32_t bits = static_cast<uint32_t>(exponent + 127) << 23;
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+template <int N, typename Q>
+inline int intersectChildren(const QuantizedBVHNode<N, Q> &node, const WideBVHRay &ray,
+                             float t_min, float t_max, float *t_near)
+{
+    float scale[3];
+    for (int a = 0; a < 3; ++a)
+        scale[a] = exp2Float(node.exponent[a]);
+
+    int mask = 0;
+    for (int k = 0; k < N; ++k)
+    {
+        float t0 = t_min, t1 = t_max;
+        for (int a = 0; a < 3; ++a)
+        {
+            float lo = node.origin[a] + node.lo[a][k] * scale[a];
+            float hi = node.origin[a] + node.hi[a][k] * scale[a];
+            float near = ((ray.dir_neg[a] ? hi : lo) - ray.origin[a]) * ray.inv_d[a];
+            float far = ((ray.dir_neg[a] ? lo : hi) - ray.origin[a]) * ray.inv_d[a] * WIDE_BVH_WIDEN;
+            t0 = near > t0 ? near : t0;
+            t1 = far < t1 ? far : t1;
+        }
+        t_near[k] = t0;
+        mask |= (t0 <= t1) << k;
+    }
+    return mask;
+}
+
+#if defined(__SSE2__)
+// widen four unsigned 8- or 16-bit values to floats
+inline __m128 loadQuantized(const uint8_t *q)
+{
+    int32_t packed;
+    std::memcpy(&packed, q, 4);
+    __m128i zero = _mm_setzero_si128();
+    __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero);
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+}
+
+inline __m128 loadQuantized(const uint16_t *q)
+{
+    __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(q));
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, _mm_setzero_si128()));
+}
+
+template <typename Q>
+inline int intersectChildren(const QuantizedBVHNode<4, Q> &node, const WideBVHRay &ray,
+                             float t_min, float t_max, float *t_near)
+{
+    __m128 t0 = _mm_set1_ps(t_min);
+    __m128 t1 = _mm_set1_ps(t_max);
+    __m128 widen = _mm_set1_ps(WIDE_BVH_WIDEN);
+    for (int a = 0; a < 3; ++a)
+    {
+        __m128 origin = _mm_set1_ps(node.origin[a]);
+        __m128 scale = _mm_set1_ps(exp2Float(node.exponent[a]));
+        __m128 lo = _mm_add_ps(origin, _mm_mul_ps(loadQuantized(node.lo[a]), scale));
+        __m128 hi = _mm_add_ps(origin, _mm_mul_ps(loadQuantized(node.hi[a]), scale));
+
+        __m128 o = _mm_set1_ps(ray.origin[a]);
+        __m128 inv_d = _mm_set1_ps(ray.inv_d[a]);
+        __m128 near = _mm_mul_ps(_mm_sub_ps(ray.dir_neg[a] ? hi : lo, o), inv_d);
+        __m128 far = _mm_mul_ps(_mm_mul_ps(
+            _mm_sub_ps(ray.dir_neg[a] ? lo : hi, o), inv_d), widen);
+        t0 = _mm_max_ps(near, t0);
+        t1 = _mm_min_ps(far, t1);
+    }
+    _mm_storeu_ps(t_near, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+#endif
+
+template <int N, typename Q = uint8_t>
+class QuantizedBVH : public Accelerator
+{
+private:
+    AlignedVector<QuantizedBVHNode<N, Q>> nodes;
+    std::vector<shared_ptr<Hittable>> primitives; // in leaf order
+    TypedLeaves typed;
+    AABB box;
+    bool has_box = false;
+
+    static QuantizedBVHNode<N, Q> quantize(const WideBVHNode<N> &wide);
+
+public:
+    QuantizedBVH() {}
+
+    QuantizedBVH(HittableList &list, double time0, double time1,
+                 const BVHBuildOptions &options = BVHBuildOptions())
+        : QuantizedBVH(WideBVH<N>(list, time0, time1, options)) {}
+
+    explicit QuantizedBVH(const WideBVH<N> &bvh);
+
+    bool hit(const Ray &r, double t_min,
+             double t_max, HitRecord &rec) const override
+    {
+        return traverseWideBVH<N>(nodes, primitives, typed, r, t_min, t_max, rec);
+    }
+
+    bool occluded(const Ray &r, double t_min, double t_max) const override
+    {
+        return occludedWideBVH<N>(nodes, primitives, typed, r, t_min, t_max);
+    }
+
+    bool boundingBox(double t0, double t1,
+                     AABB &output_box) const override
+    {
+        output_box = box;
+        return has_box;
+    }
+
+    size_t memoryUsage() const override
+    {
+        return nodes.capacity() * sizeof(QuantizedBVHNode<N, Q>) +
+               primitives.capacity() * sizeof(shared_ptr<Hittable>) +
+               typed.memoryUsage();
+    }
+};
+
+using BVH4Q = QuantizedBVH<4>;
+using BVH8Q = QuantizedBVH<8>;
+
+template <int N, typename Q>
+QuantizedBVH<N, Q>::QuantizedBVH(const WideBVH<N> &bvh)
+    : primitives(bvh.primitives), typed(bvh.typed), box(bvh.box), has_box(bvh.has_box)
+{
+    nodes.reserve(bvh.nodes.size());
+    for (const auto &wide : bvh.nodes)
+        nodes.push_back(quantize(wide));
+}
+
+// The grid starts at the parent's min corner, and its step is the
+//  smallest power of two that lets the largest offset pass the max.
+// Each bound is then moved outwards until it decodes, in float exactly
+//  as traversal does, to a value that still contains the child.
+template <int N, typename Q>
+QuantizedBVHNode<N, Q> QuantizedBVH<N, Q>::quantize(const WideBVHNode<N> &wide)
+{
+    const int q_max = std::numeric_limits<Q>::max();
+
+    QuantizedBVHNode<N, Q> node;
+    std::memset(&node, 0, sizeof(node));
+    bool used[N];
+    for (int k = 0; k < N; ++k)
+    {
+        used[k] = wide.bounds[0][0][k] <= wide.bounds[1][0][k];
+        node.child[k] = wide.child[k];
+        node.count[k] = wide.count[k];
+    }
+
+    for (int a = 0; a < 3; ++a)
+    {
+        float lo = std::numeric_limits<float>::infinity();
+        float hi = -std::numeric_limits<float>::infinity();
+        for (int k = 0; k < N; ++k)
+            if (used[k])
+            {
+                lo = std::min(lo, wide.bounds[0][a][k]);
+                hi = std::max(hi, wide.bounds[1][a][k]);
+            }
+        node.origin[a] = lo;
+
+        int exponent = -126;
+        double extent = static_cast<double>(hi) - lo;
+        if (extent > 0)
+            exponent = std::max(-126, static_cast<int>(std::ceil(std::log2(extent / q_max))));
+        // strictly past hi, so that unused lanes decode to lo > hi
+        while (exponent < 127 && static_cast<float>(lo + q_max * exp2Float(exponent)) <= hi)
+            ++exponent;
+        node.exponent[a] = exponent;
+        float scale = exp2Float(exponent);
+
+        for (int k = 0; k < N; ++k)
+        {
+            if (!used[k])
+            {
+                node.lo[a][k] = q_max;
+                node.hi[a][k] = 0;
+                continue;
+            }
+            float child_lo = wide.bounds[0][a][k], child_hi = wide.bounds[1][a][k];
+            int q_lo = std::max(0, std::min(q_max, static_cast<int>(std::floor((child_lo - lo) / scale))));
+            int q_hi = std::max(0, std::min(q_max, static_cast<int>(std::ceil((child_hi - lo) / scale))));
+            while (q_lo > 0 && node.origin[a] + q_lo * scale > child_lo)
+                --q_lo;
+            while (q_hi < q_max && node.origin[a] + q_hi * scale < child_hi)
+                ++q_hi;
+            node.lo[a][k] = q_lo;
+            node.hi[a][k] = q_hi;
+        }
+    }
+    return node;
+}
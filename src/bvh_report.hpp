@@ -0,0 +1,178 @@
+// Statistics run of a scene, for scenes compiled with -DBVH_STATS:
+//  traces a sample of camera paths through the world and prints
+//  the traversal counts per ray and every tree built as JSON.
+// `make stats` in scenes/ writes one such file per scene.
+
+#pragma once
+
+#include <cstring>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "raytracer.h"
+#include "hittable.h"
+#include "camera.hpp"
+#include "material.hpp"
+#include "bvh_stats.hpp"
+
+// A hardware event counted for the calling thread in user space.
+// Counts are -1 where the kernel or the machine (e.g. most virtual
+//  machines) does not provide the event.
+class PerfCounter
+{
+private:
+    int fd = -1;
+
+public:
+    PerfCounter(uint32_t type, uint64_t config)
+    {
+#if defined(__linux__)
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+
+    PerfCounter(const PerfCounter &) = delete;
+    PerfCounter &operator=(const PerfCounter &) = delete;
+
+    ~PerfCounter()
+    {
+#if defined(__linux__)
+        if (fd >= 0)
+            close(fd);
+#endif
+    }
+
+    void start()
+    {
+#if defined(__linux__)
+        if (fd >= 0)
+        {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    int64_t stop()
+    {
+        int64_t count = -1;
+#if defined(__linux__)
+        if (fd >= 0)
+        {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd, &count, sizeof(count)) != sizeof(count))
+                count = -1;
+        }
+#endif
+        return count;
+    }
+};
+
+// Follows n_paths camera paths the way the renderer does,
+//  up to max_depth bounces, and returns the number of rays.
+uint64_t traceBVHStatsPaths(const Hittable &world, const Camera &cam,
+                            int max_depth, int n_paths)
+{
+    uint64_t n_rays = 0;
+    for (int s = 0; s < n_paths; ++s)
+    {
+        Ray r = cam.getRay(randomReal(), randomReal());
+        for (int depth = max_depth; depth >= 0; --depth)
+        {
+            ++n_rays;
+            HitRecord rec;
+            if (!world.hit(r, 0.001, INF, rec))
+                break;
+            Ray scattered;
+            Color attenuation;
+            if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
+                break;
+            r = scattered;
+        }
+    }
+    return n_rays;
+}
+
+// Traces the paths twice: first under the hardware counters, with the
+//  cache model off so that it does not disturb them, then with the
+//  traversal counters and the cache model.
+int reportBVHStats(const char *scene, const Hittable &world, const Camera &cam,
+                   int max_depth, int n_paths = 1 << 16)
+{
+#if defined(__linux__)
+    const uint64_t l1d_read_miss = PERF_COUNT_HW_CACHE_L1D |
+                                   PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                                   PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+    const uint64_t dtlb_read_miss = PERF_COUNT_HW_CACHE_DTLB |
+                                    PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                                    PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+    PerfCounter hw_counters[] = {
+        {PERF_TYPE_HW_CACHE, l1d_read_miss},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_HW_CACHE, dtlb_read_miss}};
+#else
+    PerfCounter hw_counters[] = {{0, 0}, {0, 0}, {0, 0}};
+#endif
+    const char *hw_names[] = {"l1d_misses_per_ray", "llc_misses_per_ray",
+                              "dtlb_misses_per_ray"};
+
+    auto &model = bvhMemoryModel();
+    model.enabled = false;
+    for (auto &counter : hw_counters)
+        counter.start();
+    uint64_t hw_rays = traceBVHStatsPaths(world, cam, max_depth, n_paths);
+    int64_t hw_counts[3];
+    for (int i = 0; i < 3; ++i)
+        hw_counts[i] = hw_counters[i].stop();
+
+    auto &counters = bvhRayCounters();
+    counters = BVHRayCounters();
+    model = BVHMemoryModel();
+    uint64_t n_rays = traceBVHStatsPaths(world, cam, max_depth, n_paths);
+
+    auto &out = std::cout;
+    out << "{\n  \"scene\": \"" << scene << "\",\n"
+        << "  \"paths\": " << n_paths << ",\n"
+        << "  \"rays\": " << n_rays << ",\n"
+        << std::setprecision(9)
+        << "  \"node_tests_per_ray\": "
+        << static_cast<double>(counters.node_tests) / n_rays << ",\n"
+        << "  \"primitive_tests_per_ray\": "
+        << static_cast<double>(counters.primitive_tests) / n_rays << ",\n"
+        << "  \"node_cache_model\": {\"lines_per_ray\": "
+        << static_cast<double>(model.l1.accesses) / n_rays
+        << ", \"l1_misses_per_ray\": "
+        << static_cast<double>(model.l1.misses) / n_rays
+        << ", \"tlb_misses_per_ray\": "
+        << static_cast<double>(model.tlb.misses) / n_rays << "},\n"
+        << "  \"hardware\": {";
+    for (int i = 0; i < 3; ++i)
+    {
+        out << (i ? ", \"" : "\"") << hw_names[i] << "\": ";
+        if (hw_counts[i] < 0)
+            out << "null";
+        else
+            out << static_cast<double>(hw_counts[i]) / hw_rays;
+    }
+    out << "},\n  \"trees\": [";
+    const auto &trees = bvhStatsRegistry();
+    for (size_t i = 0; i < trees.size(); ++i)
+    {
+        out << (i ? ",\n    " : "\n    ");
+        writeBVHStatsJSON(out, trees[i]);
+    }
+    out << (trees.empty() ? "]\n}\n" : "\n  ]\n}\n");
+    return 0;
+}
@@ -0,0 +1,180 @@
+// BVH quality and traversal statistics.
+//
+// Compiled in with -DBVH_STATS only: every built BVHNode records the
+//  shape of its tree, and traversal counts node and primitive tests
+//  and runs the nodes it reads through a model of the caches.
+// bvh_report.hpp samples rays through a scene and prints both as JSON.
+
+#pragma once
+
+#include <iomanip>
+
+#include "raytracer.h"
+#include "aabb.hpp"
+#include "bvh_build.hpp"
+
+// tests done by the calling thread since the counters were reset;
+//  a wide node counts once for all of its children
+struct BVHRayCounters
+{
+    uint64_t node_tests = 0;
+    uint64_t primitive_tests = 0;
+};
+
+inline BVHRayCounters &bvhRayCounters()
+{
+    static thread_local BVHRayCounters counters;
+    return counters;
+}
+
+// Set-associative LRU model of a cache with 2^line_bits byte lines,
+//  so that node layouts can be compared on machines without
+//  hardware performance counters.
+class BVHCacheModel
+{
+private:
+    int line_bits, n_sets, n_ways;
+    std::vector<uint64_t> tags; // per set, most recent first; 0 is empty
+
+public:
+    uint64_t accesses = 0;
+    uint64_t misses = 0;
+
+    BVHCacheModel(int line_bits, int n_sets, int n_ways)
+        : line_bits(line_bits), n_sets(n_sets), n_ways(n_ways),
+          tags(n_sets * n_ways, 0) {}
+
+    void touch(const void *data, size_t size)
+    {
+        auto address = reinterpret_cast<uintptr_t>(data);
+        for (auto line = address >> line_bits;
+             line <= (address + size - 1) >> line_bits; ++line)
+        {
+            ++accesses;
+            uint64_t *set = &tags[line % n_sets * n_ways];
+            int way = 0;
+            while (way < n_ways && set[way] != line + 1)
+                ++way;
+            if (way == n_ways)
+            {
+                ++misses;
+                --way;
+            }
+            for (; way > 0; --way)
+                set[way] = set[way - 1];
+            set[0] = line + 1;
+        }
+    }
+};
+
+// the nodes read by traversal on the calling thread, through a 32 KiB
+//  8-way L1 data cache and a 64 entry TLB of 4 KiB pages
+struct BVHMemoryModel
+{
+    bool enabled = true;
+    BVHCacheModel l1 = BVHCacheModel(6, 64, 8);
+    BVHCacheModel tlb = BVHCacheModel(12, 1, 64);
+};
+
+inline BVHMemoryModel &bvhMemoryModel()
+{
+    static thread_local BVHMemoryModel model;
+    return model;
+}
+
+inline void touchBVHNode(const void *node, size_t size)
+{
+    auto &model = bvhMemoryModel();
+    if (!model.enabled)
+        return;
+    model.l1.touch(node, size);
+    model.tlb.touch(node, size);
+}
+
+#ifdef BVH_STATS
+#define BVH_STATS_COUNT(counter) (++bvhRayCounters().counter)
+#define BVH_STATS_TOUCH(node) touchBVHNode(&(node), sizeof(node))
+#else
+#define BVH_STATS_COUNT(counter) ((void)0)
+#define BVH_STATS_TOUCH(node) ((void)0)
+#endif
+
+struct BVHTreeStats
+{
+    size_t primitives = 0;
+    size_t references = 0; // more than primitives after spatial splits
+    size_t nodes = 0;
+    size_t leaves = 0;
+    int depth = 0;                 // edges from the root to the deepest leaf
+    std::vector<size_t> leaf_sizes; // leaf_sizes[n]: leaves with n primitives
+    double sah_cost = 0;
+
+    // area of the overlap between the two children of each interior node,
+    //  summed and divided by the summed area of those nodes
+    double sibling_overlap = 0;
+};
+
+// everything but the primitive counts and the cost
+BVHTreeStats bvhTreeStats(const AlignedVector<BVHLinearNode> &nodes)
+{
+    BVHTreeStats stats;
+    stats.nodes = nodes.size();
+    if (nodes.empty())
+        return stats;
+
+    double overlap_area = 0, interior_area = 0;
+    std::vector<std::pair<uint32_t, int>> stack = {{0, 0}};
+    while (!stack.empty())
+    {
+        auto index = stack.back().first;
+        auto depth = stack.back().second;
+        stack.pop_back();
+
+        const auto &node = nodes[index];
+        if (node.count > 0)
+        {
+            ++stats.leaves;
+            stats.depth = std::max(stats.depth, depth);
+            if (stats.leaf_sizes.size() <= node.count)
+                stats.leaf_sizes.resize(node.count + 1);
+            ++stats.leaf_sizes[node.count];
+            continue;
+        }
+
+        AABB overlap;
+        if (overlapBox(nodes[node.offset].box, nodes[node.offset + 1].box, overlap))
+            overlap_area += overlap.surfaceArea();
+        interior_area += node.box.surfaceArea();
+        stack.push_back({node.offset, depth + 1});
+        stack.push_back({node.offset + 1, depth + 1});
+    }
+    stats.sibling_overlap = interior_area > 0 ? overlap_area / interior_area : 0;
+    return stats;
+}
+
+// every tree built so far, in build order
+inline std::vector<BVHTreeStats> &bvhStatsRegistry()
+{
+    static std::vector<BVHTreeStats> registry;
+    return registry;
+}
+
+inline void registerBVHStats(const BVHTreeStats &stats)
+{
+#pragma omp critical(bvh_stats_registry)
+    bvhStatsRegistry().push_back(stats);
+}
+
+void writeBVHStatsJSON(std::ostream &out, const BVHTreeStats &stats)
+{
+    out << "{\"primitives\": " << stats.primitives
+        << ", \"references\": " << stats.references
+        << ", \"nodes\": " << stats.nodes
+        << ", \"leaves\": " << stats.leaves
+        << ", \"depth\": " << stats.depth
+        << ", \"leaf_sizes\": [";
+    for (size_t n = 0; n < stats.leaf_sizes.size(); ++n)
+        out << (n ? ", " : "") << stats.leaf_sizes[n];
+    out << "], \"sah_cost\": " << std::setprecision(9) << stats.sah_cost
+        << ", \"sibling_overlap\": " << stats.sibling_overlap << "}";
+}
@@ -0,0 +1,688 @@
+// Wide BVH: N children per node, all tested at once
+
+#pragma once
+
+#include "raytracer.h"
+#include "hittable.h"
+#include "hittable_list.hpp"
+#include "aabb.hpp"
+#include "bvh.hpp"
+
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+// Child boxes are stored in single precision, structure-of-arrays:
+//  bounds[0] holds the minimum and bounds[1] the maximum corner,
+//  one lane per child.
+// A child with count > 0 is a leaf of `count` primitives at `child`,
+//  otherwise `child` is the index of another node.
+// Unused lanes have an empty (inverted) box and never hit.
+template <int N>
+struct alignas(CACHE_LINE_SIZE) WideBVHNode
+{
+    float bounds[2][3][N];
+    uint32_t child[N];
+    uint32_t count[N];
+};
+
+// round outwards, so the float box always contains the double one
+inline float roundDown(double x)
+{
+    float f = static_cast<float>(x);
+    return f > x ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+inline float roundUp(double x)
+{
+    float f = static_cast<float>(x);
+    return f < x ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+template <int N>
+inline void setChildBox(WideBVHNode<N> &node, int k, const AABB &box)
+{
+    for (int a = 0; a < 3; ++a)
+    {
+        node.bounds[0][a][k] = roundDown(box.min()[a]);
+        node.bounds[1][a][k] = roundUp(box.max()[a]);
+    }
+}
+
+template <int N>
+inline AABB childBox(const WideBVHNode<N> &node, int k)
+{
+    return AABB(Point3(node.bounds[0][0][k], node.bounds[0][1][k], node.bounds[0][2][k]),
+                Point3(node.bounds[1][0][k], node.bounds[1][1][k], node.bounds[1][2][k]));
+}
+
+// the ray in the form the slab test wants
+struct WideBVHRay
+{
+    float origin[3];
+    float inv_d[3];
+    int dir_neg[3];
+    float time; // motion nodes only: fraction of the shutter interval
+};
+
+// Single precision slab distances are slightly widened,
+//  so that rounding can never cull a box the ray really hits.
+const float WIDE_BVH_WIDEN = 1.0000005f;
+
+inline WideBVHRay wideBVHRay(const Ray &r, float time)
+{
+    WideBVHRay ray;
+    for (int a = 0; a < 3; ++a)
+    {
+        ray.origin[a] = static_cast<float>(r.origin()[a]);
+        ray.inv_d[a] = static_cast<float>(1 / r.direction()[a]);
+        ray.dir_neg[a] = ray.inv_d[a] < 0;
+    }
+    ray.time = time;
+    return ray;
+}
+
+// Returns the mask of children whose box overlaps [t_min, t_max],
+//  and writes each child's entry distance to t_near.
+template <int N>
+inline int intersectChildren(const WideBVHNode<N> &node, const WideBVHRay &ray,
+                             float t_min, float t_max, float *t_near)
+{
+    int mask = 0;
+    for (int k = 0; k < N; ++k)
+    {
+        float t0 = t_min, t1 = t_max;
+        for (int a = 0; a < 3; ++a)
+        {
+            float near = (node.bounds[ray.dir_neg[a]][a][k] - ray.origin[a]) * ray.inv_d[a];
+            float far = (node.bounds[1 - ray.dir_neg[a]][a][k] - ray.origin[a]) * ray.inv_d[a] * WIDE_BVH_WIDEN;
+            // written so that NaN (0 * inf) leaves the interval unchanged
+            t0 = near > t0 ? near : t0;
+            t1 = far < t1 ? far : t1;
+        }
+        t_near[k] = t0;
+        mask |= (t0 <= t1) << k;
+    }
+    return mask;
+}
+
+#if defined(__SSE__)
+template <>
+inline int intersectChildren<4>(const WideBVHNode<4> &node, const WideBVHRay &ray,
+                                float t_min, float t_max, float *t_near)
+{
+    __m128 t0 = _mm_set1_ps(t_min);
+    __m128 t1 = _mm_set1_ps(t_max);
+    __m128 widen = _mm_set1_ps(WIDE_BVH_WIDEN);
+    for (int a = 0; a < 3; ++a)
+    {
+        __m128 o = _mm_set1_ps(ray.origin[a]);
+        __m128 inv_d = _mm_set1_ps(ray.inv_d[a]);
+        __m128 near = _mm_mul_ps(
+            _mm_sub_ps(_mm_loadu_ps(node.bounds[ray.dir_neg[a]][a]), o), inv_d);
+        __m128 far = _mm_mul_ps(_mm_mul_ps(
+            _mm_sub_ps(_mm_loadu_ps(node.bounds[1 - ray.dir_neg[a]][a]), o), inv_d), widen);
+        // max/min return the second operand if either one is NaN
+        t0 = _mm_max_ps(near, t0);
+        t1 = _mm_min_ps(far, t1);
+    }
+    _mm_storeu_ps(t_near, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+#endif
+
+#if defined(__AVX__)
+template <>
+inline int intersectChildren<8>(const WideBVHNode<8> &node, const WideBVHRay &ray,
+                                float t_min, float t_max, float *t_near)
+{
+    __m256 t0 = _mm256_set1_ps(t_min);
+    __m256 t1 = _mm256_set1_ps(t_max);
+    __m256 widen = _mm256_set1_ps(WIDE_BVH_WIDEN);
+    for (int a = 0; a < 3; ++a)
+    {
+        __m256 o = _mm256_set1_ps(ray.origin[a]);
+        __m256 inv_d = _mm256_set1_ps(ray.inv_d[a]);
+        __m256 near = _mm256_mul_ps(
+            _mm256_sub_ps(_mm256_loadu_ps(node.bounds[ray.dir_neg[a]][a]), o), inv_d);
+        __m256 far = _mm256_mul_ps(_mm256_mul_ps(
+            _mm256_sub_ps(_mm256_loadu_ps(node.bounds[1 - ray.dir_neg[a]][a]), o), inv_d), widen);
+        t0 = _mm256_max_ps(near, t0);
+        t1 = _mm256_min_ps(far, t1);
+    }
+    _mm256_storeu_ps(t_near, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+#endif
+
+struct WideBVHStackEntry
+{
+    uint32_t child;
+    uint32_t count;
+    float t_near;
+};
+
+// Nearest-first traversal, shared by every wide node format.
+// `Node` needs child[N], count[N] and an intersectChildren() overload.
+template <int N, typename Node>
+bool traverseWideBVH(const AlignedVector<Node> &nodes,
+                     const std::vector<shared_ptr<Hittable>> &primitives,
+                     const TypedLeaves &typed,
+                     const Ray &r, double t_min, double t_max, HitRecord &rec,
+                     float time = 0)
+{
+    if (nodes.empty())
+        return false;
+
+    auto ray = wideBVHRay(r, time);
+    float t_lo = static_cast<float>(t_min) *
+                 (t_min > 0 ? 1 / WIDE_BVH_WIDEN : WIDE_BVH_WIDEN);
+    float t_hi = static_cast<float>(t_max) * WIDE_BVH_WIDEN;
+
+    WideBVHStackEntry stack[BVH_STACK_SIZE * N];
+    int top = 0;
+    stack[top++] = {0, 0, t_lo};
+    bool hit_anything = false;
+
+    while (top > 0)
+    {
+        const auto entry = stack[--top];
+        if (entry.t_near > t_max)
+            continue;
+
+        if (entry.count > 0)
+        {
+            if (typed.hit(primitives, entry.child, entry.count,
+                          r, t_min, t_max, rec))
+            {
+                hit_anything = true;
+                t_hi = static_cast<float>(t_max) * WIDE_BVH_WIDEN;
+            }
+            continue;
+        }
+
+        const auto &node = nodes[entry.child];
+        BVH_STATS_COUNT(node_tests);
+        BVH_STATS_TOUCH(node);
+        alignas(32) float t_near[N];
+        int mask = intersectChildren(node, ray, t_lo, t_hi, t_near);
+        if (!mask)
+            continue;
+
+        // push the hit children far to near, so the nearest pops first
+        int first = top;
+        for (int k = 0; k < N; ++k)
+        {
+            if (!(mask >> k & 1))
+                continue;
+            WideBVHStackEntry child = {node.child[k], node.count[k], t_near[k]};
+            int j = top++;
+            for (; j > first && stack[j - 1].t_near < child.t_near; --j)
+                stack[j] = stack[j - 1];
+            stack[j] = child;
+        }
+    }
+
+    return hit_anything;
+}
+
+// Any-hit traversal for Hittable::occluded, over the same node formats:
+//  leaf children are tested as soon as their box is hit, and the
+//  interior ones are visited in no particular order.
+template <int N, typename Node>
+bool occludedWideBVH(const AlignedVector<Node> &nodes,
+                     const std::vector<shared_ptr<Hittable>> &primitives,
+                     const TypedLeaves &typed,
+                     const Ray &r, double t_min, double t_max, float time = 0)
+{
+    if (nodes.empty())
+        return false;
+
+    auto ray = wideBVHRay(r, time);
+    float t_lo = static_cast<float>(t_min) *
+                 (t_min > 0 ? 1 / WIDE_BVH_WIDEN : WIDE_BVH_WIDEN);
+    float t_hi = static_cast<float>(t_max) * WIDE_BVH_WIDEN;
+
+    uint32_t stack[BVH_STACK_SIZE * N];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        const auto &node = nodes[stack[--top]];
+        BVH_STATS_COUNT(node_tests);
+        BVH_STATS_TOUCH(node);
+        alignas(32) float t_near[N];
+        int mask = intersectChildren(node, ray, t_lo, t_hi, t_near);
+        for (int k = 0; k < N; ++k)
+        {
+            if (!(mask >> k & 1))
+                continue;
+            if (node.count[k] == 0)
+                stack[top++] = node.child[k];
+            else if (typed.occluded(primitives, node.child[k], node.count[k],
+                                    r, t_min, t_max))
+                return true;
+        }
+    }
+    return false;
+}
+
+// The whole packet as intervals: each ray's float origin and inverse
+//  direction lie within [lo, hi] along every axis.
+// Only built when all rays agree on the sign of each direction component.
+struct WideBVHFrustum
+{
+    float origin_lo[3], origin_hi[3];
+    float inv_d_lo[3], inv_d_hi[3];
+    int dir_neg[3];
+};
+
+// lower and upper bound of (plane - origin) * inv_d over the packet
+inline void slabInterval(float plane, const WideBVHFrustum &frustum, int a,
+                         float &lo, float &hi)
+{
+    float d_lo = plane - frustum.origin_hi[a], d_hi = plane - frustum.origin_lo[a];
+    float p0 = d_lo * frustum.inv_d_lo[a], p1 = d_lo * frustum.inv_d_hi[a];
+    float p2 = d_hi * frustum.inv_d_lo[a], p3 = d_hi * frustum.inv_d_hi[a];
+    lo = std::min(std::min(p0, p1), std::min(p2, p3));
+    hi = std::max(std::max(p0, p1), std::max(p2, p3));
+}
+
+// Returns the mask of children that some ray of the packet may hit,
+//  by interval arithmetic on the slab test, and writes a lower bound
+//  of every ray's entry distance to t_near.
+// Rounding is monotonic, so the float bounds hold for each ray's own
+//  float slab test as well: no child that test would keep is culled.
+template <int N>
+inline int cullChildren(const WideBVHNode<N> &node, const WideBVHFrustum &frustum,
+                        float t_min, float t_max, float t_near[N])
+{
+    int mask = 0;
+    for (int k = 0; k < N; ++k)
+    {
+        float t0 = t_min, t1 = t_max;
+        for (int a = 0; a < 3; ++a)
+        {
+            float near_lo, near_hi, far_lo, far_hi;
+            slabInterval(node.bounds[frustum.dir_neg[a]][a][k], frustum, a,
+                         near_lo, near_hi);
+            slabInterval(node.bounds[1 - frustum.dir_neg[a]][a][k], frustum, a,
+                         far_lo, far_hi);
+            t0 = std::max(t0, near_lo);
+            t1 = std::min(t1, far_hi * WIDE_BVH_WIDEN);
+        }
+        t_near[k] = t0;
+        mask |= (t0 <= t1) << k;
+    }
+    return mask;
+}
+
+struct WideBVHPacketEntry
+{
+    uint32_t child;
+    uint32_t count;
+    uint32_t parent; // leaves only: the node and lane holding their box
+    uint8_t lane;
+    uint8_t first; // no ray before this one can hit the child
+    float t_near;  // lower bound of the entry distance of every ray
+};
+
+// Packet traversal: the packet visits a child if some ray hits its box,
+//  so every node and its lines are read once for all the rays.
+// Children the frustum misses are culled without testing any ray;
+//  otherwise the rays are tested in order until one hits, and the
+//  rays before that first active one are skipped below the child.
+// A packet whose rays differ in the sign of a direction component has
+//  no useful frustum, and is traced ray by ray instead.
+template <int N>
+void traceWideBVHPacket(const AlignedVector<WideBVHNode<N>> &nodes,
+                        const std::vector<shared_ptr<Hittable>> &primitives,
+                        const TypedLeaves &typed, RayPacket &packet, double t_min)
+{
+    if (nodes.empty() || packet.n == 0)
+        return;
+
+    WideBVHRay rays[RAY_PACKET_SIZE];
+    float t_hi[RAY_PACKET_SIZE];
+    WideBVHFrustum frustum;
+    bool coherent = true;
+    for (int i = 0; i < packet.n; ++i)
+    {
+        rays[i] = wideBVHRay(packet.rays[i], 0);
+        t_hi[i] = static_cast<float>(packet.t_max[i]) * WIDE_BVH_WIDEN;
+        for (int a = 0; a < 3; ++a)
+        {
+            float origin = rays[i].origin[a], inv_d = rays[i].inv_d[a];
+            coherent = coherent && std::isfinite(inv_d) &&
+                       rays[i].dir_neg[a] == rays[0].dir_neg[a];
+            frustum.origin_lo[a] = i ? std::min(frustum.origin_lo[a], origin) : origin;
+            frustum.origin_hi[a] = i ? std::max(frustum.origin_hi[a], origin) : origin;
+            frustum.inv_d_lo[a] = i ? std::min(frustum.inv_d_lo[a], inv_d) : inv_d;
+            frustum.inv_d_hi[a] = i ? std::max(frustum.inv_d_hi[a], inv_d) : inv_d;
+            frustum.dir_neg[a] = rays[0].dir_neg[a];
+        }
+    }
+
+    if (!coherent)
+    {
+        for (int i = 0; i < packet.n; ++i)
+            if (traverseWideBVH<N>(nodes, primitives, typed, packet.rays[i],
+                                   t_min, packet.t_max[i], packet.rec[i]))
+            {
+                packet.hit[i] = true;
+                packet.t_max[i] = packet.rec[i].t;
+            }
+        return;
+    }
+
+    float t_lo = static_cast<float>(t_min) *
+                 (t_min > 0 ? 1 / WIDE_BVH_WIDEN : WIDE_BVH_WIDEN);
+    float packet_t_hi = *std::max_element(t_hi, t_hi + packet.n);
+
+    WideBVHPacketEntry stack[BVH_STACK_SIZE * N];
+    int top = 0;
+    stack[top++] = {0, 0, 0, 0, 0, t_lo};
+
+    while (top > 0)
+    {
+        const auto entry = stack[--top];
+        if (entry.t_near > packet_t_hi)
+            continue;
+
+        if (entry.count > 0)
+        {
+            const auto &parent = nodes[entry.parent];
+            for (int i = entry.first; i < packet.n; ++i)
+            {
+                alignas(32) float t_near[N];
+                if (entry.t_near > t_hi[i] ||
+                    !(intersectChildren(parent, rays[i], t_lo, t_hi[i], t_near) >> entry.lane & 1))
+                    continue;
+                if (typed.hit(primitives, entry.child, entry.count, packet.rays[i],
+                              t_min, packet.t_max[i], packet.rec[i]))
+                {
+                    packet.hit[i] = true;
+                    t_hi[i] = static_cast<float>(packet.t_max[i]) * WIDE_BVH_WIDEN;
+                }
+            }
+            packet_t_hi = *std::max_element(t_hi, t_hi + packet.n);
+            continue;
+        }
+
+        const auto &node = nodes[entry.child];
+        BVH_STATS_COUNT(node_tests);
+        BVH_STATS_TOUCH(node);
+        float t_bound[N];
+        int candidates = cullChildren(node, frustum, t_lo, packet_t_hi, t_bound);
+        int remaining = candidates;
+
+        // the first active ray of each child, and its distance to order them
+        int first[N];
+        float t_first[N];
+        for (int i = entry.first; i < packet.n && remaining; ++i)
+        {
+            alignas(32) float t_near[N];
+            int mask = intersectChildren(node, rays[i], t_lo, t_hi[i], t_near) & remaining;
+            for (int k = 0; k < N; ++k)
+                if (mask >> k & 1)
+                {
+                    first[k] = i;
+                    t_first[k] = t_near[k];
+                }
+            remaining &= ~mask;
+        }
+
+        // push the hit children far to near by the distance of their
+        //  first active ray, so the nearest pops first
+        int hit = candidates & ~remaining;
+        int order[N], n_hit = 0;
+        for (int k = 0; k < N; ++k)
+        {
+            if (!(hit >> k & 1))
+                continue;
+            int j = n_hit++;
+            for (; j > 0 && t_first[order[j - 1]] < t_first[k]; --j)
+                order[j] = order[j - 1];
+            order[j] = k;
+        }
+        for (int j = 0; j < n_hit; ++j)
+        {
+            int k = order[j];
+            stack[top++] = {node.child[k], node.count[k], entry.child,
+                            static_cast<uint8_t>(k), static_cast<uint8_t>(first[k]),
+                            t_bound[k]};
+        }
+    }
+}
+
+// Pull binary nodes up into one wide node, written at `wide_index`:
+//  keep opening the largest interior child until N children are found.
+// The interior children are laid out next to each other at the end of
+//  `nodes` before any of their subtrees, like the binary siblings.
+template <int N>
+void collapseBVH(const AlignedVector<BVHLinearNode> &bin, uint32_t index,
+                 AlignedVector<WideBVHNode<N>> &nodes, uint32_t wide_index)
+{
+    std::vector<uint32_t> children;
+    if (bin[index].count > 0)
+        children.push_back(index); // the whole tree is one leaf
+    else
+    {
+        children.push_back(bin[index].offset);
+        children.push_back(bin[index].offset + 1);
+    }
+
+    while (children.size() < N)
+    {
+        int largest = -1;
+        double largest_area = -1;
+        for (size_t k = 0; k < children.size(); ++k)
+        {
+            const auto &child = bin[children[k]];
+            if (child.count == 0 && child.box.surfaceArea() > largest_area)
+            {
+                largest = k;
+                largest_area = child.box.surfaceArea();
+            }
+        }
+        if (largest == -1)
+            break;
+
+        uint32_t opened = children[largest];
+        children[largest] = bin[opened].offset;
+        children.push_back(bin[opened].offset + 1);
+    }
+
+    WideBVHNode<N> node;
+    for (int k = 0; k < N; ++k)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            node.bounds[0][a][k] = std::numeric_limits<float>::infinity();
+            node.bounds[1][a][k] = -std::numeric_limits<float>::infinity();
+        }
+        node.child[k] = 0;
+        node.count[k] = 0;
+    }
+
+    uint32_t next = nodes.size();
+    for (size_t k = 0; k < children.size(); ++k)
+    {
+        const auto &child = bin[children[k]];
+        setChildBox(node, k, child.box);
+        if (child.count > 0)
+        {
+            node.child[k] = child.offset;
+            node.count[k] = child.count;
+        }
+        else
+            node.child[k] = next++;
+    }
+    nodes[wide_index] = node;
+    nodes.resize(next);
+
+    for (size_t k = 0; k < children.size(); ++k)
+        if (node.count[k] == 0)
+            collapseBVH(bin, children[k], nodes, node.child[k]);
+}
+
+template <int N>
+class WideBVH : public Accelerator
+{
+    template <int M, typename Q>
+    friend class QuantizedBVH;
+    template <int M>
+    friend class MotionBVH;
+
+private:
+    AlignedVector<WideBVHNode<N>> nodes;
+    std::vector<shared_ptr<Hittable>> primitives; // in leaf order
+    TypedLeaves typed;
+    AABB box;
+    bool has_box = false;
+    BVHBuildOptions options;
+    double built_cost = 0; // sahCost() right after building
+
+    AABB refitNode(uint32_t index, double time0, double time1, int depth);
+
+public:
+    WideBVH() {}
+
+    WideBVH(HittableList &list, double time0, double time1,
+            const BVHBuildOptions &options = BVHBuildOptions())
+        : WideBVH(BVHNode(list, time0, time1, options)) {}
+
+    // collapse a binary BVH
+    explicit WideBVH(const BVHNode &bvh);
+
+    // expected cost of a random ray that hits the root box
+    double sahCost() const;
+
+    // same as BVHNode::refit
+    bool refit(double time0, double time1);
+
+    bool hit(const Ray &r, double t_min,
+             double t_max, HitRecord &rec) const override
+    {
+        return traverseWideBVH<N>(nodes, primitives, typed, r, t_min, t_max, rec);
+    }
+
+    bool occluded(const Ray &r, double t_min, double t_max) const override
+    {
+        return occludedWideBVH<N>(nodes, primitives, typed, r, t_min, t_max);
+    }
+
+    void hitPacket(RayPacket &packet, double t_min) const override
+    {
+        traceWideBVHPacket<N>(nodes, primitives, typed, packet, t_min);
+    }
+
+    bool boundingBox(double t0, double t1,
+                     AABB &output_box) const override
+    {
+        output_box = box;
+        return has_box;
+    }
+
+    size_t memoryUsage() const override
+    {
+        return nodes.capacity() * sizeof(WideBVHNode<N>) +
+               primitives.capacity() * sizeof(shared_ptr<Hittable>) +
+               typed.memoryUsage();
+    }
+};
+
+using BVH4 = WideBVH<4>;
+using BVH8 = WideBVH<8>;
+
+template <int N>
+WideBVH<N>::WideBVH(const BVHNode &bvh)
+    : primitives(bvh.primitives), typed(bvh.typed), options(bvh.options)
+{
+    if (bvh.nodes.empty())
+        return;
+    has_box = bvh.boundingBox(0, 0, box);
+    nodes.emplace_back();
+    collapseBVH(bvh.nodes, 0, nodes, 0);
+    nodes.shrink_to_fit();
+    built_cost = sahCost();
+}
+
+template <int N>
+double WideBVH<N>::sahCost() const
+{
+    // every node costs one (wide) visit, every leaf its primitive tests
+    double cost = 0;
+    for (const auto &node : nodes)
+    {
+        AABB node_box;
+        for (int k = 0; k < N; ++k)
+        {
+            if (node.bounds[0][0][k] > node.bounds[1][0][k])
+                continue; // unused lane
+            auto child_box = childBox(node, k);
+            node_box = k ? surroundingBox(node_box, child_box) : child_box;
+            cost += options.intersect_cost * node.count[k] * child_box.surfaceArea();
+        }
+        cost += options.traversal_cost * node_box.surfaceArea();
+    }
+    return nodes.empty() ? 0 : cost / box.surfaceArea();
+}
+
+template <int N>
+bool WideBVH<N>::refit(double time0, double time1)
+{
+    if (nodes.empty())
+        return false;
+
+#pragma omp parallel if (primitives.size() >= options.parallel_threshold)
+#pragma omp single
+    box = refitNode(0, time0, time1, 0);
+
+    if (sahCost() <= built_cost * options.refit_tolerance)
+        return false;
+
+    auto objects = BVHNode::uniquePrimitives(primitives);
+    *this = WideBVH(BVHNode(objects, 0, objects.size(), time0, time1, options));
+    return true;
+}
+
+// returns the new box of the whole node
+template <int N>
+AABB WideBVH<N>::refitNode(uint32_t index, double time0, double time1, int depth)
+{
+    auto &node = nodes[index];
+    AABB child_box[N];
+    int n_children = 0;
+    for (int k = 0; k < N; ++k)
+    {
+        if (node.bounds[0][0][k] > node.bounds[1][0][k])
+            continue; // unused lane
+        n_children = k + 1;
+
+        if (node.count[k] > 0)
+        {
+            for (uint32_t i = 0; i < node.count[k]; ++i)
+            {
+                AABB prim_box;
+                if (!primitives[node.child[k] + i]->boundingBox(time0, time1, prim_box))
+                    std::cerr << "[ERROR]: No bounding box in WideBVH::refit.\n";
+                child_box[k] = i ? surroundingBox(child_box[k], prim_box) : prim_box;
+            }
+        }
+        else
+        {
+#pragma omp task shared(child_box) if (depth < 4)
+            child_box[k] = refitNode(node.child[k], time0, time1, depth + 1);
+        }
+    }
+#pragma omp taskwait
+
+    AABB node_box = child_box[0];
+    for (int k = 0; k < n_children; ++k)
+    {
+        setChildBox(node, k, child_box[k]);
+        node_box = surroundingBox(node_box, child_box[k]);
+    }
+    return node_box;
+}
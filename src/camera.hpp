@@ -2,6 +2,7 @@
 #pragma once
 
 #include "raytracer.h"
+#include "hittable.h"
 
 class Camera
 {
@@ -54,4 +55,55 @@ public:
                        t * vertical - origin - offset,
                    randomReal(time0, time1));
     }
+
+    // one jittered ray through each pixel of the tile of up to 8x8
+    //  pixels with (i0, j0) as its lower left corner
+    void getPacket(int i0, int j0, int image_width, int image_height,
+                   RayPacket &packet) const
+    {
+        packet.clear();
+        for (int j = j0; j < std::min(j0 + RAY_PACKET_WIDTH, image_height); ++j)
+            for (int i = i0; i < std::min(i0 + RAY_PACKET_WIDTH, image_width); ++i)
+            {
+                auto s = (i + randomReal()) / (image_width - 1);
+                auto t = (j + randomReal()) / (image_height - 1);
+                packet.add(getRay(s, t), i, j);
+            }
+    }
+
+    // sums samples_per_pixel samples for every pixel, image[j][i] with
+    //  j counted from the bottom: the camera rays of each sample through
+    //  a tile are traced together, see Hittable::hitPacket, and
+    //  shade(ray, rec) gives the color along each, with rec == nullptr
+    //  where the ray misses
+    template <typename Shade>
+    std::vector<std::vector<Color>> render(const Hittable &world,
+                                           int image_width, int image_height,
+                                           int samples_per_pixel, Shade shade) const
+    {
+        std::vector<std::vector<Color>> image(
+            image_height, std::vector<Color>(image_width));
+
+        int finished_cnt = 0;
+#pragma omp parallel for num_threads(6) schedule(dynamic)
+        for (int tile_j = 0; tile_j < image_height; tile_j += RAY_PACKET_WIDTH)
+        {
+            RayPacket packet;
+            for (int tile_i = 0; tile_i < image_width; tile_i += RAY_PACKET_WIDTH)
+                for (int s = 0; s < samples_per_pixel; ++s)
+                {
+                    getPacket(tile_i, tile_j, image_width, image_height, packet);
+                    world.hitPacket(packet, 0.001);
+                    for (int k = 0; k < packet.n; ++k)
+                        image[packet.y[k]][packet.x[k]] += shade(
+                            packet.rays[k], packet.hit[k] ? &packet.rec[k] : nullptr);
+                }
+#pragma omp critical
+            {
+                finished_cnt += std::min(RAY_PACKET_WIDTH, image_height - tile_j);
+                std::cerr << "\rFinished lines: " << finished_cnt << std::flush;
+            }
+        }
+        return image;
+    }
 };
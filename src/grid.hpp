@@ -0,0 +1,320 @@
+// Uniform grid: space is cut into equal cells, each listing the
+//  primitives whose boxes overlap it, and rays step from cell to cell
+//  (Amanatides and Woo, "A Fast Voxel Traversal Algorithm", 1987).
+//
+// Builds in linear time and wins on evenly spread scenes of similar
+//  objects, but not where a few cells hold most of them.
+// Primitives much larger than the spread of the others, such as a
+//  ground sphere or the boundary of a fog, would land in nearly every
+//  cell; they are kept apart instead and tested against every ray.
+// So is any primitive spanning several cells that TypedLeaves does not
+//  pack: a ray may test a primitive once per cell, which is only
+//  harmless for a hit() that always gives the same answer, and
+//  ConstantMedium draws a new distance each time.
+
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <cmath>
+
+#include "raytracer.h"
+#include "hittable.h"
+#include "accelerator.h"
+#include "hittable_list.hpp"
+#include "aabb.hpp"
+#include "typed_leaves.hpp"
+
+const int GRID_MAX_RESOLUTION = 128;
+// at most max(GRID_MIN_LARGE, n / GRID_LARGE_SHARE) primitives are
+//  kept apart as large
+const size_t GRID_MIN_LARGE = 8;
+const size_t GRID_LARGE_SHARE = 8;
+
+class UniformGrid : public Accelerator
+{
+private:
+    AABB bounds; // of the primitives in cells
+    bool bounds_set = false;
+    int resolution[3] = {0, 0, 0};
+    Vec3 cell_size, inv_cell_size;
+
+    // cell c holds primitives[cells[c]] up to primitives[cells[c + 1]],
+    //  cells are numbered x first, then y, then z
+    std::vector<uint32_t> cells;
+    std::vector<shared_ptr<Hittable>> primitives; // cell by cell
+    uint32_t large_first = 0; // the large ones follow the last cell
+    std::vector<AABB> large_boxes;
+    TypedLeaves typed;
+
+    bool has_box = false;
+    AABB box;
+
+    int cellIndex(int x, int y, int z) const
+    {
+        return (z * resolution[1] + y) * resolution[0] + x;
+    }
+
+    int cellCoordinate(double p, int axis) const
+    {
+        int c = static_cast<int>((p - bounds.min()[axis]) * inv_cell_size[axis]);
+        return c < 0 ? 0 : (c < resolution[axis] ? c : resolution[axis] - 1);
+    }
+
+    // Steps through the cells the ray crosses inside [t_min, t_max],
+    //  calling visit(first, count) on each non-empty one until it
+    //  returns true or t_max is reached; visit may shrink t_max.
+    template <typename Visit>
+    void traverse(const Ray &r, double t_min, double &t_max, Visit visit) const;
+
+public:
+    UniformGrid() {}
+
+    // about `density` cells per primitive in cells
+    UniformGrid(HittableList &list, double time0, double time1,
+                double density = 4.0, bool typed_leaves = true);
+
+    // primitives kept out of the cells and tested against every ray
+    size_t largeCount() const { return primitives.size() - large_first; }
+
+    bool hit(const Ray &r, double t_min,
+             double t_max, HitRecord &rec) const override
+    {
+        bool hit_anything = hitBoxed(primitives, large_first, large_boxes,
+                                     r, t_min, t_max, rec);
+        traverse(r, t_min, t_max,
+                 [&](uint32_t first, uint32_t count)
+                 {
+                     if (typed.hit(primitives, first, count, r, t_min, t_max, rec))
+                         hit_anything = true;
+                     return false;
+                 });
+        return hit_anything;
+    }
+
+    bool occluded(const Ray &r, double t_min, double t_max) const override
+    {
+        if (occludedBoxed(primitives, large_first, large_boxes, r, t_min, t_max))
+            return true;
+        bool occluded = false;
+        traverse(r, t_min, t_max,
+                 [&](uint32_t first, uint32_t count)
+                 { return occluded = typed.occluded(primitives, first, count,
+                                                    r, t_min, t_max); });
+        return occluded;
+    }
+
+    bool boundingBox(double t0, double t1,
+                     AABB &output_box) const override
+    {
+        output_box = box;
+        return has_box;
+    }
+
+    size_t memoryUsage() const override
+    {
+        return cells.capacity() * sizeof(uint32_t) +
+               primitives.capacity() * sizeof(shared_ptr<Hittable>) +
+               large_boxes.capacity() * sizeof(AABB) + typed.memoryUsage();
+    }
+};
+
+UniformGrid::UniformGrid(HittableList &list, double time0, double time1,
+                         double density, bool typed_leaves)
+{
+    const auto &objects = list.objects;
+    size_t n = objects.size();
+    std::vector<AABB> boxes(n);
+    std::vector<bool> bounded(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        bounded[i] = objects[i]->boundingBox(time0, time1, boxes[i]);
+        // unbounded objects are tested against every ray
+        if (!bounded[i])
+            std::cerr << "[ERROR]: No bounding box in UniformGrid constructor.\n";
+    }
+
+    has_box = n > 0;
+    AABB centroids;
+    size_t n_bounded = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        has_box = has_box && bounded[i];
+        if (bounded[i])
+        {
+            auto c = boxes[i].centroid();
+            box = n_bounded ? surroundingBox(box, boxes[i]) : boxes[i];
+            centroids = n_bounded ? surroundingBox(centroids, c) : AABB(c, c);
+            ++n_bounded;
+        }
+    }
+
+    // anything wider than half the spread of the centroids is large, but
+    //  only the widest of them if there are many: when the centroids
+    //  (nearly) coincide, e.g. concentric spheres, all of them would be
+    //  and every ray would test every primitive
+    auto spread = (centroids.max() - centroids.min()).length();
+    std::vector<std::pair<double, size_t>> wide;
+    for (size_t i = 0; i < n; ++i)
+    {
+        auto size = (boxes[i].max() - boxes[i].min()).length();
+        if (bounded[i] && size > 0.5 * spread)
+            wide.emplace_back(size, i);
+    }
+    size_t max_large = std::max(GRID_MIN_LARGE, n_bounded / GRID_LARGE_SHARE);
+    if (wide.size() > max_large)
+    {
+        std::nth_element(wide.begin(), wide.begin() + max_large, wide.end(),
+                         std::greater<std::pair<double, size_t>>());
+        wide.resize(max_large);
+    }
+    std::vector<bool> large(n);
+    for (size_t i = 0; i < n; ++i)
+        large[i] = !bounded[i];
+    for (const auto &entry : wide)
+        large[entry.second] = true;
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (large[i])
+            continue;
+        bounds = bounds_set ? surroundingBox(bounds, boxes[i]) : boxes[i];
+        bounds_set = true;
+    }
+
+    if (bounds_set)
+    {
+        // cubic cells, as many per unit length as density * n cubic
+        //  cells would have in a cube as wide as the widest side
+        auto extent = bounds.max() - bounds.min();
+        double widest = std::max(extent.x(), std::max(extent.y(), extent.z()));
+        double n_gridded = std::count(large.begin(), large.end(), false);
+        double cells_per_unit = widest > 0 ? std::cbrt(density * n_gridded) / widest : 0;
+        for (int a = 0; a < 3; ++a)
+        {
+            int res = static_cast<int>(std::round(extent[a] * cells_per_unit));
+            resolution[a] = std::max(1, std::min(res, GRID_MAX_RESOLUTION));
+            cell_size[a] = extent[a] / resolution[a];
+            inv_cell_size[a] = cell_size[a] > 0 ? 1 / cell_size[a] : 0;
+        }
+    }
+
+    std::vector<size_t> gridded;
+    std::vector<int> lo(3 * n), hi(3 * n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (large[i])
+            continue;
+        bool one_cell = true;
+        for (int a = 0; a < 3; ++a)
+        {
+            lo[3 * i + a] = cellCoordinate(boxes[i].min()[a], a);
+            hi[3 * i + a] = cellCoordinate(boxes[i].max()[a], a);
+            one_cell = one_cell && lo[3 * i + a] == hi[3 * i + a];
+        }
+        large[i] = !one_cell && leafType(*objects[i]) == LeafType::Other;
+        if (!large[i])
+            gridded.push_back(i);
+    }
+
+    // count the references of every cell, then place them
+    size_t n_cells = static_cast<size_t>(resolution[0]) * resolution[1] * resolution[2];
+    cells.assign(n_cells + 1, 0);
+    for (auto i : gridded)
+        for (int z = lo[3 * i + 2]; z <= hi[3 * i + 2]; ++z)
+            for (int y = lo[3 * i + 1]; y <= hi[3 * i + 1]; ++y)
+                for (int x = lo[3 * i]; x <= hi[3 * i]; ++x)
+                    ++cells[cellIndex(x, y, z) + 1];
+    for (size_t c = 0; c < n_cells; ++c)
+        cells[c + 1] += cells[c];
+
+    large_first = cells[n_cells];
+    primitives.resize(large_first);
+    std::vector<uint32_t> next(cells.begin(), cells.end() - 1);
+    for (auto i : gridded)
+        for (int z = lo[3 * i + 2]; z <= hi[3 * i + 2]; ++z)
+            for (int y = lo[3 * i + 1]; y <= hi[3 * i + 1]; ++y)
+                for (int x = lo[3 * i]; x <= hi[3 * i]; ++x)
+                    primitives[next[cellIndex(x, y, z)]++] = objects[i];
+    for (size_t i = 0; i < n; ++i)
+        if (large[i])
+        {
+            primitives.push_back(objects[i]);
+            large_boxes.push_back(bounded[i] ? boxes[i] : AABB(Point3(-INF, -INF, -INF),
+                                                               Point3(INF, INF, INF)));
+        }
+
+    if (typed_leaves)
+    {
+        std::vector<std::pair<uint32_t, uint32_t>> leaves;
+        for (size_t c = 0; c < n_cells; ++c)
+            leaves.emplace_back(cells[c], cells[c + 1]);
+        typed = TypedLeaves(primitives, leaves);
+    }
+}
+
+template <typename Visit>
+void UniformGrid::traverse(const Ray &r, double t_min, double &t_max, Visit visit) const
+{
+    if (!bounds_set)
+        return;
+
+    Vec3 inv_d(1 / r.direction().x(),
+               1 / r.direction().y(),
+               1 / r.direction().z());
+    double t_enter = t_min, t_exit = t_max;
+    if (!bounds.clipRay(r, inv_d, t_enter, t_exit))
+        return;
+
+    // the cell the ray enters, and the distances to the next cell
+    //  boundary along every axis and between two boundaries
+    auto p = r.at(t_enter);
+    int cell[3], step[3], end[3];
+    double next_t[3], delta_t[3];
+    for (int a = 0; a < 3; ++a)
+    {
+        cell[a] = cellCoordinate(p[a], a);
+        double d = r.direction()[a];
+        if (d > 0)
+        {
+            step[a] = 1;
+            end[a] = resolution[a];
+            next_t[a] = t_enter + (bounds.min()[a] + (cell[a] + 1) * cell_size[a] - p[a]) / d;
+            delta_t[a] = cell_size[a] / d;
+        }
+        else if (d < 0)
+        {
+            step[a] = -1;
+            end[a] = -1;
+            next_t[a] = t_enter + (bounds.min()[a] + cell[a] * cell_size[a] - p[a]) / d;
+            delta_t[a] = -cell_size[a] / d;
+        }
+        else
+        {
+            step[a] = 0;
+            end[a] = -1;
+            next_t[a] = INF;
+            delta_t[a] = 0;
+        }
+    }
+
+    while (true)
+    {
+        int c = cellIndex(cell[0], cell[1], cell[2]);
+        uint32_t first = cells[c], count = cells[c + 1] - first;
+        BVH_STATS_COUNT(node_tests);
+        if (count > 0 && visit(first, count))
+            return;
+
+        int axis = next_t[0] < next_t[1]
+                       ? (next_t[0] < next_t[2] ? 0 : 2)
+                       : (next_t[1] < next_t[2] ? 1 : 2);
+        // a hit before the exit of this cell cannot be beaten
+        //  by anything in the cells further along
+        if (t_max < next_t[axis] || next_t[axis] > t_exit)
+            return;
+        cell[axis] += step[axis];
+        if (cell[axis] == end[axis])
+            return;
+        next_t[axis] += delta_t[axis];
+    }
+}
@@ -7,6 +7,121 @@
 // F(x, y, z) = (x ^ 2 + P * y ^ 2 + z ^ 2 - 1) ^ 3 - x ^ 2 * z ^ 3 - Q * y ^ 2 * z ^ 3
 // x, y, z = > z, x, y :
 //  (z ^ 2 + P * x ^ 2 + y ^ 2 - 1) ^ 3 - z ^ 2 * y ^ 3 - Q * x ^ 2 * y ^ 3
+//
+// Along a ray F is a polynomial of degree 6, so hit() clips the ray to
+//  the bounding box, expands F in the distance travelled inside it and
+//  finds the first root of that polynomial: the roots of its derivative
+//  cut [0, length] into pieces on which F is monotonic, and the first
+//  piece whose ends differ in sign holds exactly one root, refined by
+//  Newton's method kept inside the piece. The derivative's roots come
+//  from the same procedure one degree lower, down to a quadratic.
+
+// c[0] + c[1] * s + ... + c[N] * s ^ N
+template <int N>
+inline double evalPolynomial(const double *c, double s)
+{
+    double value = c[N];
+    for (int i = N - 1; i >= 0; --i)
+        value = value * s + c[i];
+    return value;
+}
+
+// the single root in [lo, hi] of a polynomial that is monotonic there
+//  and whose value at lo has the sign of f_lo
+template <int N>
+inline double refinePolynomialRoot(const double *c, double lo, double hi, double f_lo)
+{
+    double d[N];
+    for (int i = 0; i < N; ++i)
+        d[i] = (i + 1) * c[i + 1];
+
+    double s = 0.5 * (lo + hi);
+    for (int i = 0; i < 64; ++i)
+    {
+        double f = evalPolynomial<N>(c, s);
+        if (f == 0)
+            return s;
+        if ((f < 0) == (f_lo < 0))
+            lo = s;
+        else
+            hi = s;
+        // bisect whenever Newton leaves the bracket (or divides by zero)
+        double next = s - f / evalPolynomial<N - 1>(d, s);
+        if (!(next > lo && next < hi))
+            next = 0.5 * (lo + hi);
+        if (fabs(next - s) <= 1e-12 * (1 + fabs(s)))
+            return next;
+        s = next;
+    }
+    return s;
+}
+
+// roots of c in [lo, hi], ascending; only the first one if `first_only`
+template <int N>
+inline int polynomialRoots(const double *c, double lo, double hi,
+                           double *roots, bool first_only = false)
+{
+    double d[N];
+    for (int i = 0; i < N; ++i)
+        d[i] = (i + 1) * c[i + 1];
+    double ends[N + 1];
+    int n_ends = polynomialRoots<N - 1>(d, lo, hi, ends);
+    ends[n_ends++] = hi;
+
+    int n = 0;
+    double a = lo, f_a = evalPolynomial<N>(c, lo);
+    for (int i = 0; i < n_ends; ++i)
+    {
+        double b = ends[i], f_b = evalPolynomial<N>(c, b);
+        if (f_a == 0 || (f_a < 0) != (f_b < 0))
+        {
+            roots[n++] = f_a == 0 ? a : refinePolynomialRoot<N>(c, a, b, f_a);
+            if (first_only)
+                return n;
+        }
+        // a root exactly at b is found from the next piece
+        a = b;
+        f_a = f_b;
+    }
+    return n;
+}
+
+template <>
+inline int polynomialRoots<2>(const double *c, double lo, double hi,
+                              double *roots, bool first_only)
+{
+    double r[2];
+    int n = 0;
+    if (c[2] == 0)
+    {
+        if (c[1] == 0)
+            return 0;
+        r[n++] = -c[0] / c[1];
+    }
+    else
+    {
+        double discriminant = c[1] * c[1] - 4 * c[2] * c[0];
+        if (discriminant < 0)
+            return 0;
+        // no cancellation between -c[1] and the square root
+        double q = -0.5 * (c[1] + (c[1] < 0 ? -1 : 1) * sqrt(discriminant));
+        r[n++] = q / c[2];
+        if (q != 0)
+            r[n++] = c[0] / q;
+        if (n == 2 && r[0] > r[1])
+            std::swap(r[0], r[1]);
+    }
+
+    int m = 0;
+    for (int i = 0; i < n; ++i)
+        if (r[i] >= lo && r[i] <= hi)
+        {
+            roots[m++] = r[i];
+            if (first_only)
+                break;
+        }
+    return m;
+}
 
 class Heart : public Hittable
 {
@@ -17,39 +132,86 @@ private:
 
     static constexpr double P = 9.0 / 4;
     static constexpr double Q = 9.0 / 80;
-    static constexpr double eps = 0.000001;
+
+    // F <= 0 lies within these, in units of scale
+    static Vec3 extentMin() { return Vec3(-0.75, -1.05, -1.2); }
+    static Vec3 extentMax() { return Vec3(0.75, 1.3, 1.2); }
 
     inline double square(double x) const { return x * x; }
     inline double cubic(double x) const { return x * x * x; }
-    inline double F(Point3 pos) const
-    {
-        pos = pos - origin;
-        double ratio = 1 / fabs(scale);
-        double x = pos.x() * ratio, y = pos.y() * ratio, z = pos.z() * ratio;
-        return cubic(square(z) + P * square(x) + square(y) - 1) -
-               square(z) * cubic(y) - Q * square(x) * cubic(y);
-    }
-    inline double Fx(Point3 pos) const
+
+    // the gradient of F, which points outwards as F > 0 outside
+    inline Vec3 gradient(Point3 pos) const
     {
         pos = pos - origin;
         double ratio = 1 / fabs(scale);
         double x = pos.x() * ratio, y = pos.y() * ratio, z = pos.z() * ratio;
-        return 6 * square(square(z) + P * square(x) + square(y) - 1) * P * x - 2 * Q * cubic(y) * x;
+        double g = 6 * square(square(z) + P * square(x) + square(y) - 1);
+        return Vec3(g * P * x - 2 * Q * cubic(y) * x,
+                    g * y - 3 * square(y) * square(z) - 3 * Q * square(y) * square(x),
+                    g * z - 2 * cubic(y) * z);
     }
-    inline double Fy(Point3 pos) const
+
+    // F(a + s * u), with s in units of scale, as c[0] + c[1] * s + ... + c[6] * s ^ 6
+    void expand(const Vec3 &a, const Vec3 &u, double c[7]) const
     {
-        pos = pos - origin;
-        double ratio = 1 / fabs(scale);
-        double x = pos.x() * ratio, y = pos.y() * ratio, z = pos.z() * ratio;
-        return 6 * square(square(z) + P * square(x) + square(y) - 1) * y -
-               3 * square(y) * square(z) - 3 * Q * square(y) * square(x);
+        // squares of the coordinates, each a quadratic in s
+        double xx[3] = {a.x() * a.x(), 2 * a.x() * u.x(), u.x() * u.x()};
+        double yy[3] = {a.y() * a.y(), 2 * a.y() * u.y(), u.y() * u.y()};
+        double zz[3] = {a.z() * a.z(), 2 * a.z() * u.z(), u.z() * u.z()};
+
+        double g[3], h[3];
+        for (int i = 0; i < 3; ++i)
+        {
+            g[i] = zz[i] + P * xx[i] + yy[i];
+            h[i] = zz[i] + Q * xx[i];
+        }
+        g[0] -= 1;
+
+        double g2[5] = {}, y3[4] = {};
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 3; ++j)
+                g2[i + j] += g[i] * g[j];
+        for (int i = 0; i < 3; ++i)
+        {
+            y3[i] += yy[i] * a.y();
+            y3[i + 1] += yy[i] * u.y();
+        }
+
+        for (int i = 0; i < 7; ++i)
+            c[i] = 0;
+        for (int i = 0; i < 5; ++i)
+            for (int j = 0; j < 3; ++j)
+                c[i + j] += g2[i] * g[j];
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 4; ++j)
+                c[i + j] -= h[i] * y3[j];
     }
-    inline double Fz(Point3 pos) const
+
+    // the first t in [t_min, t_max] where the ray meets the surface
+    bool firstRoot(const Ray &r, double t_min, double t_max, double &t) const
     {
-        pos = pos - origin;
+        AABB box;
+        boundingBox(0, 1, box);
+        Vec3 inv_d(1 / r.direction().x(),
+                   1 / r.direction().y(),
+                   1 / r.direction().z());
+        if (!box.clipRay(r, inv_d, t_min, t_max))
+            return false;
+
+        // start where the ray enters the box, and measure s in units of
+        //  scale, so the coefficients stay small wherever the ray begins
         double ratio = 1 / fabs(scale);
-        double x = pos.x() * ratio, y = pos.y() * ratio, z = pos.z() * ratio;
-        return 6 * square(square(z) + P * square(x) + square(y) - 1) * z - 2 * cubic(y) * z;
+        double speed = r.direction().length() * ratio;
+        Vec3 a = (r.at(t_min) - origin) * ratio;
+        Vec3 u = r.direction() * (ratio / speed);
+
+        double c[7], s;
+        expand(a, u, c);
+        if (!polynomialRoots<6>(c, 0, (t_max - t_min) * speed, &s, true))
+            return false;
+        t = t_min + s / speed;
+        return t <= t_max;
     }
 
 public:
@@ -61,51 +223,13 @@ public:
     bool hit(const Ray &r, double t_min,
              double t_max, HitRecord &rec) const override
     {
-        // use Newton's method to find solution
-
-        // 50 iterations: suppose to get 2 different solutions (not exact)
-        const int n_step = 50;
-        Point3 p;
-        double t1 = std::min(t_min + 50, t_max);
-        for (int i = 0; i < n_step; ++i)
-        {
-            p = r.at(t1);
-            double val = F(p);
-            if (fabs(val) < eps)
-                break;
-            double step = val / (Fx(p) * r.direction().x() / fabs(scale) +
-                                 Fy(p) * r.direction().y() / fabs(scale) +
-                                 Fz(p) * r.direction().z() / fabs(scale));
-            t1 -= step;
-        }
-
-        double t0 = std::max(
-            t_min, t1 - scale * randomReal(0.1, 0.2));
-        for (int i = 0; i < n_step; ++i)
-        {
-            p = r.at(t0);
-            double val = F(p);
-            if (fabs(val) < eps)
-                break;
-            double step = val / (Fx(p) * r.direction().x() / fabs(scale) +
-                                 Fy(p) * r.direction().y() / fabs(scale) +
-                                 Fz(p) * r.direction().z() / fabs(scale));
-            t0 -= step;
-        }
-
-        if (t0 < t_min || t0 > t_max ||
-            (t0 > t1 && (t1 > t_min && t1 < t_max) &&
-             fabs(F(r.at(t1))) < eps))
-            t0 = t1;
-        if (fabs(F(r.at(t0))) > eps)
+        double t;
+        if (!firstRoot(r, t_min, t_max, t))
             return false;
 
-        rec.t = t0;
-        rec.p = r.at(t0);
-        Vec3 out = rec.p - origin;
-        Vec3 outward_norm(Fx(rec.p), Fy(rec.p), Fz(rec.p));
-        if (dot(out, outward_norm) < 0)
-            outward_norm = -outward_norm;
+        rec.t = t;
+        rec.p = r.at(t);
+        Vec3 outward_norm = gradient(rec.p);
         if (scale < 0)
             outward_norm = -outward_norm;
         outward_norm = unitVector(outward_norm);
@@ -114,11 +238,17 @@ public:
         return true;
     }
 
+    bool occluded(const Ray &r, double t_min, double t_max) const override
+    {
+        double t;
+        return firstRoot(r, t_min, t_max, t);
+    }
+
     bool boundingBox(double t0, double t1,
                      AABB &output_box) const override
     {
-        output_box = AABB(origin - Vec3(2, 2, 2) * fabs(scale),
-                          origin + Vec3(2, 2, 2) * fabs(scale));
+        output_box = AABB(origin + extentMin() * fabs(scale),
+                          origin + extentMax() * fabs(scale));
         return true;
     }
 };
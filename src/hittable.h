@@ -21,6 +21,35 @@ struct HitRecord
     }
 };
 
+// Up to 8x8 coherent rays, e.g. the camera rays of one sample through
+//  a tile of pixels, intersected together by Hittable::hitPacket.
+const int RAY_PACKET_WIDTH = 8;
+const int RAY_PACKET_SIZE = RAY_PACKET_WIDTH * RAY_PACKET_WIDTH;
+
+struct RayPacket
+{
+    int n = 0;
+    Ray rays[RAY_PACKET_SIZE];
+    int x[RAY_PACKET_SIZE], y[RAY_PACKET_SIZE]; // pixel of each ray
+
+    // the nearest hit so far of each ray, its t bounding the rest
+    bool hit[RAY_PACKET_SIZE];
+    double t_max[RAY_PACKET_SIZE];
+    HitRecord rec[RAY_PACKET_SIZE];
+
+    void clear() { n = 0; }
+
+    void add(const Ray &r, int px, int py)
+    {
+        rays[n] = r;
+        x[n] = px;
+        y[n] = py;
+        hit[n] = false;
+        t_max[n] = INF;
+        ++n;
+    }
+};
+
 class Hittable
 {
 public:
@@ -28,8 +57,40 @@ public:
         const Ray &r, double t_min,
         double t_max, HitRecord &rec) const = 0;
 
+    // whether anything is hit between t_min and t_max, for shadow and
+    //  visibility rays: may stop at any hit, and computes no attributes
+    virtual bool occluded(
+        const Ray &r, double t_min, double t_max) const
+    {
+        HitRecord rec;
+        return hit(r, t_min, t_max, rec);
+    }
+
+    // Intersects every ray of the packet, keeping for each the nearer
+    //  of its hit so far and the one found here.
+    // Acceleration structures that can share work between the rays
+    //  override this; by default the rays are traced one by one.
+    virtual void hitPacket(RayPacket &packet, double t_min) const
+    {
+        for (int i = 0; i < packet.n; ++i)
+            if (hit(packet.rays[i], t_min, packet.t_max[i], packet.rec[i]))
+            {
+                packet.hit[i] = true;
+                packet.t_max[i] = packet.rec[i].t;
+            }
+    }
+
     virtual bool boundingBox(
         double t0, double t1, AABB &output_box) const = 0;
+
+    // bounds of the part inside `clip`, false if nothing is inside;
+    //  used by spatial BVH splits, tighter bounds make better splits
+    virtual bool clippedBox(
+        double t0, double t1, const AABB &clip, AABB &output_box) const
+    {
+        AABB box;
+        return boundingBox(t0, t1, box) && overlapBox(box, clip, output_box);
+    }
 };
 
 class FlipFace : public Hittable
@@ -49,6 +110,11 @@ public:
         return true;
     }
 
+    bool occluded(const Ray &r, double t_min, double t_max) const override
+    {
+        return ptr->occluded(r, t_min, t_max);
+    }
+
     bool boundingBox(double t0, double t1,
                      AABB &output_box) const override
     {
@@ -79,6 +145,12 @@ public:
         return true;
     }
 
+    bool occluded(const Ray &r, double t_min, double t_max) const override
+    {
+        Ray moved_r(r.origin() - offset, r.direction(), r.time());
+        return ptr->occluded(moved_r, t_min, t_max);
+    }
+
     bool boundingBox(double t0, double t1,
                      AABB &output_box) const override
     {
@@ -99,6 +171,21 @@ private:
     bool hasbox;
     AABB bbox;
 
+    // world space -> object space
+    Ray rotateRay(const Ray &r) const
+    {
+        auto origin = r.origin();
+        auto direction = r.direction();
+
+        origin[0] = cos_theta * r.origin()[0] - sin_theta * r.origin()[2];
+        origin[2] = sin_theta * r.origin()[0] + cos_theta * r.origin()[2];
+
+        direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
+        direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
+
+        return Ray(origin, direction, r.time());
+    }
+
 public:
     RotateY(shared_ptr<Hittable> p, double angle) : ptr(p)
     {
@@ -136,16 +223,7 @@ public:
     bool hit(const Ray &r, double t_min,
              double t_max, HitRecord &rec) const override
     {
-        auto origin = r.origin();
-        auto direction = r.direction();
-
-        origin[0] = cos_theta * r.origin()[0] - sin_theta * r.origin()[2];
-        origin[2] = sin_theta * r.origin()[0] + cos_theta * r.origin()[2];
-
-        direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
-        direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
-
-        Ray rotated_r(origin, direction, r.time());
+        Ray rotated_r = rotateRay(r);
 
         if (!ptr->hit(rotated_r, t_min, t_max, rec))
             return false;
@@ -165,6 +243,11 @@ public:
         return true;
     }
 
+    bool occluded(const Ray &r, double t_min, double t_max) const override
+    {
+        return ptr->occluded(rotateRay(r), t_min, t_max);
+    }
+
     bool boundingBox(double t0, double t1,
                      AABB &output_box) const override
     {
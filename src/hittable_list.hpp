@@ -7,6 +7,9 @@
 class HittableList : public Hittable
 {
     friend class BVHNode;
+    friend class UniformGrid;
+    friend class KdTree;
+    friend class LazyBVH;
 
 private:
     std::vector<shared_ptr<Hittable>> objects;
@@ -38,6 +41,20 @@ public:
         return hit_anything;
     }
 
+    bool occluded(const Ray &r, double t_min, double t_max) const override
+    {
+        for (const auto &object : objects)
+            if (object->occluded(r, t_min, t_max))
+                return true;
+        return false;
+    }
+
+    void hitPacket(RayPacket &packet, double t_min) const override
+    {
+        for (const auto &object : objects)
+            object->hitPacket(packet, t_min);
+    }
+
     bool boundingBox(double t0, double t1,
                      AABB &output_box) const override
     {
@@ -0,0 +1,194 @@
+// Two-level acceleration structure:
+//  a bottom-level structure (usually a BVH) is built once per geometry,
+//  every Instance of it only stores a transform and a shared pointer,
+//  and a top-level BVH is built over the instances.
+
+#pragma once
+
+#include "raytracer.h"
+#include "hittable.h"
+#include "aabb.hpp"
+
+// affine transform p -> L * p + t, stored as the 3x4 matrix [L | t]
+struct Transform
+{
+    double m[3][4] = {{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}};
+
+    static Transform translation(const Vec3 &offset)
+    {
+        Transform a;
+        for (int i = 0; i < 3; ++i)
+            a.m[i][3] = offset[i];
+        return a;
+    }
+
+    static Transform scaling(const Vec3 &factor)
+    {
+        Transform a;
+        for (int i = 0; i < 3; ++i)
+            a.m[i][i] = factor[i];
+        return a;
+    }
+
+    // by `angle` degrees about `axis`, counterclockwise looking down the axis
+    static Transform rotation(const Vec3 &axis, double angle)
+    {
+        auto radians = deg2rad(angle);
+        double s = sin(radians), c = cos(radians);
+        Vec3 k = unitVector(axis);
+        Transform a;
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 3; ++j)
+                a.m[i][j] = (1 - c) * k[i] * k[j] + (i == j ? c : 0);
+        a.m[0][1] -= s * k.z();
+        a.m[0][2] += s * k.y();
+        a.m[1][0] += s * k.z();
+        a.m[1][2] -= s * k.x();
+        a.m[2][0] -= s * k.y();
+        a.m[2][1] += s * k.x();
+        return a;
+    }
+
+    Point3 point(const Point3 &p) const
+    {
+        return Point3(m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+                      m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+                      m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+    }
+
+    Vec3 vector(const Vec3 &v) const
+    {
+        return Vec3(m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+                    m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+                    m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+    }
+
+    // by L^-T, which keeps normals perpendicular to transformed surfaces;
+    //  called on the inverse transform, that is L^-T of the forward one
+    Vec3 normal(const Vec3 &n) const
+    {
+        return Vec3(m[0][0] * n.x() + m[1][0] * n.y() + m[2][0] * n.z(),
+                    m[0][1] * n.x() + m[1][1] * n.y() + m[2][1] * n.z(),
+                    m[0][2] * n.x() + m[1][2] * n.y() + m[2][2] * n.z());
+    }
+
+    double determinant() const
+    {
+        return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+               m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+               m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    }
+
+    // [L | t]^-1 = [L^-1 | -L^-1 * t]
+    Transform inverse() const
+    {
+        Transform a;
+        double det = determinant();
+        if (det == 0)
+        {
+            std::cerr << "[ERROR]: Singular transform has no inverse.\n";
+            return a;
+        }
+        double inv_det = 1 / det;
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 3; ++j)
+            {
+                // cofactor of (j, i), from the cyclic neighbours
+                int j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+                int i1 = (i + 1) % 3, i2 = (i + 2) % 3;
+                a.m[i][j] = (m[j1][i1] * m[j2][i2] - m[j1][i2] * m[j2][i1]) * inv_det;
+            }
+        for (int i = 0; i < 3; ++i)
+            a.m[i][3] = -(a.m[i][0] * m[0][3] + a.m[i][1] * m[1][3] + a.m[i][2] * m[2][3]);
+        return a;
+    }
+};
+
+// (a * b).point(p) == a.point(b.point(p)), so the rightmost applies first
+inline Transform operator*(const Transform &a, const Transform &b)
+{
+    Transform c;
+    for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 4; ++j)
+        {
+            c.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+            if (j == 3)
+                c.m[i][j] += a.m[i][3];
+        }
+    return c;
+}
+
+// any rotation, scale and translation in a single step: rays are moved
+//  into object space by one precomputed matrix, and hits are moved back
+//  by its inverse and, for normals, its inverse-transpose
+class Instance : public Hittable
+{
+private:
+    shared_ptr<Hittable> blas;
+    Transform object_to_world;
+    Transform world_to_object;
+
+    // the direction is not normalized, so t is the same in both spaces
+    Ray toObject(const Ray &r) const
+    {
+        return Ray(world_to_object.point(r.origin()),
+                   world_to_object.vector(r.direction()), r.time());
+    }
+
+public:
+    Instance(shared_ptr<Hittable> blas, const Transform &object_to_world)
+        : blas(blas), object_to_world(object_to_world),
+          world_to_object(object_to_world.inverse()) {}
+
+    // rotate about y by `angle` degrees, then translate by `offset`
+    Instance(shared_ptr<Hittable> blas,
+             double angle, const Vec3 &offset)
+        : Instance(blas, Transform::translation(offset) *
+                             Transform::rotation(Vec3(0, 1, 0), angle)) {}
+
+    bool hit(const Ray &r, double t_min,
+             double t_max, HitRecord &rec) const override
+    {
+        if (!blas->hit(toObject(r), t_min, t_max, rec))
+            return false;
+
+        // dot(L * d, L^-T * n) == dot(d, n), so the normal still faces
+        //  against the ray and front_face stays valid, even under
+        //  non-uniform scale
+        rec.p = object_to_world.point(rec.p);
+        rec.normal = unitVector(world_to_object.normal(rec.normal));
+        return true;
+    }
+
+    bool occluded(const Ray &r, double t_min, double t_max) const override
+    {
+        return blas->occluded(toObject(r), t_min, t_max);
+    }
+
+    // the exact box around the transformed box: per output axis, every
+    //  entry of L picks whichever end of the input range gives the
+    //  lower (upper) product, which equals transforming all 8 corners
+    bool boundingBox(double t0, double t1,
+                     AABB &output_box) const override
+    {
+        AABB bbox;
+        if (!blas->boundingBox(t0, t1, bbox))
+            return false;
+
+        Point3 min, max;
+        for (int i = 0; i < 3; ++i)
+        {
+            min[i] = max[i] = object_to_world.m[i][3];
+            for (int j = 0; j < 3; ++j)
+            {
+                double a = object_to_world.m[i][j] * bbox.min()[j];
+                double b = object_to_world.m[i][j] * bbox.max()[j];
+                min[i] += fmin(a, b);
+                max[i] += fmax(a, b);
+            }
+        }
+
+        output_box = AABB(min, max);
+        return true;
+    }
+};
@@ -0,0 +1,358 @@
+// kd-tree: space is split in two by axis-aligned planes chosen with the
+//  surface area heuristic, and a primitive is listed in every leaf cell
+//  its geometry reaches (Wald and Havran, "On building fast kd-trees
+//  for ray tracing", 2006; the node layout and traversal follow pbrt).
+//
+// Unlike a BVH the cells never overlap, so a ray visits them front to
+//  back and stops at the first cell holding a hit, at the cost of
+//  references repeated across cells and a slower build.
+// A primitive that TypedLeaves does not pack is never repeated: once
+//  it straddles a split, it is tested against every ray instead.
+//  Repeating it would test it several times per ray, and ConstantMedium
+//  draws a new distance each time.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include "raytracer.h"
+#include "hittable.h"
+#include "accelerator.h"
+#include "hittable_list.hpp"
+#include "aabb.hpp"
+#include "typed_leaves.hpp"
+
+struct KdTreeOptions
+{
+    double traversal_cost = 1.0;  // cost of visiting one node,
+    double intersect_cost = 80.0; //  relative to one primitive test
+    double empty_bonus = 0.5;     // discount for splits with an empty side
+    int max_leaf_size = 1;        // larger cells are split if it pays off
+    int max_depth = -1;           // 8 + 1.3 log2(n) if negative
+
+    // see BVHBuildOptions::typed_leaves
+    bool typed_leaves = true;
+};
+
+// 8 bytes: interior nodes hold the split position and the index of
+//  the child above it, the child below follows its parent directly;
+//  leaves hold `count` primitives starting at `first`.
+struct KdTreeNode
+{
+    union
+    {
+        float split;    // interior
+        uint32_t first; // leaf
+    };
+    uint32_t flags; // split axis in the low 2 bits, 3 for a leaf,
+                    //  then the above child or the count
+
+    bool isLeaf() const { return (flags & 3) == 3; }
+    int axis() const { return flags & 3; }
+    uint32_t aboveChild() const { return flags >> 2; }
+    uint32_t count() const { return flags >> 2; }
+};
+
+const int KD_TREE_STACK_SIZE = 64;
+
+class KdTree : public Accelerator
+{
+private:
+    std::vector<KdTreeNode> nodes;
+    std::vector<shared_ptr<Hittable>> primitives; // leaf by leaf
+    uint32_t unsplit_first = 0; // the straddling ones follow the leaves
+    std::vector<AABB> unsplit_boxes;
+    TypedLeaves typed;
+    KdTreeOptions options;
+    AABB bounds;
+    bool has_box = false;
+
+    // a primitive in the cell being built, with its box clipped to it
+    struct KdTreeRef
+    {
+        size_t index;
+        AABB box;
+    };
+
+    struct KdTreeBuild
+    {
+        const std::vector<shared_ptr<Hittable>> &objects;
+        double time0, time1;
+        std::vector<bool> splittable; // packed by TypedLeaves
+        std::vector<size_t> unsplit;
+    };
+
+    void buildNode(KdTreeBuild &build, const AABB &cell,
+                   std::vector<KdTreeRef> &refs, int depth, int bad_refines);
+
+    // visits the leaves the ray crosses inside [t_min, t_max] front to
+    //  back, calling visit(first, count) on each until it returns true;
+    //  visit may shrink t_max
+    template <typename Visit>
+    void traverse(const Ray &r, double t_min, double &t_max, Visit visit) const;
+
+public:
+    KdTree() {}
+
+    KdTree(HittableList &list, double time0, double time1,
+           const KdTreeOptions &options = KdTreeOptions());
+
+    bool hit(const Ray &r, double t_min,
+             double t_max, HitRecord &rec) const override
+    {
+        bool hit_anything = hitBoxed(primitives, unsplit_first, unsplit_boxes,
+                                     r, t_min, t_max, rec);
+        traverse(r, t_min, t_max,
+                 [&](uint32_t first, uint32_t count)
+                 {
+                     if (typed.hit(primitives, first, count, r, t_min, t_max, rec))
+                         hit_anything = true;
+                     return false;
+                 });
+        return hit_anything;
+    }
+
+    bool occluded(const Ray &r, double t_min, double t_max) const override
+    {
+        if (occludedBoxed(primitives, unsplit_first, unsplit_boxes, r, t_min, t_max))
+            return true;
+        bool occluded = false;
+        traverse(r, t_min, t_max,
+                 [&](uint32_t first, uint32_t count)
+                 { return occluded = typed.occluded(primitives, first, count,
+                                                    r, t_min, t_max); });
+        return occluded;
+    }
+
+    bool boundingBox(double t0, double t1,
+                     AABB &output_box) const override
+    {
+        output_box = bounds;
+        return has_box;
+    }
+
+    size_t memoryUsage() const override
+    {
+        return nodes.capacity() * sizeof(KdTreeNode) +
+               primitives.capacity() * sizeof(shared_ptr<Hittable>) +
+               unsplit_boxes.capacity() * sizeof(AABB) + typed.memoryUsage();
+    }
+};
+
+KdTree::KdTree(HittableList &list, double time0, double time1,
+               const KdTreeOptions &options)
+    : options(options)
+{
+    const auto &objects = list.objects;
+    std::vector<KdTreeRef> refs;
+    has_box = !objects.empty();
+    for (size_t i = 0; i < objects.size(); ++i)
+    {
+        AABB box;
+        if (!objects[i]->boundingBox(time0, time1, box))
+        {
+            std::cerr << "[ERROR]: No bounding box in KdTree constructor.\n";
+            has_box = false;
+            continue;
+        }
+        bounds = refs.empty() ? box : surroundingBox(bounds, box);
+        refs.push_back({i, box});
+    }
+    if (refs.empty())
+        return;
+
+    int max_depth = options.max_depth >= 0
+                        ? options.max_depth
+                        : static_cast<int>(8 + 1.3 * std::log2(refs.size()));
+    this->options.max_depth = std::min(max_depth, KD_TREE_STACK_SIZE - 1);
+
+    KdTreeBuild build{objects, time0, time1, std::vector<bool>(objects.size())};
+    for (size_t i = 0; i < objects.size(); ++i)
+        build.splittable[i] = leafType(*objects[i]) != LeafType::Other;
+    buildNode(build, bounds, refs, 0, 0);
+    unsplit_first = primitives.size();
+    for (auto i : build.unsplit)
+    {
+        primitives.push_back(objects[i]);
+        unsplit_boxes.emplace_back();
+        objects[i]->boundingBox(time0, time1, unsplit_boxes.back());
+    }
+
+    if (options.typed_leaves)
+    {
+        std::vector<std::pair<uint32_t, uint32_t>> leaves;
+        for (const auto &node : nodes)
+            if (node.isLeaf())
+                leaves.emplace_back(node.first, node.first + node.count());
+        typed = TypedLeaves(primitives, leaves);
+    }
+}
+
+void KdTree::buildNode(KdTreeBuild &build, const AABB &cell,
+                       std::vector<KdTreeRef> &refs, int depth, int bad_refines)
+{
+    uint32_t index = nodes.size();
+    nodes.emplace_back();
+    size_t n = refs.size();
+    auto makeLeaf = [&]()
+    {
+        nodes[index].first = primitives.size();
+        nodes[index].flags = static_cast<uint32_t>(n) << 2 | 3;
+        for (const auto &ref : refs)
+            primitives.push_back(build.objects[ref.index]);
+    };
+
+    if (n <= static_cast<size_t>(options.max_leaf_size) ||
+        depth >= options.max_depth)
+        return makeLeaf();
+
+    // Every edge of a clipped box inside the cell is a candidate plane.
+    // A primitive is below a plane if its box starts before it, and
+    //  above if its box ends after it.
+    double leaf_cost = options.intersect_cost * n;
+    double best_cost = INF, best_split = 0;
+    int best_axis = -1;
+    double inv_area = 1 / cell.surfaceArea();
+    auto extent = cell.max() - cell.min();
+    std::vector<double> starts(n), ends(n);
+    for (int a = 0; a < 3; ++a)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            starts[i] = refs[i].box.min()[a];
+            ends[i] = refs[i].box.max()[a];
+        }
+        std::sort(starts.begin(), starts.end());
+        std::sort(ends.begin(), ends.end());
+
+        int b = (a + 1) % 3, c = (a + 2) % 3;
+        for (int side = 0; side < 2; ++side)
+            for (auto edge : side ? ends : starts)
+            {
+                // traversal compares against the float plane
+                double split = static_cast<float>(edge);
+                if (split <= cell.min()[a] || split >= cell.max()[a])
+                    continue;
+
+                size_t n_below = std::lower_bound(starts.begin(), starts.end(), split) - starts.begin();
+                size_t n_above = ends.end() - std::upper_bound(ends.begin(), ends.end(), split);
+                double below = split - cell.min()[a], above = cell.max()[a] - split;
+                double area_below = 2 * (extent[b] * extent[c] + below * (extent[b] + extent[c]));
+                double area_above = 2 * (extent[b] * extent[c] + above * (extent[b] + extent[c]));
+                double bonus = n_below == 0 || n_above == 0 ? options.empty_bonus : 0;
+                double cost = options.traversal_cost +
+                              options.intersect_cost * (1 - bonus) * inv_area *
+                                  (area_below * n_below + area_above * n_above);
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_split = split;
+                    best_axis = a;
+                }
+            }
+    }
+
+    // allow a few splits that do not pay off at once, in case
+    //  their children find better ones
+    if (best_cost > leaf_cost)
+        ++bad_refines;
+    if (best_axis < 0 || (best_cost > 4 * leaf_cost && n < 16) || bad_refines == 3)
+        return makeLeaf();
+
+    // Clip every primitive to both halves. Its part on the plane itself
+    //  goes to one side only, unless the primitive lies in the plane.
+    auto below_max = cell.max(), above_min = cell.min();
+    below_max[best_axis] = best_split;
+    above_min[best_axis] = best_split;
+    AABB below_cell(cell.min(), below_max), above_cell(above_min, cell.max());
+    std::vector<KdTreeRef> below_refs, above_refs;
+    for (const auto &ref : refs)
+    {
+        const auto &object = build.objects[ref.index];
+        AABB below_box, above_box;
+        bool below = object->clippedBox(build.time0, build.time1, below_cell, below_box);
+        bool above = object->clippedBox(build.time0, build.time1, above_cell, above_box);
+        bool flat_below = below && below_box.min()[best_axis] >= best_split;
+        bool flat_above = above && above_box.max()[best_axis] <= best_split;
+        if (below && !flat_below && above && !flat_above &&
+            !build.splittable[ref.index])
+        {
+            build.unsplit.push_back(ref.index);
+            continue;
+        }
+        if (below && (!flat_below || !above || flat_above))
+            below_refs.push_back({ref.index, below_box});
+        if (above && !flat_above)
+            above_refs.push_back({ref.index, above_box});
+    }
+    std::vector<KdTreeRef>().swap(refs);
+
+    buildNode(build, below_cell, below_refs, depth + 1, bad_refines);
+    nodes[index].split = static_cast<float>(best_split);
+    nodes[index].flags = static_cast<uint32_t>(nodes.size()) << 2 | best_axis;
+    buildNode(build, above_cell, above_refs, depth + 1, bad_refines);
+}
+
+template <typename Visit>
+void KdTree::traverse(const Ray &r, double t_min, double &t_max, Visit visit) const
+{
+    if (nodes.empty())
+        return;
+
+    Vec3 inv_d(1 / r.direction().x(),
+               1 / r.direction().y(),
+               1 / r.direction().z());
+    double t_enter = t_min, t_exit = t_max;
+    if (!bounds.clipRay(r, inv_d, t_enter, t_exit))
+        return;
+
+    struct Todo
+    {
+        uint32_t node;
+        double t_enter, t_exit;
+    } todo[KD_TREE_STACK_SIZE];
+    int top = 0;
+    uint32_t current = 0;
+    while (true)
+    {
+        // a hit before this cell cannot be beaten by anything in it
+        if (t_max < t_enter)
+            return;
+
+        const auto &node = nodes[current];
+        BVH_STATS_COUNT(node_tests);
+        BVH_STATS_TOUCH(node);
+        if (!node.isLeaf())
+        {
+            int axis = node.axis();
+            double origin = r.origin()[axis];
+            double t_plane = (node.split - origin) * inv_d[axis];
+            bool below_first = origin < node.split ||
+                               (origin == node.split && r.direction()[axis] <= 0);
+            uint32_t first = below_first ? current + 1 : node.aboveChild();
+            uint32_t second = below_first ? node.aboveChild() : current + 1;
+
+            if (t_plane > t_exit || t_plane <= 0)
+                current = first;
+            else if (t_plane < t_enter)
+                current = second;
+            else
+            {
+                todo[top++] = {second, t_plane, t_exit};
+                current = first;
+                t_exit = t_plane;
+            }
+            continue;
+        }
+
+        if (node.count() > 0 && visit(node.first, node.count()))
+            return;
+        if (top == 0)
+            return;
+        --top;
+        current = todo[top].node;
+        t_enter = todo[top].t_enter;
+        t_exit = todo[top].t_exit;
+    }
+}
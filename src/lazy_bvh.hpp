@@ -0,0 +1,350 @@
+// Lazy BVH: only the root exists after construction, and the children
+//  of a node are built by the first ray that reaches it, so geometry
+//  no ray gets near never costs more than its bounding box.
+//
+// The primitives are sorted along a Morton curve once, and every node
+//  covers a range of that order: building children cuts the range in
+//  two where the surface area heuristic is lowest, without moving any
+//  primitive. The centroids are binned by the Morton code bits that
+//  follow the range's common prefix, so only the cuts between those
+//  cells are tried, each found by a binary search over the codes; the
+//  box of any range comes from a segment tree over the primitive
+//  boxes. Building children thus costs O(n_bins * log(n)) however
+//  large the range.
+//
+// Nothing a ray reads ever changes, so render threads need no locks:
+//  a thread that finds a node without children builds them itself and
+//  publishes them with one compare-and-swap, and should another thread
+//  have been first, drops its own copy and uses theirs.
+//
+// Construction is a linear pass over the boxes plus the radix sort;
+//  time to first pixel then grows with the depth of the tree only.
+
+#pragma once
+
+#include <atomic>
+
+#include "raytracer.h"
+#include "hittable.h"
+#include "accelerator.h"
+#include "hittable_list.hpp"
+#include "aabb.hpp"
+#include "bvh_build.hpp"
+#include "lbvh.hpp"
+#include "bvh_stats.hpp"
+
+// below this depth children are cut by SAH, deeper ones in the middle,
+//  which bounds the depth by about 48 + log2(n)
+const uint32_t LAZY_BVH_SAH_DEPTH = 48;
+const int LAZY_BVH_STACK_SIZE = 128;
+// ranges up to this size try every cut, all in one pass over their boxes
+const uint32_t LAZY_BVH_SWEEP_SIZE = 64;
+
+struct LazyBVHNode
+{
+    AABB box;
+    uint32_t first = 0, count = 0; // range of sorted primitives below
+    uint32_t depth = 0;
+    std::atomic<LazyBVHNode *> children{nullptr}; // a pair, null until built
+
+    LazyBVHNode() {}
+    ~LazyBVHNode() { delete[] children.load(); }
+};
+
+class LazyBVH : public Accelerator
+{
+private:
+    std::vector<shared_ptr<Hittable>> primitives; // along the Morton curve
+    // segment tree: boxes[n + i] bounds primitive i, and
+    //  boxes[k] bounds boxes[2 * k] and boxes[2 * k + 1]
+    std::vector<AABB> boxes;
+    std::vector<uint64_t> keys; // Morton codes of the centroids, ascending
+    uint32_t max_leaf_size;
+    int bin_bits; // the cells of this many bits are the SAH bins
+    bool has_box = false;
+
+    mutable LazyBVHNode root;
+    mutable std::atomic<size_t> n_nodes{1};
+
+    // the children of an interior node, built if no ray needed them yet
+    LazyBVHNode *children(LazyBVHNode &node) const;
+
+    // bounds of the primitives [first, end), a nonempty range
+    AABB rangeBox(uint32_t first, uint32_t end) const;
+
+public:
+    LazyBVH(HittableList &list, double time0, double time1,
+            const BVHBuildOptions &options = BVHBuildOptions());
+
+    // nodes built so far
+    size_t builtNodes() const { return n_nodes.load(std::memory_order_relaxed); }
+
+    bool hit(const Ray &r, double t_min,
+             double t_max, HitRecord &rec) const override;
+
+    bool occluded(const Ray &r, double t_min, double t_max) const override;
+
+    bool boundingBox(double t0, double t1,
+                     AABB &output_box) const override
+    {
+        output_box = root.box;
+        return has_box;
+    }
+
+    size_t memoryUsage() const override
+    {
+        return primitives.capacity() * sizeof(shared_ptr<Hittable>) +
+               boxes.capacity() * sizeof(AABB) +
+               keys.capacity() * sizeof(uint64_t) +
+               builtNodes() * sizeof(LazyBVHNode);
+    }
+};
+
+LazyBVH::LazyBVH(HittableList &list, double time0, double time1,
+                 const BVHBuildOptions &options)
+{
+    max_leaf_size = std::max(1, options.max_leaf_size);
+    bin_bits = 1;
+    while (2 << bin_bits <= options.n_bins)
+        ++bin_bits;
+    const auto &objects = list.objects;
+    size_t n = objects.size();
+    std::vector<BVHPrimitive> prims(n);
+#pragma omp parallel for if (n >= options.parallel_threshold)
+    for (size_t i = 0; i < n; ++i)
+    {
+        AABB prim_box;
+        if (!objects[i]->boundingBox(time0, time1, prim_box))
+#pragma omp critical
+            std::cerr << "[ERROR]: No bounding box in LazyBVH constructor.\n";
+        prims[i] = {prim_box, prim_box.centroid(), i};
+    }
+    if (prims.empty())
+        return;
+
+    LBVHBuilder(prims, options).sortPrimitives(keys);
+    primitives.resize(n);
+    boxes.resize(2 * n);
+#pragma omp parallel for if (n >= options.parallel_threshold)
+    for (size_t i = 0; i < n; ++i)
+    {
+        primitives[i] = objects[prims[i].index];
+        boxes[n + i] = prims[i].box;
+    }
+    for (size_t k = n; k-- > 1;)
+        boxes[k] = surroundingBox(boxes[2 * k], boxes[2 * k + 1]);
+
+    root.box = rangeBox(0, n);
+    root.count = n;
+    has_box = true;
+}
+
+AABB LazyBVH::rangeBox(uint32_t first, uint32_t end) const
+{
+    size_t n = primitives.size();
+    AABB box;
+    bool empty = true;
+    for (size_t l = first + n, r = end + n; l < r; l /= 2, r /= 2)
+    {
+        if (l & 1)
+        {
+            box = empty ? boxes[l] : surroundingBox(box, boxes[l]);
+            empty = false;
+            ++l;
+        }
+        if (r & 1)
+        {
+            --r;
+            box = empty ? boxes[r] : surroundingBox(box, boxes[r]);
+            empty = false;
+        }
+    }
+    return box;
+}
+
+LazyBVHNode *LazyBVH::children(LazyBVHNode &node) const
+{
+    auto *pair = node.children.load(std::memory_order_acquire);
+    if (pair)
+        return pair;
+
+    // the first child gets `cut` primitives, the cut that minimizes
+    //  area(first) * count(first) + area(second) * count(second)
+    //  of all cuts in a small range, else of those between the cells
+    //  of the bin_bits bits from the first that differs in the range
+    uint32_t first = node.first, n = node.count;
+    uint32_t cut = n / 2;
+    uint64_t differ = keys[first] ^ keys[first + n - 1];
+    const AABB *leaf_boxes = boxes.data() + primitives.size();
+    if (node.depth < LAZY_BVH_SAH_DEPTH && n <= LAZY_BVH_SWEEP_SIZE)
+    {
+        // few enough to try every cut
+        AABB suffix[LAZY_BVH_SWEEP_SIZE];
+        suffix[n - 1] = leaf_boxes[first + n - 1];
+        for (uint32_t i = n - 1; i-- > 0;)
+            suffix[i] = surroundingBox(leaf_boxes[first + i], suffix[i + 1]);
+        AABB prefix = leaf_boxes[first];
+        double best_cost = INF;
+        for (uint32_t i = 1; i < n; ++i)
+        {
+            double cost = prefix.surfaceArea() * i + suffix[i].surfaceArea() * (n - i);
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                cut = i;
+            }
+            prefix = surroundingBox(prefix, leaf_boxes[first + i]);
+        }
+    }
+    else if (node.depth < LAZY_BVH_SAH_DEPTH && differ)
+    {
+        int high = 63 - __builtin_clzll(differ);
+        int low = std::max(0, high - bin_bits + 1);
+        uint64_t prefix = keys[first] & ~((2ull << high) - 1);
+        const uint64_t *begin = keys.data() + first, *end = begin + n;
+        double best_cost = INF;
+        for (uint64_t cell = 1; cell < 1ull << (high - low + 1); ++cell)
+        {
+            // the first primitive in this cell or a later one
+            uint32_t i = std::lower_bound(begin, end, prefix | cell << low) - begin;
+            if (i == 0 || i == n)
+                continue;
+            double cost = rangeBox(first, first + i).surfaceArea() * i +
+                          rangeBox(first + i, first + n).surfaceArea() * (n - i);
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                cut = i;
+            }
+        }
+    }
+
+    pair = new LazyBVHNode[2];
+    pair[0].first = first;
+    pair[0].count = cut;
+    pair[0].box = rangeBox(first, first + cut);
+    pair[1].first = first + cut;
+    pair[1].count = n - cut;
+    pair[1].box = rangeBox(first + cut, first + n);
+    pair[0].depth = pair[1].depth = node.depth + 1;
+
+    LazyBVHNode *published = nullptr;
+    if (node.children.compare_exchange_strong(published, pair,
+                                              std::memory_order_acq_rel,
+                                              std::memory_order_acquire))
+    {
+        n_nodes.fetch_add(2, std::memory_order_relaxed);
+        return pair;
+    }
+    // another thread built them first
+    delete[] pair;
+    return published;
+}
+
+bool LazyBVH::hit(const Ray &r, double t_min,
+                  double t_max, HitRecord &rec) const
+{
+    Vec3 inv_d(1 / r.direction().x(),
+               1 / r.direction().y(),
+               1 / r.direction().z());
+    if (!has_box || !root.box.hit(r, inv_d, t_min, t_max))
+        return false;
+
+    // nodes still to visit, with the distance at which the ray enters them
+    struct Entry
+    {
+        LazyBVHNode *node;
+        double t_enter;
+    } stack[LAZY_BVH_STACK_SIZE];
+    int top = 0;
+    LazyBVHNode *node = &root;
+    bool hit_anything = false;
+    while (true)
+    {
+        BVH_STATS_COUNT(node_tests);
+        if (node->count <= max_leaf_size)
+        {
+            for (uint32_t i = node->first; i < node->first + node->count; ++i)
+            {
+                BVH_STATS_COUNT(primitive_tests);
+                if (primitives[i]->hit(r, t_min, t_max, rec))
+                {
+                    hit_anything = true;
+                    t_max = rec.t;
+                }
+            }
+        }
+        else
+        {
+            auto *pair = children(*node);
+            double enter[2] = {t_min, t_min}, exit[2] = {t_max, t_max};
+            bool hits[2];
+            for (int k = 0; k < 2; ++k)
+                hits[k] = pair[k].box.clipRay(r, inv_d, enter[k], exit[k]);
+            if (hits[0] && hits[1])
+            {
+                // the nearer one first
+                int near = enter[1] < enter[0];
+                stack[top++] = {&pair[1 - near], enter[1 - near]};
+                node = &pair[near];
+                continue;
+            }
+            if (hits[0] || hits[1])
+            {
+                node = &pair[hits[1]];
+                continue;
+            }
+        }
+
+        // skip nodes the ray only enters behind the closest hit
+        do
+        {
+            if (top == 0)
+                return hit_anything;
+            --top;
+        } while (stack[top].t_enter > t_max);
+        node = stack[top].node;
+    }
+}
+
+bool LazyBVH::occluded(const Ray &r, double t_min, double t_max) const
+{
+    Vec3 inv_d(1 / r.direction().x(),
+               1 / r.direction().y(),
+               1 / r.direction().z());
+    if (!has_box || !root.box.hit(r, inv_d, t_min, t_max))
+        return false;
+
+    LazyBVHNode *stack[LAZY_BVH_STACK_SIZE];
+    int top = 0;
+    LazyBVHNode *node = &root;
+    while (true)
+    {
+        BVH_STATS_COUNT(node_tests);
+        if (node->count <= max_leaf_size)
+        {
+            for (uint32_t i = node->first; i < node->first + node->count; ++i)
+            {
+                BVH_STATS_COUNT(primitive_tests);
+                if (primitives[i]->occluded(r, t_min, t_max))
+                    return true;
+            }
+        }
+        else
+        {
+            auto *pair = children(*node);
+            bool hit0 = pair[0].box.hit(r, inv_d, t_min, t_max);
+            bool hit1 = pair[1].box.hit(r, inv_d, t_min, t_max);
+            if (hit0 || hit1)
+            {
+                if (hit0 && hit1)
+                    stack[top++] = &pair[1];
+                node = hit0 ? &pair[0] : &pair[1];
+                continue;
+            }
+        }
+        if (top == 0)
+            return false;
+        node = stack[--top];
+    }
+}
@@ -0,0 +1,460 @@
+// Linear BVH: sort the primitives along a Morton curve,
+//  then every interior node can be emitted independently
+//  (Karras, "Maximizing Parallelism in the Construction of BVHs,
+//  Octrees, and k-d Trees", 2012).
+
+#pragma once
+
+#include <functional>
+
+#include "raytracer.h"
+#include "aabb.hpp"
+#include "bvh_build.hpp"
+
+// insert two zero bits after each of the low 10 bits
+inline uint64_t expandBits10(uint64_t v)
+{
+    v &= 0x3ff;
+    v = (v | v << 16) & 0x30000ff;
+    v = (v | v << 8) & 0x300f00f;
+    v = (v | v << 4) & 0x30c30c3;
+    v = (v | v << 2) & 0x9249249;
+    return v;
+}
+
+// insert two zero bits after each of the low 21 bits
+inline uint64_t expandBits21(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+class LBVHBuilder
+{
+private:
+    // children with LEAF set refer to a sorted primitive,
+    //  the others to another internal node
+    struct InternalNode
+    {
+        uint32_t children[2];
+        uint32_t first, last; // range of sorted primitives below
+    };
+
+    static const uint32_t LEAF = 1u << 31;
+    static const int TREELET_SIZE = 7;
+
+    std::vector<BVHPrimitive> &prims;
+    BVHBuildOptions options;
+    size_t max_leaf_size;
+    int n_chunks;
+
+    std::vector<uint64_t> keys; // sorted Morton codes
+    std::vector<InternalNode> internal;
+
+    void sortByMorton();
+    void emitHierarchy();
+
+    // length of the common prefix of keys i and j,
+    //  equal keys are told apart by their index
+    int delta(int64_t i, int64_t j) const
+    {
+        if (j < 0 || j >= static_cast<int64_t>(keys.size()))
+            return -1;
+        if (keys[i] == keys[j])
+            return 64 + __builtin_clzll(static_cast<uint64_t>(i ^ j));
+        return __builtin_clzll(keys[i] ^ keys[j]);
+    }
+
+    std::unique_ptr<BVHBuildNode> createSubtree(uint32_t ref, int depth);
+    std::unique_ptr<BVHBuildNode> balancedSubtree(uint32_t first, uint32_t last);
+    void setAxis(BVHBuildNode *node) const;
+
+    void optimizeTreelets(BVHBuildNode *node, int depth);
+    void optimizeTreelet(BVHBuildNode *root);
+
+public:
+    LBVHBuilder(std::vector<BVHPrimitive> &prims,
+                const BVHBuildOptions &options)
+        : prims(prims), options(options)
+    {
+        max_leaf_size = std::max(1, std::min(options.max_leaf_size, 0xffff));
+        n_chunks = prims.size() < options.parallel_threshold
+                       ? 1
+                       : std::min<size_t>(64, prims.size() / 1024);
+    }
+
+    // Appends the tree to `nodes` and reorders `prims` to leaf order.
+    void build(AlignedVector<BVHLinearNode> &nodes);
+
+    // Only sorts `prims` along the Morton curve, for builders that
+    //  split the sorted order themselves (see lazy_bvh.hpp), and
+    //  hands over the sorted codes.
+    void sortPrimitives(std::vector<uint64_t> &sorted_keys)
+    {
+        if (!prims.empty())
+            sortByMorton();
+        sorted_keys.swap(keys);
+        keys.clear();
+    }
+};
+
+void LBVHBuilder::build(AlignedVector<BVHLinearNode> &nodes)
+{
+    if (prims.empty())
+        return;
+
+    sortByMorton();
+    emitHierarchy();
+
+    std::unique_ptr<BVHBuildNode> root;
+#pragma omp parallel if (prims.size() >= options.parallel_threshold)
+#pragma omp single
+    {
+        root = prims.size() == 1 ? createSubtree(LEAF, 0)
+                                 : createSubtree(0, 0);
+        for (int pass = 0; pass < options.treelet_passes; ++pass)
+            optimizeTreelets(root.get(), 0);
+    }
+
+    keys.clear();
+    internal.clear();
+    nodes.reserve(nodes.size() + 2 * prims.size());
+    flattenBVH(root.get(), nodes);
+}
+
+// 30-bit codes are enough for up to about a million primitives,
+//  larger scenes get 63 bits (21 per axis).
+// The codes are sorted by a stable LSD radix sort, 8 bits per pass,
+//  with one histogram per chunk so that chunks can scatter in parallel.
+void LBVHBuilder::sortByMorton()
+{
+    const size_t n = prims.size();
+    const bool wide = n > (1u << 20);
+
+    AABB centroid_box(prims[0].centroid, prims[0].centroid);
+    for (size_t i = 1; i < n; ++i)
+        centroid_box = surroundingBox(centroid_box, prims[i].centroid);
+
+    const double scale = wide ? (1 << 21) - 1 : (1 << 10) - 1;
+    Vec3 extent = centroid_box.max() - centroid_box.min();
+    keys.resize(n);
+    std::vector<uint32_t> order(n);
+#pragma omp parallel for if (n_chunks > 1)
+    for (size_t i = 0; i < n; ++i)
+    {
+        uint64_t q[3];
+        for (int a = 0; a < 3; ++a)
+        {
+            double t = extent[a] > 0
+                           ? (prims[i].centroid[a] - centroid_box.min()[a]) / extent[a]
+                           : 0;
+            q[a] = static_cast<uint64_t>(t * scale);
+        }
+        keys[i] = wide ? expandBits21(q[0]) << 2 | expandBits21(q[1]) << 1 | expandBits21(q[2])
+                       : expandBits10(q[0]) << 2 | expandBits10(q[1]) << 1 | expandBits10(q[2]);
+        order[i] = i;
+    }
+
+    std::vector<uint64_t> keys_tmp(n);
+    std::vector<uint32_t> order_tmp(n);
+    std::vector<size_t> histogram(n_chunks * 256);
+    auto chunkBegin = [&](int c)
+    { return n * c / n_chunks; };
+
+    for (int shift = 0; shift < (wide ? 63 : 30); shift += 8)
+    {
+        std::fill(histogram.begin(), histogram.end(), 0);
+#pragma omp parallel for if (n_chunks > 1)
+        for (int c = 0; c < n_chunks; ++c)
+            for (size_t i = chunkBegin(c); i < chunkBegin(c + 1); ++i)
+                ++histogram[c * 256 + (keys[i] >> shift & 0xff)];
+
+        // digit-major order keeps equal digits in chunk order, i.e. stable
+        size_t sum = 0;
+        for (int d = 0; d < 256; ++d)
+            for (int c = 0; c < n_chunks; ++c)
+            {
+                auto count = histogram[c * 256 + d];
+                histogram[c * 256 + d] = sum;
+                sum += count;
+            }
+
+#pragma omp parallel for if (n_chunks > 1)
+        for (int c = 0; c < n_chunks; ++c)
+            for (size_t i = chunkBegin(c); i < chunkBegin(c + 1); ++i)
+            {
+                auto dest = histogram[c * 256 + (keys[i] >> shift & 0xff)]++;
+                keys_tmp[dest] = keys[i];
+                order_tmp[dest] = order[i];
+            }
+        keys.swap(keys_tmp);
+        order.swap(order_tmp);
+    }
+
+    std::vector<BVHPrimitive> sorted(n);
+#pragma omp parallel for if (n_chunks > 1)
+    for (size_t i = 0; i < n; ++i)
+        sorted[i] = prims[order[i]];
+    prims.swap(sorted);
+}
+
+// Internal node i covers sorted primitives [min(i, j), max(i, j)],
+//  and splits them where the highest differing bit changes.
+void LBVHBuilder::emitHierarchy()
+{
+    const int64_t n = keys.size();
+    internal.resize(n - 1);
+
+#pragma omp parallel for if (n_chunks > 1)
+    for (int64_t i = 0; i < n - 1; ++i)
+    {
+        // direction of the range
+        int d = delta(i, i + 1) > delta(i, i - 1) ? 1 : -1;
+
+        // upper bound of the range length, then binary search the other end
+        int delta_min = delta(i, i - d);
+        int64_t l_max = 2;
+        while (delta(i, i + l_max * d) > delta_min)
+            l_max *= 2;
+        int64_t l = 0;
+        for (int64_t t = l_max / 2; t >= 1; t /= 2)
+            if (delta(i, i + (l + t) * d) > delta_min)
+                l += t;
+        int64_t j = i + l * d;
+
+        // binary search the split position
+        int delta_node = delta(i, j);
+        int64_t s = 0;
+        for (int64_t t = (l + 1) / 2;; t = (t + 1) / 2)
+        {
+            if (delta(i, i + (s + t) * d) > delta_node)
+                s += t;
+            if (t == 1)
+                break;
+        }
+        int64_t gamma = i + s * d + std::min(d, 0);
+
+        auto &node = internal[i];
+        node.first = std::min(i, j);
+        node.last = std::max(i, j);
+        node.children[0] = gamma | (node.first == gamma ? LEAF : 0);
+        node.children[1] = (gamma + 1) | (node.last == gamma + 1 ? LEAF : 0);
+    }
+}
+
+// the axis along which the children are furthest apart,
+//  for the near-first traversal order
+void LBVHBuilder::setAxis(BVHBuildNode *node) const
+{
+    auto d = node->children[1]->box.centroid() - node->children[0]->box.centroid();
+    node->axis = 0;
+    for (int a = 1; a < 3; ++a)
+        if (fabs(d[a]) > fabs(d[node->axis]))
+            node->axis = a;
+}
+
+// Boxes are merged bottom-up, and small subtrees collapse into
+//  one leaf when that is cheaper.
+std::unique_ptr<BVHBuildNode> LBVHBuilder::createSubtree(uint32_t ref, int depth)
+{
+    std::unique_ptr<BVHBuildNode> node(new BVHBuildNode());
+    if (ref & LEAF)
+    {
+        uint32_t index = ref & ~LEAF;
+        node->box = prims[index].box;
+        node->offset = index;
+        node->count = 1;
+        node->update(options);
+        return node;
+    }
+
+    const auto &in = internal[ref];
+    // Morton trees can be deep where keys repeat,
+    //  keep the traversal stack bounded as BVHBuilder does
+    if (depth >= BVH_STACK_SIZE - 32)
+        return balancedSubtree(in.first, in.last);
+
+    if (in.last - in.first + 1 >= options.parallel_threshold)
+    {
+#pragma omp task shared(node)
+        node->children[0] = createSubtree(in.children[0], depth + 1);
+        node->children[1] = createSubtree(in.children[1], depth + 1);
+#pragma omp taskwait
+    }
+    else
+    {
+        node->children[0] = createSubtree(in.children[0], depth + 1);
+        node->children[1] = createSubtree(in.children[1], depth + 1);
+    }
+    node->box = surroundingBox(node->children[0]->box, node->children[1]->box);
+    setAxis(node.get());
+    node->update(options);
+
+    size_t count = in.last - in.first + 1;
+    double leaf_cost = options.intersect_cost * count * node->box.surfaceArea();
+    if (count <= max_leaf_size && leaf_cost <= node->cost)
+    {
+        node->children[0].reset();
+        node->children[1].reset();
+        node->offset = in.first;
+        node->count = count;
+        node->update(options);
+    }
+    return node;
+}
+
+std::unique_ptr<BVHBuildNode> LBVHBuilder::balancedSubtree(uint32_t first, uint32_t last)
+{
+    std::unique_ptr<BVHBuildNode> node(new BVHBuildNode());
+    if (last - first + 1 <= max_leaf_size)
+    {
+        node->box = prims[first].box;
+        for (uint32_t i = first + 1; i <= last; ++i)
+            node->box = surroundingBox(node->box, prims[i].box);
+        node->offset = first;
+        node->count = last - first + 1;
+        node->update(options);
+        return node;
+    }
+
+    uint32_t mid = first + (last - first) / 2;
+    node->children[0] = balancedSubtree(first, mid);
+    node->children[1] = balancedSubtree(mid + 1, last);
+    node->box = surroundingBox(node->children[0]->box, node->children[1]->box);
+    setAxis(node.get());
+    node->update(options);
+    return node;
+}
+
+// post-order, so that every treelet is formed from optimized subtrees
+void LBVHBuilder::optimizeTreelets(BVHBuildNode *node, int depth)
+{
+    if (!node->children[0])
+        return;
+    if (depth < 8)
+    {
+#pragma omp task
+        optimizeTreelets(node->children[0].get(), depth + 1);
+        optimizeTreelets(node->children[1].get(), depth + 1);
+#pragma omp taskwait
+    }
+    else
+    {
+        optimizeTreelets(node->children[0].get(), depth + 1);
+        optimizeTreelets(node->children[1].get(), depth + 1);
+    }
+    optimizeTreelet(node);
+}
+
+// Treelet restructuring (Karras and Aila, "Fast Parallel Construction
+//  of High-Quality Bounding Volume Hierarchies", 2013):
+// grow a treelet of up to 7 subtrees below `root` by opening the largest one,
+//  find the cheapest binary tree over them by dynamic programming,
+//  and rebuild the treelet if it is cheaper and no taller.
+void LBVHBuilder::optimizeTreelet(BVHBuildNode *root)
+{
+    BVHBuildNode *leaves[TREELET_SIZE];
+    BVHBuildNode *inner[TREELET_SIZE - 1];
+    int n_leaves = 2, n_inner = 1;
+    leaves[0] = root->children[0].get();
+    leaves[1] = root->children[1].get();
+    inner[0] = root;
+
+    while (n_leaves < TREELET_SIZE)
+    {
+        int largest = -1;
+        for (int k = 0; k < n_leaves; ++k)
+            if (leaves[k]->children[0] &&
+                (largest == -1 ||
+                 leaves[k]->box.surfaceArea() > leaves[largest]->box.surfaceArea()))
+                largest = k;
+        if (largest == -1)
+            break;
+        auto opened = leaves[largest];
+        inner[n_inner++] = opened;
+        leaves[largest] = opened->children[0].get();
+        leaves[n_leaves++] = opened->children[1].get();
+    }
+    if (n_leaves < 3)
+        return;
+
+    // cost[s], height[s]: best tree over the subset s of leaves
+    const int n_subsets = 1 << n_leaves;
+    AABB box[1 << TREELET_SIZE];
+    double cost[1 << TREELET_SIZE];
+    int height[1 << TREELET_SIZE];
+    int split[1 << TREELET_SIZE];
+
+    for (int s = 1; s < n_subsets; ++s)
+    {
+        int low = s & -s;
+        if (s == low)
+        {
+            int k = __builtin_ctz(s);
+            box[s] = leaves[k]->box;
+            cost[s] = leaves[k]->cost;
+            height[s] = leaves[k]->height;
+            continue;
+        }
+        box[s] = surroundingBox(box[low], box[s ^ low]);
+
+        // every split of s, counted once by keeping the lowest leaf on the left
+        cost[s] = INF;
+        for (int p = (s - 1) & s; p; p = (p - 1) & s)
+        {
+            if (!(p & low))
+                continue;
+            double c = cost[p] + cost[s ^ p];
+            if (c < cost[s])
+            {
+                cost[s] = c;
+                split[s] = p;
+            }
+        }
+        height[s] = 1 + std::max(height[split[s]], height[s ^ split[s]]);
+        cost[s] += options.traversal_cost * box[s].surfaceArea();
+    }
+
+    const int all = n_subsets - 1;
+    if (cost[all] >= root->cost * (1 - 1e-9) || height[all] > root->height)
+        return;
+
+    // detach all the treelet's subtrees, then reassemble them
+    std::unique_ptr<BVHBuildNode> owned_leaves[TREELET_SIZE];
+    std::vector<std::unique_ptr<BVHBuildNode>> pool;
+    for (int k = 0; k < n_inner; ++k)
+        for (auto &child : inner[k]->children)
+        {
+            int found = std::find(leaves, leaves + n_leaves, child.get()) - leaves;
+            if (found < n_leaves)
+                owned_leaves[found] = std::move(child);
+            else
+                pool.push_back(std::move(child));
+        }
+
+    std::function<void(BVHBuildNode *, int)> assemble =
+        [&](BVHBuildNode *node, int s)
+    {
+        int parts[2] = {split[s], s ^ split[s]};
+        for (int c = 0; c < 2; ++c)
+        {
+            if (!(parts[c] & (parts[c] - 1)))
+                node->children[c] = std::move(owned_leaves[__builtin_ctz(parts[c])]);
+            else
+            {
+                node->children[c] = std::move(pool.back());
+                pool.pop_back();
+                assemble(node->children[c].get(), parts[c]);
+            }
+        }
+        node->box = box[s];
+        setAxis(node);
+        node->update(options);
+    };
+    assemble(root, all);
+}
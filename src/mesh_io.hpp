@@ -0,0 +1,1051 @@
+// Loading triangle meshes from files.
+//
+// OBJ and binary PLY files are mapped and parsed in parallel into a
+//  TriangleMeshData, and the mesh is built from it as usual.
+//
+// The native format (.rtmesh) holds a TriangleMesh as it is in memory,
+//  BVH included, each array starting on a cache line: the file is mapped
+//  and the mesh reads its arrays from the mapping, so loading parses,
+//  copies and builds nothing. Only the indices and the nodes are read
+//  once, to check that no ray can be sent out of bounds; the vertices
+//  are paged in when rays first reach them.
+// saveMeshFile() writes one, and scenes/mesh_convert converts a file.
+//
+// Layout: MeshFileHeader, then the nodes, x, y, z, nx, ny, nz, u, v and
+//  the three corner arrays, leaving out the normals or texture
+//  coordinates if the mesh has none, each padded with zeros to a
+//  multiple of 64 bytes.
+
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "raytracer.h"
+#include "triangle_mesh.hpp"
+
+// A read-only mapping of a whole file, unmapped with the last reference.
+// data() is null if the file cannot be mapped.
+class MappedFile
+{
+private:
+    const char *bytes = nullptr;
+    size_t length = 0;
+
+public:
+    explicit MappedFile(const std::string &path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED)
+            {
+                bytes = static_cast<const char *>(data);
+                length = st.st_size;
+            }
+        }
+        close(fd);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+        if (bytes)
+            munmap(const_cast<char *>(bytes), length);
+    }
+
+    const char *data() const { return bytes; }
+    size_t size() const { return length; }
+};
+
+// Text files are parsed in chunks of about this many bytes,
+//  each cut at the end of a line.
+const size_t MESH_PARSE_CHUNK = 1 << 22;
+
+// where every chunk of the text starts; the last entry is the end
+inline std::vector<size_t> lineChunks(const char *text, size_t size)
+{
+    std::vector<size_t> starts{0};
+    for (size_t pos = MESH_PARSE_CHUNK; pos < size; pos += MESH_PARSE_CHUNK)
+    {
+        const char *newline = static_cast<const char *>(
+            std::memchr(text + pos, '\n', size - pos));
+        if (!newline)
+            break;
+        pos = newline + 1 - text;
+        if (pos < size)
+            starts.push_back(pos);
+    }
+    starts.push_back(size);
+    return starts;
+}
+
+// Numbers are read in place from the mapping, so every parser below
+//  stops at `end`, which is always '\n', '\r' or a terminating zero.
+inline const char *skipSpaces(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t'))
+        ++p;
+    return p;
+}
+
+inline bool parseNumber(const char *&p, const char *end, double &value)
+{
+    p = skipSpaces(p, end);
+    if (p >= end)
+        return false;
+    char *next;
+    value = std::strtod(p, &next);
+    if (next == p || next > end)
+        return false;
+    p = next;
+    return true;
+}
+
+inline bool parseInteger(const char *&p, const char *end, int64_t &value)
+{
+    bool negative = p < end && *p == '-';
+    const char *digits = negative ? p + 1 : p;
+    value = 0;
+    const char *q = digits;
+    for (; q < end && *q >= '0' && *q <= '9'; ++q)
+        value = 10 * value + (*q - '0');
+    if (q == digits)
+        return false;
+    if (negative)
+        value = -value;
+    p = q;
+    return true;
+}
+
+// ---------------------------------------------------------------- OBJ
+
+// the position, texture and normal index of one corner of a face,
+//  -1 where there is none
+struct OBJCorner
+{
+    int64_t index[3];
+    // negative OBJ indices count back from the last entry so far: they
+    //  are stored as an index within the chunk, which may be negative,
+    //  until the entries of the chunks before are known
+    uint8_t in_chunk[3];
+};
+
+struct OBJChunk
+{
+    std::vector<double> positions; // three per entry
+    std::vector<double> uvs;       // two per entry
+    std::vector<double> normals;   // three per entry
+    std::vector<OBJCorner> corners; // three per triangle
+    size_t bad_line = 0;            // line number, within the chunk, of an error
+};
+
+// one "v/vt/vn" token of a face
+inline bool parseOBJCorner(const char *&p, const char *end,
+                           const OBJChunk &chunk, OBJCorner &corner)
+{
+    size_t counts[3] = {chunk.positions.size() / 3, chunk.uvs.size() / 2,
+                        chunk.normals.size() / 3};
+    for (int k = 0; k < 3; ++k)
+    {
+        corner.index[k] = -1;
+        corner.in_chunk[k] = 0;
+        if (k > 0)
+        {
+            if (p >= end || *p != '/')
+                continue;
+            ++p;
+            if (p < end && *p == '/' && k == 1)
+                continue; // v//vn
+        }
+        int64_t i;
+        if (!parseInteger(p, end, i))
+        {
+            if (k == 0)
+                return false;
+            continue;
+        }
+        if (i == 0)
+            return false;
+        if (i > 0)
+            corner.index[k] = i - 1;
+        else
+        {
+            corner.index[k] = static_cast<int64_t>(counts[k]) + i;
+            corner.in_chunk[k] = 1;
+        }
+    }
+    return true;
+}
+
+inline void parseOBJLine(const char *p, const char *end, OBJChunk &chunk, size_t line)
+{
+    p = skipSpaces(p, end);
+    if (p >= end || *p == '#')
+        return;
+    const char *keyword = p;
+    while (p < end && *p != ' ' && *p != '\t')
+        ++p;
+    size_t length = p - keyword;
+
+    bool ok = true;
+    if (length == 1 && keyword[0] == 'v')
+    {
+        double value[3];
+        for (int k = 0; k < 3; ++k)
+            ok = ok && parseNumber(p, end, value[k]);
+        if (ok)
+            chunk.positions.insert(chunk.positions.end(), value, value + 3);
+    }
+    else if (length == 2 && keyword[0] == 'v' && keyword[1] == 'n')
+    {
+        double value[3];
+        for (int k = 0; k < 3; ++k)
+            ok = ok && parseNumber(p, end, value[k]);
+        if (ok)
+            chunk.normals.insert(chunk.normals.end(), value, value + 3);
+    }
+    else if (length == 2 && keyword[0] == 'v' && keyword[1] == 't')
+    {
+        double value[2];
+        for (int k = 0; k < 2; ++k)
+            ok = ok && parseNumber(p, end, value[k]);
+        if (ok)
+            chunk.uvs.insert(chunk.uvs.end(), value, value + 2);
+    }
+    else if (length == 1 && keyword[0] == 'f')
+    {
+        // polygons are split into a fan of triangles around the first corner
+        OBJCorner first, previous, corner;
+        int n = 0;
+        while ((p = skipSpaces(p, end)) < end)
+        {
+            if (!parseOBJCorner(p, end, chunk, corner))
+            {
+                ok = false;
+                break;
+            }
+            if (n >= 2)
+            {
+                chunk.corners.push_back(first);
+                chunk.corners.push_back(previous);
+                chunk.corners.push_back(corner);
+            }
+            (n == 0 ? first : previous) = corner;
+            ++n;
+        }
+        ok = ok && n >= 3;
+    }
+    // groups, objects, materials and smoothing are ignored
+
+    if (!ok && !chunk.bad_line)
+        chunk.bad_line = line;
+}
+
+void parseOBJChunk(const char *text, size_t begin, size_t end, size_t size, OBJChunk &chunk)
+{
+    size_t line = 1;
+    for (size_t pos = begin; pos < end; ++line)
+    {
+        const char *start = text + pos;
+        const char *newline = static_cast<const char *>(std::memchr(start, '\n', end - pos));
+        if (!newline && end == size)
+        {
+            // the last line has no newline after it, and its
+            //  numbers must not be read past the mapping
+            std::string last(start, end - pos);
+            parseOBJLine(last.c_str(), last.c_str() + last.size(), chunk, line);
+            break;
+        }
+        const char *line_end = newline ? newline : text + end;
+        parseOBJLine(start, line_end > start && line_end[-1] == '\r' ? line_end - 1 : line_end,
+                     chunk, line);
+        pos = line_end + 1 - text;
+    }
+}
+
+// Faces may give a vertex other texture coordinates or another normal
+//  in each of its triangles, so every distinct combination becomes a
+//  vertex of its own, unless all faces use the same index for all three.
+bool loadOBJ(const std::string &path, TriangleMeshData &data)
+{
+    MappedFile file(path);
+    if (!file.data())
+    {
+        std::cerr << "[ERROR]: Cannot read " << path << ".\n";
+        return false;
+    }
+    auto starts = lineChunks(file.data(), file.size());
+    size_t n_chunks = starts.size() - 1;
+    std::vector<OBJChunk> chunks(n_chunks);
+#pragma omp parallel for schedule(dynamic)
+    for (size_t c = 0; c < n_chunks; ++c)
+        parseOBJChunk(file.data(), starts[c], starts[c + 1], file.size(), chunks[c]);
+
+    // entries of every kind before each chunk
+    std::vector<size_t> first[3];
+    size_t total[3] = {0, 0, 0};
+    for (int k = 0; k < 3; ++k)
+        first[k].resize(n_chunks + 1);
+    std::vector<size_t> first_corner(n_chunks + 1, 0);
+    for (size_t c = 0; c < n_chunks; ++c)
+    {
+        if (chunks[c].bad_line)
+        {
+            std::cerr << "[ERROR]: Cannot parse " << path << ", line "
+                      << chunks[c].bad_line << " of the chunk at byte "
+                      << starts[c] << ".\n";
+            return false;
+        }
+        size_t counts[3] = {chunks[c].positions.size() / 3, chunks[c].uvs.size() / 2,
+                            chunks[c].normals.size() / 3};
+        for (int k = 0; k < 3; ++k)
+        {
+            first[k][c] = total[k];
+            total[k] += counts[k];
+        }
+        first_corner[c + 1] = first_corner[c] + chunks[c].corners.size();
+    }
+    size_t n_corners = first_corner[n_chunks];
+
+    // resolve the indices, and see which attributes every corner has
+    std::vector<OBJCorner> corners(n_corners);
+    bool bad_index = false, all_uvs = total[1] > 0, all_normals = total[2] > 0;
+    bool shared = true; // every corner uses one index for all it has
+#pragma omp parallel for schedule(dynamic) reduction(|| : bad_index) \
+    reduction(&& : all_uvs, all_normals, shared)
+    for (size_t c = 0; c < n_chunks; ++c)
+        for (size_t i = 0; i < chunks[c].corners.size(); ++i)
+        {
+            auto corner = chunks[c].corners[i];
+            for (int k = 0; k < 3; ++k)
+            {
+                if (corner.in_chunk[k])
+                    corner.index[k] += first[k][c];
+                if (corner.index[k] >= static_cast<int64_t>(total[k]) ||
+                    (corner.index[k] < 0 && (k == 0 || corner.in_chunk[k])))
+                    bad_index = true;
+            }
+            all_uvs = all_uvs && corner.index[1] >= 0;
+            all_normals = all_normals && corner.index[2] >= 0;
+            shared = shared && (corner.index[1] < 0 || corner.index[1] == corner.index[0]) &&
+                     (corner.index[2] < 0 || corner.index[2] == corner.index[0]);
+            corners[first_corner[c] + i] = corner;
+        }
+    // vertices no face uses have no attributes to share
+    shared = shared && (!all_uvs || total[1] == total[0]) &&
+             (!all_normals || total[2] == total[0]);
+    if (bad_index || n_corners / 3 > 0xffffffffu)
+    {
+        std::cerr << "[ERROR]: Index out of range in " << path << ".\n";
+        return false;
+    }
+
+    // the vertex of every corner
+    data = TriangleMeshData();
+    data.indices.resize(n_corners);
+    std::vector<OBJCorner> vertices; // distinct combinations, unless shared
+    if (shared)
+    {
+#pragma omp parallel for if (n_corners >= MESH_PARSE_CHUNK)
+        for (size_t i = 0; i < n_corners; ++i)
+            data.indices[i] = corners[i].index[0];
+    }
+    else
+    {
+        auto key = [&](const OBJCorner &corner)
+        {
+            return (static_cast<uint64_t>(corner.index[0]) * 0x9e3779b97f4a7c15ull) ^
+                   (static_cast<uint64_t>(all_uvs ? corner.index[1] : 0) * 0xc2b2ae3d27d4eb4full) ^
+                   (static_cast<uint64_t>(all_normals ? corner.index[2] : 0) * 0x165667b19e3779f9ull);
+        };
+        std::unordered_multimap<uint64_t, uint32_t> seen;
+        for (size_t i = 0; i < n_corners; ++i)
+        {
+            const auto &corner = corners[i];
+            uint64_t h = key(corner);
+            int64_t vertex = -1;
+            auto range = seen.equal_range(h);
+            for (auto it = range.first; it != range.second && vertex < 0; ++it)
+            {
+                const auto &other = vertices[it->second];
+                if (other.index[0] == corner.index[0] &&
+                    (!all_uvs || other.index[1] == corner.index[1]) &&
+                    (!all_normals || other.index[2] == corner.index[2]))
+                    vertex = it->second;
+            }
+            if (vertex < 0)
+            {
+                vertex = vertices.size();
+                vertices.push_back(corner);
+                seen.emplace(h, vertex);
+            }
+            data.indices[i] = vertex;
+        }
+    }
+
+    // gather the attributes of the vertices
+    size_t n_vertices = shared ? total[0] : vertices.size();
+    auto entry = [&](int k, size_t vertex) -> size_t
+    { return shared ? vertex : vertices[vertex].index[k]; };
+    data.x.resize(n_vertices);
+    data.y.resize(n_vertices);
+    data.z.resize(n_vertices);
+    if (all_uvs)
+    {
+        data.u.resize(n_vertices);
+        data.v.resize(n_vertices);
+    }
+    if (all_normals)
+    {
+        data.nx.resize(n_vertices);
+        data.ny.resize(n_vertices);
+        data.nz.resize(n_vertices);
+    }
+    for (int k = 0; k < 3; ++k)
+    {
+        if ((k == 1 && !all_uvs) || (k == 2 && !all_normals))
+            continue;
+        int width = k == 1 ? 2 : 3;
+        // where each entry of this kind is in the chunks
+        std::vector<const double *> values(total[k]);
+#pragma omp parallel for schedule(dynamic)
+        for (size_t c = 0; c < n_chunks; ++c)
+        {
+            const auto &chunk = chunks[c];
+            const auto &source = k == 0 ? chunk.positions : (k == 1 ? chunk.uvs : chunk.normals);
+            for (size_t i = 0; i < source.size() / width; ++i)
+                values[first[k][c] + i] = &source[width * i];
+        }
+        auto *out = k == 0 ? data.x.data() : (k == 1 ? data.u.data() : data.nx.data());
+        auto *out1 = k == 0 ? data.y.data() : (k == 1 ? data.v.data() : data.ny.data());
+        auto *out2 = k == 0 ? data.z.data() : (k == 2 ? data.nz.data() : nullptr);
+#pragma omp parallel for if (n_vertices >= MESH_PARSE_CHUNK)
+        for (size_t i = 0; i < n_vertices; ++i)
+        {
+            const double *value = values[entry(k, i)];
+            out[i] = value[0];
+            out1[i] = value[1];
+            if (out2)
+                out2[i] = value[2];
+        }
+    }
+    return true;
+}
+
+// ---------------------------------------------------------------- PLY
+
+enum class PLYType : uint8_t
+{
+    Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64
+};
+
+inline bool parsePLYType(const std::string &name, PLYType &type)
+{
+    static const char *names[][2] = {
+        {"char", "int8"}, {"uchar", "uint8"}, {"short", "int16"}, {"ushort", "uint16"},
+        {"int", "int32"}, {"uint", "uint32"}, {"float", "float32"}, {"double", "float64"}};
+    for (int t = 0; t < 8; ++t)
+        if (name == names[t][0] || name == names[t][1])
+        {
+            type = static_cast<PLYType>(t);
+            return true;
+        }
+    return false;
+}
+
+inline size_t plyTypeSize(PLYType type)
+{
+    static const size_t sizes[] = {1, 1, 2, 2, 4, 4, 4, 8};
+    return sizes[static_cast<int>(type)];
+}
+
+// the value at p, stored in the file's byte order
+inline double readPLY(const char *p, PLYType type, bool swap)
+{
+    unsigned char bytes[8];
+    size_t size = plyTypeSize(type);
+    for (size_t i = 0; i < size; ++i)
+        bytes[i] = p[swap ? size - 1 - i : i];
+    switch (type)
+    {
+    case PLYType::Int8:
+        return static_cast<int8_t>(bytes[0]);
+    case PLYType::UInt8:
+        return bytes[0];
+    case PLYType::Int16:
+    {
+        int16_t value;
+        std::memcpy(&value, bytes, 2);
+        return value;
+    }
+    case PLYType::UInt16:
+    {
+        uint16_t value;
+        std::memcpy(&value, bytes, 2);
+        return value;
+    }
+    case PLYType::Int32:
+    {
+        int32_t value;
+        std::memcpy(&value, bytes, 4);
+        return value;
+    }
+    case PLYType::UInt32:
+    {
+        uint32_t value;
+        std::memcpy(&value, bytes, 4);
+        return value;
+    }
+    case PLYType::Float32:
+    {
+        float value;
+        std::memcpy(&value, bytes, 4);
+        return value;
+    }
+    default:
+    {
+        double value;
+        std::memcpy(&value, bytes, 8);
+        return value;
+    }
+    }
+}
+
+// a vertex index read by readPLY(); a negative or too large one becomes
+//  UINT32_MAX, which the mesh rejects as out of range, instead of an
+//  undefined conversion
+inline uint32_t plyIndex(double value)
+{
+    return value >= 0 && value < 4294967296.0 ? static_cast<uint32_t>(value) : UINT32_MAX;
+}
+
+struct PLYProperty
+{
+    std::string name;
+    PLYType type;
+    bool is_list = false;
+    PLYType count_type; // of a list, whose entries are of `type`
+    size_t offset;      // in the record, for elements without lists
+};
+
+struct PLYElement
+{
+    std::string name;
+    size_t count;
+    std::vector<PLYProperty> properties;
+    size_t record_size = 0; // 0 if a property is a list
+
+    const PLYProperty *find(std::initializer_list<const char *> names) const
+    {
+        for (const auto &property : properties)
+            for (auto name : names)
+                if (property.name == name)
+                    return &property;
+        return nullptr;
+    }
+};
+
+// Binary PLY, little or big endian, with the vertices and the faces as
+//  the "vertex" and "face" elements; other elements are skipped as long
+//  as they have no lists. Faces are read in parallel when they are all
+//  triangles without other properties, as most are.
+bool loadPLY(const std::string &path, TriangleMeshData &data)
+{
+    MappedFile file(path);
+    const char *text = file.data();
+    size_t size = file.size();
+    auto fail = [&](const char *what)
+    {
+        std::cerr << "[ERROR]: " << what << " in " << path << ".\n";
+        return false;
+    };
+    if (!text)
+        return fail("Cannot read file");
+
+    // the header is text, one statement per line
+    const char *end_header = nullptr;
+    for (size_t pos = 0; pos + 10 <= size; ++pos)
+        if (std::memcmp(text + pos, "end_header", 10) == 0 &&
+            (pos == 0 || text[pos - 1] == '\n'))
+        {
+            end_header = text + pos;
+            break;
+        }
+    if (size < 4 || std::memcmp(text, "ply", 3) != 0 || !end_header)
+        return fail("No PLY header");
+    const char *body = static_cast<const char *>(
+        std::memchr(end_header, '\n', text + size - end_header));
+    if (!body)
+        return fail("No PLY header");
+    ++body;
+
+    bool swap = false;
+    bool format_seen = false;
+    std::vector<PLYElement> elements;
+    std::string header(text, end_header - text);
+    size_t line_start = 0;
+    while (line_start < header.size())
+    {
+        size_t line_end = header.find('\n', line_start);
+        if (line_end == std::string::npos)
+            line_end = header.size();
+        std::vector<std::string> words;
+        size_t pos = line_start;
+        while (pos < line_end)
+        {
+            while (pos < line_end && std::isspace(static_cast<unsigned char>(header[pos])))
+                ++pos;
+            size_t word = pos;
+            while (pos < line_end && !std::isspace(static_cast<unsigned char>(header[pos])))
+                ++pos;
+            if (pos > word)
+                words.push_back(header.substr(word, pos - word));
+        }
+        line_start = line_end + 1;
+        if (words.empty())
+            continue;
+
+        if (words[0] == "format")
+        {
+            uint16_t one = 1;
+            bool little_host = *reinterpret_cast<const unsigned char *>(&one) == 1;
+            if (words.size() < 2 || words[1] == "ascii")
+                return fail("Only binary PLY is supported");
+            if (words[1] != "binary_little_endian" && words[1] != "binary_big_endian")
+                return fail("Unknown PLY format");
+            swap = (words[1] == "binary_little_endian") != little_host;
+            format_seen = true;
+        }
+        else if (words[0] == "element" && words.size() == 3)
+        {
+            char *end;
+            errno = 0;
+            unsigned long long count = std::strtoull(words[2].c_str(), &end, 10);
+            if (*end || errno == ERANGE || words[2][0] == '-')
+                return fail("Bad PLY element");
+            elements.push_back({words[1], count, {}});
+        }
+        else if (words[0] == "property" && !elements.empty())
+        {
+            PLYProperty property;
+            bool ok;
+            if (words.size() == 5 && words[1] == "list")
+            {
+                property.is_list = true;
+                property.name = words[4];
+                ok = parsePLYType(words[2], property.count_type) &&
+                     parsePLYType(words[3], property.type);
+            }
+            else
+            {
+                property.name = words.size() == 3 ? words[2] : "";
+                ok = words.size() == 3 && parsePLYType(words[1], property.type);
+            }
+            if (!ok)
+                return fail("Unknown PLY property");
+            elements.back().properties.push_back(property);
+        }
+    }
+    if (!format_seen)
+        return fail("No PLY format");
+
+    for (auto &element : elements)
+    {
+        size_t offset = 0;
+        bool has_list = false;
+        for (auto &property : element.properties)
+        {
+            property.offset = offset;
+            has_list = has_list || property.is_list;
+            offset += plyTypeSize(property.type);
+        }
+        element.record_size = has_list ? 0 : offset;
+    }
+
+    data = TriangleMeshData();
+    const char *p = body;
+    const char *file_end = text + size;
+    for (const auto &element : elements)
+    {
+        if (element.name == "vertex")
+        {
+            if (!element.record_size)
+                return fail("List in PLY vertices");
+            if (static_cast<size_t>(file_end - p) / element.record_size < element.count)
+                return fail("File too short");
+            const PLYProperty *position[3] = {element.find({"x"}), element.find({"y"}),
+                                              element.find({"z"})};
+            const PLYProperty *normal[3] = {element.find({"nx"}), element.find({"ny"}),
+                                            element.find({"nz"})};
+            const PLYProperty *uv[2] = {element.find({"u", "s", "texture_u", "texture_s"}),
+                                        element.find({"v", "t", "texture_v", "texture_t"})};
+            if (!position[0] || !position[1] || !position[2])
+                return fail("No PLY vertex positions");
+            bool has_normals = normal[0] && normal[1] && normal[2];
+            bool has_uvs = uv[0] && uv[1];
+
+            size_t n = element.count;
+            data.x.resize(n);
+            data.y.resize(n);
+            data.z.resize(n);
+            if (has_normals)
+            {
+                data.nx.resize(n);
+                data.ny.resize(n);
+                data.nz.resize(n);
+            }
+            if (has_uvs)
+            {
+                data.u.resize(n);
+                data.v.resize(n);
+            }
+            const char *records = p;
+            size_t record_size = element.record_size;
+            auto read = [&](const char *record, const PLYProperty *property)
+            { return readPLY(record + property->offset, property->type, swap); };
+#pragma omp parallel for if (n >= MESH_PARSE_CHUNK / 64)
+            for (size_t i = 0; i < n; ++i)
+            {
+                const char *record = records + i * record_size;
+                data.x[i] = read(record, position[0]);
+                data.y[i] = read(record, position[1]);
+                data.z[i] = read(record, position[2]);
+                if (has_normals)
+                {
+                    data.nx[i] = read(record, normal[0]);
+                    data.ny[i] = read(record, normal[1]);
+                    data.nz[i] = read(record, normal[2]);
+                }
+                if (has_uvs)
+                {
+                    data.u[i] = read(record, uv[0]);
+                    data.v[i] = read(record, uv[1]);
+                }
+            }
+            p += n * record_size;
+        }
+        else if (element.name == "face")
+        {
+            const PLYProperty *list = element.find({"vertex_indices", "vertex_index"});
+            if (!list || !list->is_list)
+                return fail("No PLY face indices");
+            size_t n = element.count;
+            size_t count_size = plyTypeSize(list->count_type);
+            size_t index_size = plyTypeSize(list->type);
+            size_t stride = count_size + 3 * index_size;
+
+            // all triangles: every face is the same size, read in parallel
+            bool triangles = element.properties.size() == 1 &&
+                             static_cast<size_t>(file_end - p) / stride >= n;
+            if (triangles)
+            {
+#pragma omp parallel for reduction(&& : triangles) if (n >= MESH_PARSE_CHUNK / 16)
+                for (size_t f = 0; f < n; ++f)
+                    triangles = triangles && readPLY(p + f * stride, list->count_type, swap) == 3;
+            }
+            if (triangles)
+            {
+                data.indices.resize(3 * n);
+#pragma omp parallel for if (n >= MESH_PARSE_CHUNK / 16)
+                for (size_t f = 0; f < n; ++f)
+                    for (int k = 0; k < 3; ++k)
+                        data.indices[3 * f + k] = plyIndex(readPLY(
+                            p + f * stride + count_size + k * index_size, list->type, swap));
+                p += n * stride;
+                continue;
+            }
+
+            // otherwise face by face, splitting polygons into fans
+            for (size_t f = 0; f < n; ++f)
+                for (const auto &property : element.properties)
+                {
+                    if (!property.is_list)
+                    {
+                        p += plyTypeSize(property.type);
+                        continue;
+                    }
+                    if (p + plyTypeSize(property.count_type) > file_end)
+                        return fail("File too short");
+                    double list_count = readPLY(p, property.count_type, swap);
+                    if (!(list_count >= 0 && list_count < 4294967296.0))
+                        return fail("Bad PLY list size");
+                    size_t count = list_count;
+                    p += plyTypeSize(property.count_type);
+                    size_t entry_size = plyTypeSize(property.type);
+                    if (static_cast<size_t>(file_end - p) / entry_size < count)
+                        return fail("File too short");
+                    if (&property == list)
+                        for (size_t k = 2; k < count; ++k)
+                        {
+                            data.addTriangle(plyIndex(readPLY(p, property.type, swap)),
+                                             plyIndex(readPLY(p + (k - 1) * entry_size, property.type, swap)),
+                                             plyIndex(readPLY(p + k * entry_size, property.type, swap)));
+                        }
+                    p += count * entry_size;
+                }
+            if (p > file_end)
+                return fail("File too short");
+        }
+        else
+        {
+            if (!element.record_size)
+                return fail("Unsupported PLY element with lists");
+            if (static_cast<size_t>(file_end - p) / element.record_size < element.count)
+                return fail("File too short");
+            p += element.count * element.record_size;
+        }
+    }
+    if (data.x.empty())
+        return fail("No PLY vertices");
+    return true;
+}
+
+// ------------------------------------------------------------ .rtmesh
+
+const uint32_t MESH_FILE_VERSION = 1;
+const uint32_t MESH_FILE_NORMALS = 1;
+const uint32_t MESH_FILE_UVS = 2;
+
+struct MeshFileHeader
+{
+    char magic[8];       // "RTMESH" followed by zeros
+    uint32_t version;    // MESH_FILE_VERSION
+    uint32_t byte_order; // 0x01020304 as written
+    uint32_t node_size;  // sizeof(BVHLinearNode)
+    uint32_t flags;      // MESH_FILE_NORMALS, MESH_FILE_UVS
+    uint64_t n_vertices;
+    uint64_t n_triangles;
+    uint64_t n_nodes;
+    uint64_t reserved[2];
+};
+
+// byte offsets of the arrays in a mesh file, 0 for those it has none of
+struct MeshFileLayout
+{
+    size_t nodes;
+    size_t position[3], normal[3], uv[2];
+    size_t corner[3];
+    size_t size; // of the whole file
+};
+
+inline MeshFileLayout meshFileLayout(const MeshFileHeader &header)
+{
+    MeshFileLayout layout;
+    std::memset(&layout, 0, sizeof(layout));
+    size_t offset = (sizeof(MeshFileHeader) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    auto place = [&](size_t bytes)
+    {
+        size_t start = offset;
+        offset += (bytes + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+        return start;
+    };
+    layout.nodes = place(header.n_nodes * sizeof(BVHLinearNode));
+    for (int k = 0; k < 3; ++k)
+        layout.position[k] = place(header.n_vertices * sizeof(double));
+    if (header.flags & MESH_FILE_NORMALS)
+        for (int k = 0; k < 3; ++k)
+            layout.normal[k] = place(header.n_vertices * sizeof(double));
+    if (header.flags & MESH_FILE_UVS)
+        for (int k = 0; k < 2; ++k)
+            layout.uv[k] = place(header.n_vertices * sizeof(double));
+    for (int k = 0; k < 3; ++k)
+        layout.corner[k] = place(header.n_triangles * sizeof(uint32_t));
+    layout.size = offset;
+    return layout;
+}
+
+// Maps a mesh file, and returns a mesh over the mapped arrays.
+// Returns null if the file is missing, was written by another version
+//  or on another kind of machine, or is malformed.
+shared_ptr<TriangleMesh> mapMeshFile(const std::string &path, shared_ptr<Material> mat_ptr)
+{
+    auto file = make_shared<MappedFile>(path);
+    const char *bytes = file->data();
+    auto fail = [&](const char *what)
+    {
+        std::cerr << "[ERROR]: " << what << " in " << path << ".\n";
+        return nullptr;
+    };
+    if (!bytes || file->size() < sizeof(MeshFileHeader))
+        return fail("Cannot read mesh file");
+
+    MeshFileHeader header;
+    std::memcpy(&header, bytes, sizeof(header));
+    if (std::memcmp(header.magic, "RTMESH\0\0", 8) != 0 ||
+        header.version != MESH_FILE_VERSION || header.byte_order != 0x01020304 ||
+        header.node_size != sizeof(BVHLinearNode))
+        return fail("Not a mesh file of this version");
+    // sizes that could overflow the layout are rejected before it
+    if (header.n_vertices > 0xffffffffu || header.n_triangles > 0xffffffffu ||
+        header.n_nodes > 2 * header.n_triangles ||
+        (header.n_nodes == 0) != (header.n_triangles == 0))
+        return fail("Bad mesh sizes");
+    auto layout = meshFileLayout(header);
+    if (layout.size != file->size())
+        return fail("Bad mesh file size");
+
+    TriangleMeshArrays arrays;
+    arrays.n_vertices = header.n_vertices;
+    arrays.n_triangles = header.n_triangles;
+    arrays.n_nodes = header.n_nodes;
+    auto doubles = [&](size_t offset)
+    { return offset ? reinterpret_cast<const double *>(bytes + offset) : nullptr; };
+    arrays.x = doubles(layout.position[0]);
+    arrays.y = doubles(layout.position[1]);
+    arrays.z = doubles(layout.position[2]);
+    arrays.nx = doubles(layout.normal[0]);
+    arrays.ny = doubles(layout.normal[1]);
+    arrays.nz = doubles(layout.normal[2]);
+    arrays.u = doubles(layout.uv[0]);
+    arrays.v = doubles(layout.uv[1]);
+    for (int k = 0; k < 3; ++k)
+        arrays.corner[k] = reinterpret_cast<const uint32_t *>(bytes + layout.corner[k]);
+    arrays.nodes = reinterpret_cast<const BVHLinearNode *>(bytes + layout.nodes);
+
+    // never trust an index that could send traversal out of bounds,
+    //  or back up the tree: children always follow their parent
+    size_t n_nodes = arrays.n_nodes, n_triangles = arrays.n_triangles;
+    bool valid = true;
+#pragma omp parallel for reduction(&& : valid) if (n_nodes >= MESH_PARSE_CHUNK / 64)
+    for (size_t i = 0; i < n_nodes; ++i)
+    {
+        const auto &node = arrays.nodes[i];
+        valid = valid && (node.count ? static_cast<size_t>(node.offset) + node.count <= n_triangles
+                                     : node.offset > i && node.offset + 1 < n_nodes);
+    }
+#pragma omp parallel for reduction(&& : valid) if (n_triangles >= MESH_PARSE_CHUNK / 16)
+    for (size_t t = 0; t < n_triangles; ++t)
+        valid = valid && arrays.corner[0][t] < arrays.n_vertices &&
+                arrays.corner[1][t] < arrays.n_vertices &&
+                arrays.corner[2][t] < arrays.n_vertices;
+    if (!valid)
+        return fail("Index out of range");
+
+    // nor a tree deeper than the traversal stack; as children follow
+    //  their parent, one pass in order sees every parent first
+    std::vector<uint32_t> depth(n_nodes, 0);
+    for (size_t i = 0; i < n_nodes; ++i)
+    {
+        const auto &node = arrays.nodes[i];
+        if (node.count)
+            continue;
+        if (depth[i] >= BVH_STACK_SIZE - 1)
+            return fail("BVH too deep");
+        for (uint32_t child = node.offset; child < node.offset + 2; ++child)
+            depth[child] = std::max(depth[child], depth[i] + 1);
+    }
+
+    return make_shared<TriangleMesh>(arrays, file, mat_ptr);
+}
+
+bool saveMeshFile(const std::string &path, const TriangleMesh &mesh)
+{
+    const auto &arrays = mesh.meshArrays();
+    MeshFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "RTMESH", 6);
+    header.version = MESH_FILE_VERSION;
+    header.byte_order = 0x01020304;
+    header.node_size = sizeof(BVHLinearNode);
+    header.flags = (arrays.nx ? MESH_FILE_NORMALS : 0) | (arrays.u ? MESH_FILE_UVS : 0);
+    header.n_vertices = arrays.n_vertices;
+    header.n_triangles = arrays.n_triangles;
+    header.n_nodes = arrays.n_nodes;
+    auto layout = meshFileLayout(header);
+
+    auto temp_path = path + "." + std::to_string(getpid()) + ".tmp";
+    FILE *file = std::fopen(temp_path.c_str(), "wb");
+    if (!file)
+    {
+        std::cerr << "[ERROR]: Cannot write mesh file " << temp_path << ".\n";
+        return false;
+    }
+    size_t written = 0;
+    bool ok = true;
+    // each array at its offset, after zeros up to it
+    auto put = [&](size_t offset, const void *data, size_t bytes)
+    {
+        if (!data)
+            bytes = 0;
+        static const char zeros[CACHE_LINE_SIZE] = {};
+        while (ok && written < offset)
+        {
+            size_t n = std::min(offset - written, sizeof(zeros));
+            ok = std::fwrite(zeros, 1, n, file) == n;
+            written += n;
+        }
+        ok = ok && (!bytes || std::fwrite(data, 1, bytes, file) == bytes);
+        written += bytes;
+    };
+    put(0, &header, sizeof(header));
+    put(layout.nodes, arrays.nodes, arrays.n_nodes * sizeof(BVHLinearNode));
+    const double *position[3] = {arrays.x, arrays.y, arrays.z};
+    const double *normal[3] = {arrays.nx, arrays.ny, arrays.nz};
+    const double *uv[2] = {arrays.u, arrays.v};
+    size_t vertex_bytes = arrays.n_vertices * sizeof(double);
+    for (int k = 0; k < 3; ++k)
+        put(layout.position[k], position[k], vertex_bytes);
+    if (arrays.nx)
+        for (int k = 0; k < 3; ++k)
+            put(layout.normal[k], normal[k], vertex_bytes);
+    if (arrays.u)
+        for (int k = 0; k < 2; ++k)
+            put(layout.uv[k], uv[k], vertex_bytes);
+    for (int k = 0; k < 3; ++k)
+        put(layout.corner[k], arrays.corner[k], arrays.n_triangles * sizeof(uint32_t));
+    put(layout.size, nullptr, 0);
+
+    ok = std::fclose(file) == 0 && ok;
+    if (!ok || std::rename(temp_path.c_str(), path.c_str()) != 0)
+    {
+        std::remove(temp_path.c_str());
+        std::cerr << "[ERROR]: Cannot write mesh file " << path << ".\n";
+        return false;
+    }
+    return true;
+}
+
+// ---------------------------------------------------------------------
+
+inline bool endsWith(const std::string &s, const char *suffix)
+{
+    size_t n = std::strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+// The mesh in a .obj, .ply or .rtmesh file, null if it cannot be read.
+shared_ptr<TriangleMesh> loadMesh(const std::string &path, shared_ptr<Material> mat_ptr,
+                                  const BVHBuildOptions &options = BVHBuildOptions())
+{
+    if (endsWith(path, ".rtmesh"))
+        return mapMeshFile(path, mat_ptr);
+
+    TriangleMeshData data;
+    bool ok;
+    if (endsWith(path, ".obj"))
+        ok = loadOBJ(path, data);
+    else if (endsWith(path, ".ply"))
+        ok = loadPLY(path, data);
+    else
+    {
+        std::cerr << "[ERROR]: Unknown mesh format " << path << ".\n";
+        return nullptr;
+    }
+    if (!ok)
+        return nullptr;
+    return make_shared<TriangleMesh>(std::move(data), mat_ptr, options);
+}
@@ -12,21 +12,8 @@ private:
     double radius;
     shared_ptr<Material> mat_ptr;
 
-public:
-    MovingSphere() {}
-    MovingSphere(Point3 cen0, Point3 cen1,
-                 double t0, double t1, double r,
-                 shared_ptr<Material> m)
-        : center0(cen0), center1(cen1),
-          time0(t0), time1(t1), radius(r), mat_ptr(m) {}
-
-    Point3 center(double time) const
-    {
-        return center0 + ((time - time0) / (time1 - time0)) * (center1 - center0);
-    }
-
-    bool hit(const Ray &r, double t_min,
-             double t_max, HitRecord &rec) const override
+    // Find the nearest root that lies in the acceptable range.
+    bool nearestRoot(const Ray &r, double t_min, double t_max, double &root) const
     {
         Vec3 oc = r.origin() - center(r.time());
         auto a = r.direction().lengthSquared();
@@ -38,14 +25,35 @@ public:
             return false;
         auto sqrtd = sqrt(discriminant);
 
-        // Find the nearest root that lies in the acceptable range.
-        auto root = (-half_b - sqrtd) / a;
+        root = (-half_b - sqrtd) / a;
         if (root < t_min || t_max < root)
         {
             root = (-half_b + sqrtd) / a;
             if (root < t_min || t_max < root)
                 return false;
         }
+        return true;
+    }
+
+public:
+    MovingSphere() {}
+    MovingSphere(Point3 cen0, Point3 cen1,
+                 double t0, double t1, double r,
+                 shared_ptr<Material> m)
+        : center0(cen0), center1(cen1),
+          time0(t0), time1(t1), radius(r), mat_ptr(m) {}
+
+    Point3 center(double time) const
+    {
+        return center0 + ((time - time0) / (time1 - time0)) * (center1 - center0);
+    }
+
+    bool hit(const Ray &r, double t_min,
+             double t_max, HitRecord &rec) const override
+    {
+        double root;
+        if (!nearestRoot(r, t_min, t_max, root))
+            return false;
 
         rec.t = root;
         rec.p = r.at(rec.t);
@@ -56,6 +64,12 @@ public:
         return true;
     }
 
+    bool occluded(const Ray &r, double t_min, double t_max) const override
+    {
+        double root;
+        return nearestRoot(r, t_min, t_max, root);
+    }
+
     bool boundingBox(double t0, double t1,
                      AABB &output_box) const override
     {
@@ -3,6 +3,7 @@
 #include <ctime>
 #include <cmath>
 #include <cstdlib>
+#include <cstdint>
 #include <limits>
 #include <memory>
 #include <iostream>
@@ -27,10 +28,22 @@ inline double deg2rad(double degrees)
     return degrees * PI / 180;
 }
 
-inline int randomInt(int min, int max)
+// statistics and benchmark builds (see bvh_stats.hpp and
+//  accelerators.hpp) use a fixed seed, so that every run sees
+//  the same scene and the same rays
+inline unsigned randomSeed()
 {
+#if defined(BVH_STATS) || defined(ACCEL_BENCH)
+    return 12345;
+#else
     static std::random_device rd;
-    static std::mt19937 gen(rd());
+    return rd();
+#endif
+}
+
+inline int randomInt(int min, int max)
+{
+    static std::mt19937 gen(randomSeed());
     std::uniform_int_distribution<int> dist(min, max);
     return dist(gen);
 }
@@ -38,8 +51,7 @@ inline int randomInt(int min, int max)
 inline double randomReal()
 {
     // Returns a random real in [0, 1).
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
+    static std::mt19937 gen(randomSeed());
     static std::uniform_real_distribution<double> dist(0.0, 1.0);
     return dist(gen);
 }
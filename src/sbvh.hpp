@@ -0,0 +1,435 @@
+// Spatial-split BVH: besides partitioning the primitives, a node may
+//  cut space at a plane and hand a straddling primitive to both sides
+//  (Stich et al., "Spatial Splits in Bounding Volume Hierarchies", 2009).
+//
+// Each side gets the bounds of the part of the primitive on that side,
+//  as reported by the clip function (Hittable::clippedBox).
+// A primitive may end up in several leaves, and be hit more than once
+//  per ray; do not use this for primitives with a random hit(),
+//  such as ConstantMedium.
+
+#pragma once
+
+#include <functional>
+
+#include "raytracer.h"
+#include "aabb.hpp"
+#include "bvh_build.hpp"
+
+// part of `box` between lo and hi along axis
+inline AABB clipBox(const AABB &box, int axis, double lo, double hi)
+{
+    auto min = box.min(), max = box.max();
+    min[axis] = fmax(min[axis], lo);
+    max[axis] = fmin(max[axis], hi);
+    return AABB(min, max);
+}
+
+inline double overlapArea(const AABB &a, const AABB &b)
+{
+    AABB overlap;
+    return overlapBox(a, b, overlap) ? overlap.surfaceArea() : 0;
+}
+
+// Builds serially: every node owns the references below it,
+//  and leaves are appended in depth-first order.
+class SBVHBuilder
+{
+public:
+    // bounds of the part of primitive `index` inside `clip`,
+    //  false if nothing is inside
+    using ClipFunction = std::function<bool(size_t index, const AABB &clip,
+                                            AABB &output_box)>;
+
+private:
+    struct Split
+    {
+        double cost = INF; // sum of area * count over both sides
+        int axis = -1;
+        int bin = 0;       // last bin on the left
+        double position;   // spatial only: the plane
+        bool spatial = false;
+        AABB left, right;
+        size_t left_count, right_count;
+    };
+
+    std::vector<BVHPrimitive> &prims;
+    std::vector<BVHPrimitive> leaf_refs; // references in leaf order
+    ClipFunction clip;
+    BVHBuildOptions options;
+    int n_bins;
+    size_t max_leaf_size;
+    double min_overlap; // smallest child overlap worth a spatial split
+    size_t max_refs;    // no more spatial splits beyond this many references
+    size_t n_refs;      // references in the tree so far
+
+    Split findObjectSplit(const std::vector<BVHPrimitive> &refs,
+                          const AABB &centroid_box) const;
+    Split findSpatialSplit(const std::vector<BVHPrimitive> &refs,
+                           const AABB &box) const;
+    void spatialSplit(std::vector<BVHPrimitive> &refs, Split split,
+                      std::vector<BVHPrimitive> &left,
+                      std::vector<BVHPrimitive> &right) const;
+
+    std::unique_ptr<BVHBuildNode> buildRecursive(std::vector<BVHPrimitive> &refs,
+                                                 int depth);
+
+public:
+    SBVHBuilder(std::vector<BVHPrimitive> &prims, ClipFunction clip,
+                const BVHBuildOptions &options)
+        : prims(prims), clip(clip), options(options)
+    {
+        n_bins = std::max(options.n_bins, 2);
+        max_leaf_size = std::max(1, std::min(options.max_leaf_size, 0xffff));
+        max_refs = prims.size() * (1 + std::max(0.0, options.spatial_budget));
+    }
+
+    // Appends the tree to `nodes` and replaces `prims` with the
+    //  references in leaf order, which may repeat a primitive.
+    void build(AlignedVector<BVHLinearNode> &nodes);
+};
+
+void SBVHBuilder::build(AlignedVector<BVHLinearNode> &nodes)
+{
+    if (prims.empty())
+        return;
+
+    AABB root_box = prims[0].box;
+    for (const auto &prim : prims)
+        root_box = surroundingBox(root_box, prim.box);
+    min_overlap = options.spatial_alpha * root_box.surfaceArea();
+    n_refs = prims.size();
+
+    leaf_refs.reserve(prims.size());
+    std::vector<BVHPrimitive> refs(prims);
+    auto root = buildRecursive(refs, 0);
+
+    prims.swap(leaf_refs);
+    leaf_refs.clear();
+    nodes.reserve(nodes.size() + 2 * prims.size());
+    flattenBVH(root.get(), nodes);
+}
+
+SBVHBuilder::Split
+SBVHBuilder::findObjectSplit(const std::vector<BVHPrimitive> &refs,
+                             const AABB &centroid_box) const
+{
+    struct Bin
+    {
+        AABB box;
+        size_t count = 0;
+    };
+
+    Split best;
+    std::vector<Bin> bins(n_bins);
+    std::vector<AABB> right_box(n_bins);
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        if (centroid_box.max()[axis] <= centroid_box.min()[axis])
+            continue;
+        std::fill(bins.begin(), bins.end(), Bin());
+        for (const auto &ref : refs)
+        {
+            auto &bin = bins[binIndex(ref, centroid_box, axis, n_bins)];
+            bin.box = bin.count++ ? surroundingBox(bin.box, ref.box) : ref.box;
+        }
+
+        // right_box[b]: box of buckets (b, n_bins)
+        size_t right_count = 0;
+        for (int b = n_bins - 1; b > 0; --b)
+        {
+            if (bins[b].count)
+                right_box[b - 1] = right_count ? surroundingBox(right_box[b], bins[b].box)
+                                               : bins[b].box;
+            else
+                right_box[b - 1] = right_box[b];
+            right_count += bins[b].count;
+        }
+
+        AABB left_box;
+        size_t left_count = 0;
+        for (int b = 0; b < n_bins - 1; ++b)
+        {
+            if (bins[b].count)
+                left_box = left_count ? surroundingBox(left_box, bins[b].box)
+                                      : bins[b].box;
+            left_count += bins[b].count;
+            if (left_count == 0 || left_count == refs.size())
+                continue;
+
+            double cost = left_box.surfaceArea() * left_count +
+                          right_box[b].surfaceArea() * (refs.size() - left_count);
+            if (cost < best.cost)
+            {
+                best.cost = cost;
+                best.axis = axis;
+                best.bin = b;
+                best.left = left_box;
+                best.right = right_box[b];
+                best.left_count = left_count;
+                best.right_count = refs.size() - left_count;
+            }
+        }
+    }
+    return best;
+}
+
+// Bins are equal slabs of the node box. A reference enters at the bin
+//  holding its min and exits at the bin holding its max, and grows the
+//  box of every bin in between by its clipped part.
+SBVHBuilder::Split
+SBVHBuilder::findSpatialSplit(const std::vector<BVHPrimitive> &refs,
+                              const AABB &box) const
+{
+    struct Bin
+    {
+        AABB box;
+        bool empty = true;
+        size_t enter = 0, exit = 0;
+    };
+
+    Split best;
+    best.spatial = true;
+    std::vector<Bin> bins(n_bins);
+    std::vector<AABB> right_box(n_bins);
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        auto lo = box.min()[axis];
+        auto width = (box.max()[axis] - lo) / n_bins;
+        if (width <= 0)
+            continue;
+        std::fill(bins.begin(), bins.end(), Bin());
+
+        auto slab = [&](double x)
+        { return std::max(0, std::min(n_bins - 1, static_cast<int>((x - lo) / width))); };
+
+        for (const auto &ref : refs)
+        {
+            int first = slab(ref.box.min()[axis]);
+            int last = slab(ref.box.max()[axis]);
+            for (int b = first; b <= last; ++b)
+            {
+                AABB part;
+                auto slab_box = clipBox(ref.box, axis, lo + b * width, lo + (b + 1) * width);
+                if (!clip(ref.index, slab_box, part))
+                    continue;
+                bins[b].box = bins[b].empty ? part : surroundingBox(bins[b].box, part);
+                bins[b].empty = false;
+            }
+            ++bins[first].enter;
+            ++bins[last].exit;
+        }
+
+        bool empty = true;
+        for (int b = n_bins - 1; b > 0; --b)
+        {
+            if (!bins[b].empty)
+            {
+                right_box[b - 1] = empty ? bins[b].box : surroundingBox(right_box[b], bins[b].box);
+                empty = false;
+            }
+            else
+                right_box[b - 1] = right_box[b];
+        }
+
+        size_t right_count = 0;
+        for (const auto &bin : bins)
+            right_count += bin.exit;
+
+        AABB left_box;
+        empty = true;
+        size_t left_count = 0;
+        for (int b = 0; b < n_bins - 1; ++b)
+        {
+            if (!bins[b].empty)
+            {
+                left_box = empty ? bins[b].box : surroundingBox(left_box, bins[b].box);
+                empty = false;
+            }
+            left_count += bins[b].enter;
+            right_count -= bins[b].exit;
+            if (left_count == 0 || right_count == 0)
+                continue;
+
+            double cost = left_box.surfaceArea() * left_count +
+                          right_box[b].surfaceArea() * right_count;
+            if (cost < best.cost)
+            {
+                best.cost = cost;
+                best.axis = axis;
+                best.bin = b;
+                best.position = lo + (b + 1) * width;
+                best.left = left_box;
+                best.right = right_box[b];
+                best.left_count = left_count;
+                best.right_count = right_count;
+            }
+        }
+    }
+    return best;
+}
+
+// Straddling references are split in two, unless moving all of it
+//  to one side is cheaper ("reference unsplitting"),
+//  or only one side holds any part of the primitive.
+void SBVHBuilder::spatialSplit(std::vector<BVHPrimitive> &refs, Split split,
+                               std::vector<BVHPrimitive> &left,
+                               std::vector<BVHPrimitive> &right) const
+{
+    int axis = split.axis;
+    for (auto &ref : refs)
+    {
+        if (ref.box.max()[axis] <= split.position)
+        {
+            left.push_back(ref);
+            continue;
+        }
+        if (ref.box.min()[axis] >= split.position)
+        {
+            right.push_back(ref);
+            continue;
+        }
+
+        auto left_part = ref, right_part = ref;
+        bool in_left = clip(ref.index, clipBox(ref.box, axis, -INF, split.position),
+                            left_part.box);
+        bool in_right = clip(ref.index, clipBox(ref.box, axis, split.position, INF),
+                             right_part.box);
+        if (!in_left || !in_right)
+        {
+            // rounding may lose both parts, then keep the reference whole
+            if (in_right)
+            {
+                right_part.centroid = right_part.box.centroid();
+                right.push_back(right_part);
+            }
+            else
+            {
+                if (in_left)
+                    left_part.centroid = left_part.box.centroid();
+                left.push_back(left_part);
+            }
+            continue;
+        }
+
+        auto left_area = split.left.surfaceArea();
+        auto right_area = split.right.surfaceArea();
+        auto grown_left = surroundingBox(split.left, ref.box);
+        auto grown_right = surroundingBox(split.right, ref.box);
+
+        double split_cost = left_area * split.left_count +
+                            right_area * split.right_count;
+        double left_cost = INF, right_cost = INF;
+        if (split.right_count > 1)
+            left_cost = grown_left.surfaceArea() * split.left_count +
+                        right_area * (split.right_count - 1);
+        if (split.left_count > 1)
+            right_cost = left_area * (split.left_count - 1) +
+                         grown_right.surfaceArea() * split.right_count;
+
+        if (left_cost < split_cost && left_cost <= right_cost)
+        {
+            split.left = grown_left;
+            --split.right_count;
+            left.push_back(ref);
+        }
+        else if (right_cost < split_cost)
+        {
+            split.right = grown_right;
+            --split.left_count;
+            right.push_back(ref);
+        }
+        else
+        {
+            left_part.centroid = left_part.box.centroid();
+            right_part.centroid = right_part.box.centroid();
+            left.push_back(left_part);
+            right.push_back(right_part);
+        }
+    }
+}
+
+std::unique_ptr<BVHBuildNode>
+SBVHBuilder::buildRecursive(std::vector<BVHPrimitive> &refs, int depth)
+{
+    std::unique_ptr<BVHBuildNode> node(new BVHBuildNode());
+    size_t object_span = refs.size();
+
+    AABB centroid_box(refs[0].centroid, refs[0].centroid);
+    node->box = refs[0].box;
+    for (const auto &ref : refs)
+    {
+        node->box = surroundingBox(node->box, ref.box);
+        centroid_box = surroundingBox(centroid_box, ref.centroid);
+    }
+
+    Split best;
+    if (object_span > 1 && depth < BVH_STACK_SIZE - 32)
+    {
+        best = findObjectSplit(refs, centroid_box);
+
+        // only look for a spatial split where the object split
+        //  leaves children that overlap noticeably
+        if ((best.axis == -1 || overlapArea(best.left, best.right) > min_overlap) &&
+            n_refs < max_refs)
+        {
+            auto spatial = findSpatialSplit(refs, node->box);
+            if (spatial.cost < best.cost &&
+                spatial.left_count + spatial.right_count - object_span <= max_refs - n_refs)
+                best = spatial;
+        }
+    }
+
+    double leaf_cost = options.intersect_cost * object_span;
+    double best_cost = INF;
+    if (best.axis != -1)
+        best_cost = options.traversal_cost +
+                    options.intersect_cost * best.cost / node->box.surfaceArea();
+
+    if (object_span <= max_leaf_size && leaf_cost <= best_cost)
+    {
+        node->offset = leaf_refs.size();
+        node->count = object_span;
+        leaf_refs.insert(leaf_refs.end(), refs.begin(), refs.end());
+        node->update(options);
+        return node;
+    }
+
+    std::vector<BVHPrimitive> left, right;
+    if (best.axis != -1 && best.spatial)
+        spatialSplit(refs, best, left, right);
+    else if (best.axis != -1)
+    {
+        for (const auto &ref : refs)
+            (binIndex(ref, centroid_box, best.axis, n_bins) <= best.bin ? left : right)
+                .push_back(ref);
+    }
+
+    if (left.empty() || right.empty())
+    {
+        // too deep for the traversal stack, or no split found:
+        //  halve along the widest centroid extent
+        best.axis = centroid_box.maxExtent();
+        size_t mid = object_span / 2;
+        std::nth_element(
+            refs.begin(), refs.begin() + mid, refs.end(),
+            [=](const BVHPrimitive &lhs, const BVHPrimitive &rhs)
+            {
+                if (lhs.centroid[best.axis] != rhs.centroid[best.axis])
+                    return lhs.centroid[best.axis] < rhs.centroid[best.axis];
+                return lhs.index < rhs.index;
+            });
+        left.assign(refs.begin(), refs.begin() + mid);
+        right.assign(refs.begin() + mid, refs.end());
+    }
+
+    n_refs += left.size() + right.size() - object_span;
+    // the parent's references are not needed any more
+    std::vector<BVHPrimitive>().swap(refs);
+
+    node->axis = best.axis;
+    node->children[0] = buildRecursive(left, depth + 1);
+    node->children[1] = buildRecursive(right, depth + 1);
+    node->update(options);
+    return node;
+}
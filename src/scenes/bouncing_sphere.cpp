@@ -5,21 +5,19 @@
 #include "../material.hpp"
 #include "../moving_sphere.hpp"
 #include "../texture.hpp"
-#include "../bvh.hpp"
+#include "../bvh_motion.hpp"
+#include "../bvh_report.hpp"
 
-Color rayColor(const Ray &r, const Hittable &world, int depth)
+Color rayColor(const Ray &r, const Hittable &world, int depth);
+
+// the color along r, given its first hit, or nullptr if it misses
+Color rayColor(const Ray &r, const HitRecord *rec, const Hittable &world, int depth)
 {
-    // If we've exceeded the ray bounce limit, no more light is gathered.
-    if (depth < 0)
-        return Color(0, 0, 0);
-    HitRecord rec;
-    // use 0.001 instead of 0.
-    //  This gets rid of the shadow acne problem.
-    if (world.hit(r, 0.001, INF, rec))
+    if (rec)
     {
         Ray scattered;
         Color attenuation;
-        if (rec.mat_ptr->scatter(r, rec, attenuation, scattered))
+        if (rec->mat_ptr->scatter(r, *rec, attenuation, scattered))
             return attenuation * rayColor(scattered, world, depth - 1);
         return Color(0, 0, 0);
     }
@@ -28,6 +26,18 @@ Color rayColor(const Ray &r, const Hittable &world, int depth)
     return (1.0 - t) * Color(1.0, 1.0, 1.0) + t * Color(0.5, 0.7, 1.0);
 }
 
+Color rayColor(const Ray &r, const Hittable &world, int depth)
+{
+    // If we've exceeded the ray bounce limit, no more light is gathered.
+    if (depth < 0)
+        return Color(0, 0, 0);
+    HitRecord rec;
+    // use 0.001 instead of 0.
+    //  This gets rid of the shadow acne problem.
+    bool hit = world.hit(r, 0.001, INF, rec);
+    return rayColor(r, hit ? &rec : nullptr, world, depth);
+}
+
 HittableList randomScene()
 {
     HittableList world;
@@ -80,7 +90,7 @@ HittableList randomScene()
     world.add(make_shared<Sphere>(Point3(4, 1, 0), 1.0, material3));
 
     HittableList objects;
-    objects.add(make_shared<BVHNode>(world, 0, 1));
+    objects.add(make_shared<MotionBVH4>(world, 0, 1));
 
     return objects;
 }
@@ -109,25 +119,15 @@ int main()
     Camera cam(lookfrom, lookat, vup, 20,
                aspect_ratio, aperture, dist_to_focus, 0, 1);
 
-    // Render
-    std::vector<std::vector<Color>> image(
-        image_height, std::vector<Color>(image_width));
+#ifdef BVH_STATS
+    return reportBVHStats("bouncing_sphere", world, cam, max_depth);
+#endif
 
-    int finished_cnt = 0;
-#pragma omp parallel for num_threads(6) schedule(dynamic)
-    for (int j = image_height - 1; j >= 0; --j)
-    {
-        for (int i = 0; i < image_width; ++i)
-            for (int s = 0; s < samples_per_pixel; ++s)
-            {
-                auto u = (i + randomReal()) / (image_width - 1);
-                auto v = (j + randomReal()) / (image_height - 1);
-                Ray r = cam.getRay(u, v);
-                image[j][i] += rayColor(r, world, max_depth);
-            }
-#pragma omp critical
-        std::cerr << "\rFinished lines: " << ++finished_cnt << std::flush;
-    }
+    // Render
+    auto image = cam.render(
+        world, image_width, image_height, samples_per_pixel,
+        [&](const Ray &r, const HitRecord *rec)
+        { return rayColor(r, rec, world, max_depth); });
 
     std::cout << "P3\n"
               << image_width << ' ' << image_height << "\n255\n";
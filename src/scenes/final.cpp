@@ -8,7 +8,28 @@
 #include "../aarect.hpp"
 #include "../box.hpp"
 #include "../constant_medium.hpp"
-#include "../bvh.hpp"
+#include "../accelerators.hpp"
+#include "../instance.hpp"
+#include "../sphere_set.hpp"
+#include "../bvh_report.hpp"
+
+Color rayColor(const Ray &r, const Color &background, const Hittable &world, int depth);
+
+// the color along r, given its first hit, or nullptr if it misses
+Color rayColor(const Ray &r, const HitRecord *rec, const Color &background,
+               const Hittable &world, int depth)
+{
+    if (!rec)
+        return background;
+
+    Ray scattered;
+    Color attenuation;
+    Color color = rec->mat_ptr->emitted(rec->u, rec->v, rec->p); // emitted
+
+    if (rec->mat_ptr->scatter(r, *rec, attenuation, scattered))
+        color += attenuation * rayColor(scattered, background, world, depth - 1);
+    return color;
+}
 
 Color rayColor(const Ray &r, const Color &background, const Hittable &world, int depth)
 {
@@ -19,16 +40,8 @@ Color rayColor(const Ray &r, const Color &background, const Hittable &world, int
     HitRecord rec;
     // use 0.001 instead of 0.
     //  This gets rid of the shadow acne problem.
-    if (!world.hit(r, 0.001, INF, rec))
-        return background;
-
-    Ray scattered;
-    Color attenuation;
-    Color color = rec.mat_ptr->emitted(rec.u, rec.v, rec.p); // emitted
-
-    if (rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-        color += attenuation * rayColor(scattered, background, world, depth - 1);
-    return color;
+    bool hit = world.hit(r, 0.001, INF, rec);
+    return rayColor(r, hit ? &rec : nullptr, background, world, depth);
 }
 
 HittableList finalScene()
@@ -56,7 +69,7 @@ HittableList finalScene()
 
     HittableList objects;
 
-    objects.add(make_shared<BVHNode>(boxes1, 0, 1));
+    objects.add(makeAccelerator(boxes1, 0, 1));
 
     auto light = make_shared<DiffuseLight>(Color(7, 7, 7));
     objects.add(make_shared<XZRect>(123, 423, 147, 412, 554, light));
@@ -86,19 +99,20 @@ HittableList finalScene()
     auto pertext = make_shared<NoiseTexture>(0.1);
     objects.add(make_shared<Sphere>(Point3(220, 280, 300), 80, make_shared<Lambertian>(pertext)));
 
-    HittableList boxes2;
+    SphereSetData boxes2;
     auto white = make_shared<Lambertian>(make_shared<SolidColor>(.73, .73, .73));
     int ns = 1000;
     for (int j = 0; j < ns; j++)
-        boxes2.add(make_shared<Sphere>(
-            Point3::random(0, 165), 10, white));
+        boxes2.add(Point3::random(0, 165), 10, white);
+
+    // the cluster is built once and only referenced by its instance
+    auto cluster = make_shared<SphereSet>(boxes2);
+    objects.add(make_shared<Instance>(cluster, 15, Vec3(-100, 270, 395)));
 
-    objects.add(make_shared<Translate>(
-        make_shared<RotateY>(
-            make_shared<BVHNode>(boxes2, 0.0, 1.0), 15),
-        Vec3(-100, 270, 395)));
+    HittableList world;
+    world.add(makeAccelerator(objects, 0, 1));
 
-    return objects;
+    return world;
 }
 
 int main()
@@ -127,25 +141,18 @@ int main()
     Camera cam(lookfrom, lookat, vup, vfov,
                aspect_ratio, aperture, dist_to_focus, 0, 1);
 
-    // Render
-    std::vector<std::vector<Color>> image(
-        image_height, std::vector<Color>(image_width));
+#ifdef BVH_STATS
+    return reportBVHStats("final", world, cam, max_depth);
+#endif
+#ifdef ACCEL_BENCH
+    return reportAcceleratorBench("final", world, cam, max_depth);
+#endif
 
-    int finished_cnt = 0;
-#pragma omp parallel for num_threads(6) schedule(dynamic)
-    for (int j = image_height - 1; j >= 0; --j)
-    {
-        for (int i = 0; i < image_width; ++i)
-            for (int s = 0; s < samples_per_pixel; ++s)
-            {
-                auto u = (i + randomReal()) / (image_width - 1);
-                auto v = (j + randomReal()) / (image_height - 1);
-                Ray r = cam.getRay(u, v);
-                image[j][i] += rayColor(r, background, world, max_depth);
-            }
-#pragma omp critical
-        std::cerr << "\rFinished lines: " << ++finished_cnt << std::flush;
-    }
+    // Render
+    auto image = cam.render(
+        world, image_width, image_height, samples_per_pixel,
+        [&](const Ray &r, const HitRecord *rec)
+        { return rayColor(r, rec, background, world, max_depth); });
 
     std::cout << "P3\n"
               << image_width << ' ' << image_height << "\n255\n";
@@ -0,0 +1,21 @@
+// Converts a .obj or .ply mesh to the .rtmesh format of ../mesh_io.hpp,
+//  which scenes then map instead of parsing it and building its BVH:
+//      ./mesh_convert bunny.ply bunny.rtmesh
+
+#include "../raytracer.h"
+#include "../mesh_io.hpp"
+
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        std::cerr << "usage: " << argv[0] << " <input.obj|input.ply> <output.rtmesh>\n";
+        return 1;
+    }
+    auto mesh = loadMesh(argv[1], nullptr);
+    if (!mesh || !saveMeshFile(argv[2], *mesh))
+        return 1;
+    std::cerr << mesh->vertexCount() << " vertices, "
+              << mesh->triangleCount() << " triangles\n";
+    return 0;
+}
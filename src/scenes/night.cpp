@@ -8,8 +8,27 @@
 #include "../aarect.hpp"
 #include "../box.hpp"
 #include "../constant_medium.hpp"
-#include "../bvh.hpp"
+#include "../accelerators.hpp"
 #include "../heart.hpp"
+#include "../bvh_report.hpp"
+
+Color rayColor(const Ray &r, const Color &background, const Hittable &world, int depth);
+
+// the color along r, given its first hit, or nullptr if it misses
+Color rayColor(const Ray &r, const HitRecord *rec, const Color &background,
+               const Hittable &world, int depth)
+{
+    if (!rec)
+        return background;
+
+    Ray scattered;
+    Color attenuation;
+    Color color = rec->mat_ptr->emitted(rec->u, rec->v, rec->p); // emitted
+
+    if (rec->mat_ptr->scatter(r, *rec, attenuation, scattered))
+        color += attenuation * rayColor(scattered, background, world, depth - 1);
+    return color;
+}
 
 Color rayColor(const Ray &r, const Color &background, const Hittable &world, int depth)
 {
@@ -20,16 +39,8 @@ Color rayColor(const Ray &r, const Color &background, const Hittable &world, int
     HitRecord rec;
     // use 0.001 instead of 0.
     //  This gets rid of the shadow acne problem.
-    if (!world.hit(r, 0.001, INF, rec))
-        return background;
-
-    Ray scattered;
-    Color attenuation;
-    Color color = rec.mat_ptr->emitted(rec.u, rec.v, rec.p); // emitted
-
-    if (rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-        color += attenuation * rayColor(scattered, background, world, depth - 1);
-    return color;
+    bool hit = world.hit(r, 0.001, INF, rec);
+    return rayColor(r, hit ? &rec : nullptr, background, world, depth);
 }
 
 HittableList randomScene()
@@ -94,7 +105,7 @@ HittableList randomScene()
     objects.add(heart);
 
     HittableList world;
-    world.add(make_shared<BVHNode>(objects, 0, 1));
+    world.add(makeAccelerator(objects, 0, 1));
 
     return world;
 }
@@ -124,25 +135,18 @@ int main()
     Camera cam(lookfrom, lookat, vup, 20,
                aspect_ratio, aperture, dist_to_focus);
 
-    // Render
-    std::vector<std::vector<Color>> image(
-        image_height, std::vector<Color>(image_width));
+#ifdef BVH_STATS
+    return reportBVHStats("night", world, cam, max_depth);
+#endif
+#ifdef ACCEL_BENCH
+    return reportAcceleratorBench("night", world, cam, max_depth);
+#endif
 
-    int finished_cnt = 0;
-#pragma omp parallel for num_threads(6) schedule(dynamic)
-    for (int j = image_height - 1; j >= 0; --j)
-    {
-        for (int i = 0; i < image_width; ++i)
-            for (int s = 0; s < samples_per_pixel; ++s)
-            {
-                auto u = (i + randomReal()) / (image_width - 1);
-                auto v = (j + randomReal()) / (image_height - 1);
-                Ray r = cam.getRay(u, v);
-                image[j][i] += rayColor(r, background, world, max_depth);
-            }
-#pragma omp critical
-        std::cerr << "\rFinished lines: " << ++finished_cnt << std::flush;
-    }
+    // Render
+    auto image = cam.render(
+        world, image_width, image_height, samples_per_pixel,
+        [&](const Ray &r, const HitRecord *rec)
+        { return rayColor(r, rec, background, world, max_depth); });
 
     std::cout << "P3\n"
               << image_width << ' ' << image_height << "\n255\n";
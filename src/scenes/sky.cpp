@@ -4,18 +4,15 @@
 #include "../camera.hpp"
 #include "../material.hpp"
 #include "../texture.hpp"
-#include "../bvh.hpp"
+#include "../accelerators.hpp"
+#include "../bvh_report.hpp"
 
-Color rayColor(const Ray &r, const Hittable &world, int depth)
-{
+Color rayColor(const Ray &r, const Hittable &world, int depth);
 
-    // If we've exceeded the ray bounce limit, no more light is gathered.
-    if (depth < 0)
-        return Color(0, 0, 0);
-    HitRecord rec;
-    // use 0.001 instead of 0.
-    //  This gets rid of the shadow acne problem.
-    if (!world.hit(r, 0.001, INF, rec))
+// the color along r, given its first hit, or nullptr if it misses
+Color rayColor(const Ray &r, const HitRecord *rec, const Hittable &world, int depth)
+{
+    if (!rec)
     {
         Vec3 unit_direction = unitVector(r.direction());
         auto t = 0.5 * (unit_direction.y() + 1.0);
@@ -24,13 +21,26 @@ Color rayColor(const Ray &r, const Hittable &world, int depth)
 
     Ray scattered;
     Color attenuation;
-    Color color = rec.mat_ptr->emitted(rec.u, rec.v, rec.p); // emitted
+    Color color = rec->mat_ptr->emitted(rec->u, rec->v, rec->p); // emitted
 
-    if (rec.mat_ptr->scatter(r, rec, attenuation, scattered))
+    if (rec->mat_ptr->scatter(r, *rec, attenuation, scattered))
         color += attenuation * rayColor(scattered, world, depth - 1);
     return color;
 }
 
+Color rayColor(const Ray &r, const Hittable &world, int depth)
+{
+
+    // If we've exceeded the ray bounce limit, no more light is gathered.
+    if (depth < 0)
+        return Color(0, 0, 0);
+    HitRecord rec;
+    // use 0.001 instead of 0.
+    //  This gets rid of the shadow acne problem.
+    bool hit = world.hit(r, 0.001, INF, rec);
+    return rayColor(r, hit ? &rec : nullptr, world, depth);
+}
+
 HittableList randomScene()
 {
     HittableList objects;
@@ -70,7 +80,7 @@ HittableList randomScene()
             }
 
     HittableList world;
-    world.add(make_shared<BVHNode>(objects, 0, 1));
+    world.add(makeAccelerator(objects, 0, 1));
 
     return world;
 }
@@ -99,25 +109,18 @@ int main()
     Camera cam(lookfrom, lookat, vup, 20,
                aspect_ratio, aperture, dist_to_focus);
 
-    // Render
-    std::vector<std::vector<Color>> image(
-        image_height, std::vector<Color>(image_width));
+#ifdef BVH_STATS
+    return reportBVHStats("sky", world, cam, max_depth);
+#endif
+#ifdef ACCEL_BENCH
+    return reportAcceleratorBench("sky", world, cam, max_depth);
+#endif
 
-    int finished_cnt = 0;
-#pragma omp parallel for num_threads(6) schedule(dynamic)
-    for (int j = image_height - 1; j >= 0; --j)
-    {
-        for (int i = 0; i < image_width; ++i)
-            for (int s = 0; s < samples_per_pixel; ++s)
-            {
-                auto u = (i + randomReal()) / (image_width - 1);
-                auto v = (j + randomReal()) / (image_height - 1);
-                Ray r = cam.getRay(u, v);
-                image[j][i] += rayColor(r, world, max_depth);
-            }
-#pragma omp critical
-        std::cerr << "\rFinished lines: " << ++finished_cnt << std::flush;
-    }
+    // Render
+    auto image = cam.render(
+        world, image_width, image_height, samples_per_pixel,
+        [&](const Ray &r, const HitRecord *rec)
+        { return rayColor(r, rec, world, max_depth); });
 
     std::cout << "P3\n"
               << image_width << ' ' << image_height << "\n255\n";
@@ -4,36 +4,30 @@
 #include "vec3.hpp"
 #include "aabb.hpp"
 
-class Sphere : public Hittable
+// u:phi v:theta of a point p on the unit sphere
+inline void getSphereUV(const Vec3 &p, double &u, double &v)
+{
+    // z = cos(phi)
+    // x = sin(phi) * cos(theta)
+    // y = sin(phi) * sin(theta)
+    // u = phi / (2 * pi)
+    // v = theta / pi
+    // the coordinates here is different from origin
+    auto theta = atan2(p.x(), p.z());
+    auto phi = acos(p.y());
+    u = (theta + PI) / (2 * PI);
+    v = phi / PI;
+}
+
+class Sphere final : public Hittable
 {
 private:
     Point3 center;
     double radius;
     shared_ptr<Material> mat_ptr;
 
-    // u:phi v:theta
-    void getSphereUV(const Vec3 &p, double &u, double &v) const
-    {
-        // z = cos(phi)
-        // x = sin(phi) * cos(theta)
-        // y = sin(phi) * sin(theta)
-        // u = phi / (2 * pi)
-        // v = theta / pi
-        // the coordinates here is different from origin
-        auto theta = atan2(p.x(), p.z());
-        auto phi = acos(p.y());
-        u = (theta + PI) / (2 * PI);
-        v = phi / PI;
-    }
-
-public:
-    Sphere() {}
-    Sphere(Point3 c, double r,
-           shared_ptr<Material> mat_ptr)
-        : center(c), radius(r), mat_ptr(mat_ptr) {}
-
-    bool hit(const Ray &r, double t_min,
-             double t_max, HitRecord &rec) const override
+    // Find the nearest root that lies in the acceptable range.
+    bool nearestRoot(const Ray &r, double t_min, double t_max, double &root) const
     {
         Vec3 oc = r.origin() - center;
         auto a = r.direction().lengthSquared();
@@ -45,14 +39,28 @@ public:
             return false;
         auto sqrtd = sqrt(discriminant);
 
-        // Find the nearest root that lies in the acceptable range.
-        auto root = (-half_b - sqrtd) / a;
+        root = (-half_b - sqrtd) / a;
         if (root < t_min || t_max < root)
         {
             root = (-half_b + sqrtd) / a;
             if (root < t_min || t_max < root)
                 return false;
         }
+        return true;
+    }
+
+public:
+    Sphere() {}
+    Sphere(Point3 c, double r,
+           shared_ptr<Material> mat_ptr)
+        : center(c), radius(r), mat_ptr(mat_ptr) {}
+
+    bool hit(const Ray &r, double t_min,
+             double t_max, HitRecord &rec) const override
+    {
+        double root;
+        if (!nearestRoot(r, t_min, t_max, root))
+            return false;
 
         rec.t = root;
         rec.p = r.at(rec.t);
@@ -64,6 +72,12 @@ public:
         return true;
     }
 
+    bool occluded(const Ray &r, double t_min, double t_max) const override
+    {
+        double root;
+        return nearestRoot(r, t_min, t_max, root);
+    }
+
     bool boundingBox(double t0, double t1,
                      AABB &output_box) const override
     {
@@ -71,4 +85,40 @@ public:
                           center + Vec3(radius, radius, radius));
         return true;
     }
+
+    bool clippedBox(double t0, double t1, const AABB &clip,
+                    AABB &output_box) const override
+    {
+        // squared distances from the center to the nearest point
+        //  of `clip` along each axis, and to its farthest corner
+        Vec3 near2;
+        double far2 = 0;
+        for (int a = 0; a < 3; ++a)
+        {
+            auto lo = clip.min()[a] - center[a];
+            auto hi = clip.max()[a] - center[a];
+            auto d = lo > 0 ? lo : (hi < 0 ? hi : 0);
+            near2[a] = d * d;
+            far2 += fmax(lo * lo, hi * hi);
+        }
+        auto r2 = radius * radius;
+        auto sum2 = near2.x() + near2.y() + near2.z();
+        // the surface misses boxes outside or entirely inside the ball
+        if (sum2 > r2 || far2 < r2)
+            return false;
+
+        // along each axis, the slice of the sphere within the clip box
+        //  in the other two axes
+        Point3 min, max;
+        for (int a = 0; a < 3; ++a)
+        {
+            auto extent = sqrt(r2 - (sum2 - near2[a]));
+            min[a] = fmax(center[a] - extent, clip.min()[a]);
+            max[a] = fmin(center[a] + extent, clip.max()[a]);
+            if (min[a] > max[a])
+                return false;
+        }
+        output_box = AABB(min, max);
+        return true;
+    }
 };
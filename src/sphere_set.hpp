@@ -0,0 +1,328 @@
+// Sphere set: many static spheres as one Hittable, stored as one array
+//  per component with a material index each, instead of a Sphere and a
+//  shared_ptr<Material> apiece, under a BVH of its own.
+//
+// The spheres are kept in leaf order, so the spheres of a leaf sit next
+//  to each other in every array and are loaded straight into lanes:
+//  the discriminants are computed SPHERE_SET_LANES at a time, 2 with
+//  SSE2 and 4 with AVX, and only the spheres it does not rule out are
+//  solved, one by one, exactly as Sphere::hit() does, so a set hits
+//  where its spheres would.
+
+#pragma once
+
+#include <unordered_map>
+
+#include "raytracer.h"
+#include "hittable.h"
+#include "aabb.hpp"
+#include "sphere.hpp"
+#include "bvh_build.hpp"
+#include "bvh_wide.hpp"
+#include "bvh_stats.hpp"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#if defined(__AVX__)
+const int SPHERE_SET_LANES = 4;
+#elif defined(__SSE2__)
+const int SPHERE_SET_LANES = 2;
+#else
+const int SPHERE_SET_LANES = 1;
+#endif
+
+// leaves may hold this many spheres even when BVHBuildOptions asks for
+//  fewer, so the SIMD leaf test has lanes to fill; a larger
+//  max_leaf_size still gives larger leaves
+const int SPHERE_SET_LEAF_SIZE = 4;
+// children per node
+const int SPHERE_SET_WIDTH = 4;
+
+// spheres before they are built into a set, structure of arrays
+struct SphereSetData
+{
+    std::vector<double> x, y, z, radius;
+    std::vector<uint32_t> material; // into materials
+    std::vector<shared_ptr<Material>> materials;
+    std::unordered_map<const Material *, uint32_t> material_index;
+
+    size_t size() const { return x.size(); }
+
+    void add(const Point3 &center, double r, shared_ptr<Material> mat_ptr)
+    {
+        x.push_back(center.x());
+        y.push_back(center.y());
+        z.push_back(center.z());
+        radius.push_back(r);
+        auto found = material_index.find(mat_ptr.get());
+        if (found == material_index.end())
+        {
+            found = material_index.emplace(mat_ptr.get(), materials.size()).first;
+            materials.push_back(mat_ptr);
+        }
+        material.push_back(found->second);
+    }
+};
+
+class SphereSet final : public Hittable
+{
+private:
+    // in leaf order, followed by SPHERE_SET_LANES - 1 unused entries
+    //  for the lanes past the end of the last leaf
+    std::vector<double> x, y, z, radius;
+    std::vector<uint32_t> material;
+    std::vector<shared_ptr<Material>> materials;
+    AlignedVector<WideBVHNode<SPHERE_SET_WIDTH>> nodes;
+    AABB box;
+    size_t n_spheres = 0;
+
+    // Tests the spheres first to first + count; on a hit between
+    //  t_min and t_max, lowers t_max and sets the sphere.
+    bool hitLeaf(uint32_t first, uint32_t count, const Ray &r,
+                 double t_min, double &t_max, uint32_t &sphere) const;
+
+    // Through the BVH like traverseWideBVH(), calling leaf(first, count)
+    //  on each leaf hit until it returns true; leaf may lower t_max.
+    template <typename Leaf>
+    void traverse(const Ray &r, double t_min, double &t_max, Leaf leaf) const;
+
+public:
+    SphereSet(const SphereSetData &data,
+              const BVHBuildOptions &options = BVHBuildOptions());
+
+    size_t size() const { return n_spheres; }
+
+    bool hit(const Ray &r, double t_min,
+             double t_max, HitRecord &rec) const override;
+
+    bool occluded(const Ray &r, double t_min, double t_max) const override
+    {
+        bool occluded = false;
+        traverse(r, t_min, t_max,
+                 [&](uint32_t first, uint32_t count)
+                 {
+                     uint32_t sphere;
+                     return occluded = hitLeaf(first, count, r, t_min, t_max, sphere);
+                 });
+        return occluded;
+    }
+
+    bool boundingBox(double t0, double t1,
+                     AABB &output_box) const override
+    {
+        if (nodes.empty())
+            return false;
+        output_box = box;
+        return true;
+    }
+
+    size_t memoryUsage() const
+    {
+        return (x.capacity() + y.capacity() + z.capacity() + radius.capacity()) * sizeof(double) +
+               material.capacity() * sizeof(uint32_t) +
+               materials.capacity() * sizeof(shared_ptr<Material>) +
+               nodes.capacity() * sizeof(WideBVHNode<SPHERE_SET_WIDTH>);
+    }
+};
+
+SphereSet::SphereSet(const SphereSetData &data, const BVHBuildOptions &options)
+    : materials(data.materials)
+{
+    size_t n = data.size();
+    if (data.y.size() != n || data.z.size() != n || data.radius.size() != n ||
+        data.material.size() != n)
+    {
+        std::cerr << "[ERROR]: Sphere arrays of different lengths in SphereSet.\n";
+        return;
+    }
+
+    std::vector<BVHPrimitive> prims(n);
+#pragma omp parallel for if (n >= options.parallel_threshold)
+    for (size_t i = 0; i < n; ++i)
+    {
+        Vec3 extent(data.radius[i], data.radius[i], data.radius[i]);
+        Point3 center(data.x[i], data.y[i], data.z[i]);
+        AABB box(center - extent, center + extent);
+        prims[i] = {box, center, i};
+    }
+    if (prims.empty())
+        return;
+
+    auto leaf_options = options;
+    leaf_options.max_leaf_size = std::max(options.max_leaf_size, SPHERE_SET_LEAF_SIZE);
+    AlignedVector<BVHLinearNode> binary;
+    BVHBuilder(prims, leaf_options).build(binary);
+    box = binary[0].box;
+    nodes.emplace_back();
+    collapseBVH(binary, 0, nodes, 0);
+
+    n_spheres = n;
+    size_t padded = n + SPHERE_SET_LANES - 1;
+    x.assign(padded, 0);
+    y.assign(padded, 0);
+    z.assign(padded, 0);
+    radius.assign(padded, 0);
+    material.resize(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        size_t j = prims[i].index;
+        x[i] = data.x[j];
+        y[i] = data.y[j];
+        z[i] = data.z[j];
+        radius[i] = data.radius[j];
+        material[i] = data.material[j];
+    }
+}
+
+bool SphereSet::hitLeaf(uint32_t first, uint32_t count, const Ray &r,
+                        double t_min, double &t_max, uint32_t &sphere) const
+{
+    const auto &o = r.origin(), &d = r.direction();
+    double a = d.lengthSquared();
+    bool hit_anything = false;
+    for (uint32_t i = first; i < first + count; i += SPHERE_SET_LANES)
+    {
+        // lanes whose discriminant is not negative: only those can be
+        //  hit, and a ray reaching a leaf passes near few of its spheres
+        int mask;
+#if defined(__AVX__)
+        __m256d ocx = _mm256_sub_pd(_mm256_set1_pd(o.x()), _mm256_loadu_pd(&x[i]));
+        __m256d ocy = _mm256_sub_pd(_mm256_set1_pd(o.y()), _mm256_loadu_pd(&y[i]));
+        __m256d ocz = _mm256_sub_pd(_mm256_set1_pd(o.z()), _mm256_loadu_pd(&z[i]));
+        __m256d rad = _mm256_loadu_pd(&radius[i]);
+        __m256d half_b = _mm256_add_pd(
+            _mm256_add_pd(_mm256_mul_pd(ocx, _mm256_set1_pd(d.x())),
+                          _mm256_mul_pd(ocy, _mm256_set1_pd(d.y()))),
+            _mm256_mul_pd(ocz, _mm256_set1_pd(d.z())));
+        __m256d c = _mm256_sub_pd(
+            _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)),
+                          _mm256_mul_pd(ocz, ocz)),
+            _mm256_mul_pd(rad, rad));
+        __m256d discriminant = _mm256_sub_pd(_mm256_mul_pd(half_b, half_b),
+                                             _mm256_mul_pd(_mm256_set1_pd(a), c));
+        mask = _mm256_movemask_pd(_mm256_cmp_pd(discriminant, _mm256_setzero_pd(), _CMP_GE_OQ));
+#elif defined(__SSE2__)
+        __m128d ocx = _mm_sub_pd(_mm_set1_pd(o.x()), _mm_loadu_pd(&x[i]));
+        __m128d ocy = _mm_sub_pd(_mm_set1_pd(o.y()), _mm_loadu_pd(&y[i]));
+        __m128d ocz = _mm_sub_pd(_mm_set1_pd(o.z()), _mm_loadu_pd(&z[i]));
+        __m128d rad = _mm_loadu_pd(&radius[i]);
+        __m128d half_b = _mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, _mm_set1_pd(d.x())),
+                                               _mm_mul_pd(ocy, _mm_set1_pd(d.y()))),
+                                    _mm_mul_pd(ocz, _mm_set1_pd(d.z())));
+        __m128d c = _mm_sub_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, ocx), _mm_mul_pd(ocy, ocy)),
+                                          _mm_mul_pd(ocz, ocz)),
+                               _mm_mul_pd(rad, rad));
+        __m128d discriminant = _mm_sub_pd(_mm_mul_pd(half_b, half_b),
+                                          _mm_mul_pd(_mm_set1_pd(a), c));
+        mask = _mm_movemask_pd(_mm_cmpge_pd(discriminant, _mm_setzero_pd()));
+#else
+        mask = 1;
+#endif
+        // lanes past the end of the leaf are not spheres of it
+        uint32_t n = std::min<uint32_t>(SPHERE_SET_LANES, first + count - i);
+        mask &= (1 << n) - 1;
+        for (uint32_t k = 0; k < n; ++k)
+            BVH_STATS_COUNT(primitive_tests);
+        for (uint32_t k = 0; mask; ++k, mask >>= 1)
+        {
+            if (!(mask & 1))
+                continue;
+            // Sphere::nearestRoot()
+            Vec3 oc = o - Point3(x[i + k], y[i + k], z[i + k]);
+            auto half_b = dot(oc, d);
+            auto c = oc.lengthSquared() - radius[i + k] * radius[i + k];
+            auto discriminant = half_b * half_b - a * c;
+            if (discriminant < 0)
+                continue;
+            auto sqrtd = sqrt(discriminant);
+            auto root = (-half_b - sqrtd) / a;
+            if (root < t_min || t_max < root)
+            {
+                root = (-half_b + sqrtd) / a;
+                if (root < t_min || t_max < root)
+                    continue;
+            }
+            hit_anything = true;
+            t_max = root;
+            sphere = i + k;
+        }
+    }
+    return hit_anything;
+}
+
+template <typename Leaf>
+void SphereSet::traverse(const Ray &r, double t_min, double &t_max, Leaf leaf) const
+{
+    if (nodes.empty())
+        return;
+
+    // nearest first, as traverseWideBVH() does
+    auto ray = wideBVHRay(r, 0);
+    float t_lo = static_cast<float>(t_min) *
+                 (t_min > 0 ? 1 / WIDE_BVH_WIDEN : WIDE_BVH_WIDEN);
+    float t_hi = static_cast<float>(t_max) * WIDE_BVH_WIDEN;
+
+    WideBVHStackEntry stack[BVH_STACK_SIZE * SPHERE_SET_WIDTH];
+    int top = 0;
+    stack[top++] = {0, 0, t_lo};
+    while (top > 0)
+    {
+        const auto entry = stack[--top];
+        if (entry.t_near > t_max)
+            continue;
+
+        if (entry.count > 0)
+        {
+            if (leaf(entry.child, entry.count))
+                return;
+            t_hi = static_cast<float>(t_max) * WIDE_BVH_WIDEN;
+            continue;
+        }
+
+        const auto &node = nodes[entry.child];
+        BVH_STATS_COUNT(node_tests);
+        alignas(32) float t_near[SPHERE_SET_WIDTH];
+        int mask = intersectChildren(node, ray, t_lo, t_hi, t_near);
+
+        // push the hit children far to near, so the nearest pops first
+        int first = top;
+        for (int k = 0; k < SPHERE_SET_WIDTH; ++k)
+        {
+            if (!(mask >> k & 1))
+                continue;
+            WideBVHStackEntry child = {node.child[k], node.count[k], t_near[k]};
+            int j = top++;
+            for (; j > first && stack[j - 1].t_near < child.t_near; --j)
+                stack[j] = stack[j - 1];
+            stack[j] = child;
+        }
+    }
+}
+
+bool SphereSet::hit(const Ray &r, double t_min,
+                    double t_max, HitRecord &rec) const
+{
+    uint32_t sphere;
+    bool hit_anything = false;
+    traverse(r, t_min, t_max,
+             [&](uint32_t first, uint32_t count)
+             {
+                 if (hitLeaf(first, count, r, t_min, t_max, sphere))
+                     hit_anything = true;
+                 return false;
+             });
+    if (!hit_anything)
+        return false;
+
+    // as in Sphere::hit()
+    Point3 center(x[sphere], y[sphere], z[sphere]);
+    rec.t = t_max;
+    rec.p = r.at(rec.t);
+    Vec3 outward_normal = (rec.p - center) / radius[sphere];
+    rec.setFaceNormal(r, outward_normal);
+    getSphereUV(outward_normal, rec.u, rec.v);
+    rec.mat_ptr = materials[material[sphere]];
+    return true;
+}
@@ -0,0 +1,87 @@
+// Moves primitives around a BVH by remove() and insert(), as an animated
+//  scene would every frame: the packed leaf copies must not pile up,
+//  and every ray must still find the nearest hit.
+
+#include "../raytracer.h"
+#include "../hittable_list.hpp"
+#include "../sphere.hpp"
+#include "../aarect.hpp"
+#include "../box.hpp"
+#include "../material.hpp"
+#include "../bvh.hpp"
+
+shared_ptr<Hittable> randomObject(shared_ptr<Material> mat)
+{
+    Point3 p(randomReal(-50, 50), randomReal(-50, 50), randomReal(-50, 50));
+    switch (randomInt(0, 2))
+    {
+    case 0:
+        return make_shared<Sphere>(p, randomReal(0.1, 1), mat);
+    case 1:
+        return make_shared<XZRect>(p.x(), p.x() + 1, p.z(), p.z() + 1, p.y(), mat);
+    default:
+        return make_shared<Box>(p, p + Vec3(1, 1, 1), mat);
+    }
+}
+
+int main()
+{
+    auto mat = make_shared<Lambertian>(Color(0.5, 0.5, 0.5));
+    HittableList list;
+    std::vector<shared_ptr<Hittable>> objects;
+    for (int i = 0; i < 2000; ++i)
+    {
+        objects.push_back(randomObject(mat));
+        list.add(objects.back());
+    }
+    BVHNode bvh(list, 0, 1);
+    size_t initial = bvh.memoryUsage(), peak = initial;
+
+    for (int frame = 0; frame < 50; ++frame)
+    {
+        for (auto &object : objects)
+        {
+            if (!bvh.remove(object))
+            {
+                std::cerr << "[ERROR]: remove() missed an object.\n";
+                return 1;
+            }
+            object = randomObject(mat);
+            bvh.insert(object);
+        }
+        peak = std::max(peak, bvh.memoryUsage());
+    }
+    // edits leave free slots and node pairs behind, but no more than
+    //  one tree's worth of them
+    if (peak > 3 * initial)
+    {
+        std::cerr << "[ERROR]: memoryUsage() grew from " << initial
+                  << " to " << peak << " bytes.\n";
+        return 1;
+    }
+
+    for (int i = 0; i < 10000; ++i)
+    {
+        Ray r(Point3(randomReal(-60, 60), randomReal(-60, 60), randomReal(-60, 60)),
+              randomUnitVector(), 0);
+        HitRecord expected, found;
+        bool any = false;
+        double t_max = INF;
+        for (const auto &object : objects)
+            if (object->hit(r, 0.001, t_max, expected))
+            {
+                any = true;
+                t_max = expected.t;
+            }
+        if (bvh.hit(r, 0.001, INF, found) != any || (any && found.t != expected.t) ||
+            bvh.occluded(r, 0.001, INF) != any)
+        {
+            std::cerr << "[ERROR]: Edited BVH disagrees with a linear scan.\n";
+            return 1;
+        }
+    }
+
+    std::cout << "bvh_edits: " << initial << " bytes before, "
+              << peak << " at most after 100000 edits\n";
+    return 0;
+}
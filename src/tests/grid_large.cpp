@@ -0,0 +1,54 @@
+// Primitives whose centroids coincide, here concentric spheres, must
+//  not all be kept out of the grid's cells, which would turn every ray
+//  into a linear scan; rays must still find the nearest hit.
+
+#include "../raytracer.h"
+#include "../hittable_list.hpp"
+#include "../sphere.hpp"
+#include "../material.hpp"
+#include "../grid.hpp"
+
+int main()
+{
+    auto mat = make_shared<Lambertian>(Color(0.5, 0.5, 0.5));
+    HittableList list;
+    std::vector<shared_ptr<Hittable>> objects;
+    for (int i = 0; i < 1000; ++i)
+    {
+        objects.push_back(make_shared<Sphere>(Point3(0, 0, 0), randomReal(0.1, 10), mat));
+        list.add(objects.back());
+    }
+    UniformGrid grid(list, 0, 1);
+    if (grid.largeCount() > objects.size() / GRID_LARGE_SHARE)
+    {
+        std::cerr << "[ERROR]: " << grid.largeCount() << " of " << objects.size()
+                  << " primitives are tested against every ray.\n";
+        return 1;
+    }
+
+    for (int i = 0; i < 10000; ++i)
+    {
+        // from outside and from between the shells
+        double distance = i % 2 ? 20 : randomReal(0, 10);
+        Ray r(Point3(0, 0, 0) + distance * randomUnitVector(), randomUnitVector(), 0);
+        HitRecord expected, found;
+        bool any = false;
+        double t_max = INF;
+        for (const auto &object : objects)
+            if (object->hit(r, 0.001, t_max, expected))
+            {
+                any = true;
+                t_max = expected.t;
+            }
+        if (grid.hit(r, 0.001, INF, found) != any || (any && found.t != expected.t) ||
+            grid.occluded(r, 0.001, INF) != any)
+        {
+            std::cerr << "[ERROR]: Grid disagrees with a linear scan.\n";
+            return 1;
+        }
+    }
+
+    std::cout << "grid_large: " << grid.largeCount() << " of " << objects.size()
+              << " primitives outside the cells\n";
+    return 0;
+}
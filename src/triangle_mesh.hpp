@@ -0,0 +1,506 @@
+// Indexed triangle mesh: shared vertices, stored as one array per
+//  component, and a BVH of its own over the triangles, so that to the
+//  rest of the scene a whole mesh is a single Hittable.
+//
+// Rays are tested with the watertight algorithm of Woop, Benthin and
+//  Wald ("Watertight Ray/Triangle Intersection", JCGT 2013): the ray
+//  is turned into +z from the origin and each edge becomes a 2D sign
+//  test, so two triangles sharing an edge compute the same values
+//  with opposite signs and no ray slips through between them.
+// The corners of a leaf's triangles are gathered into lanes and tested
+//  two at a time with SSE2, with the closest hit picked afterwards.
+
+#pragma once
+
+#include "raytracer.h"
+#include "hittable.h"
+#include "aabb.hpp"
+#include "bvh_build.hpp"
+#include "lbvh.hpp"
+#include "bvh_stats.hpp"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// an indexed triangle mesh before it is built, structure of arrays
+struct TriangleMeshData
+{
+    std::vector<double> x, y, z;    // vertex positions
+    std::vector<double> nx, ny, nz; // vertex normals, or empty
+    std::vector<double> u, v;       // texture coordinates, v up, or empty
+
+    // three vertices per triangle, counter-clockwise seen from the front
+    std::vector<uint32_t> indices;
+
+    size_t vertexCount() const { return x.size(); }
+    size_t triangleCount() const { return indices.size() / 3; }
+
+    void addVertex(const Point3 &p)
+    {
+        x.push_back(p.x());
+        y.push_back(p.y());
+        z.push_back(p.z());
+    }
+
+    void addTriangle(uint32_t a, uint32_t b, uint32_t c)
+    {
+        indices.push_back(a);
+        indices.push_back(b);
+        indices.push_back(c);
+    }
+};
+
+// triangles tested together in a leaf, a multiple of the SIMD width
+const int MESH_LEAF_BATCH = 8;
+
+// the ray sheared so that it runs along +z from the origin
+struct ShearedRay
+{
+    int kx, ky, kz;
+    double sx, sy, sz;
+};
+
+inline ShearedRay shearRay(const Ray &r)
+{
+    // z is the axis along which the ray moves fastest, and x and y
+    //  are swapped for a ray going down it to keep the winding
+    const auto &d = r.direction();
+    ShearedRay s;
+    s.kz = std::fabs(d.x()) > std::fabs(d.y())
+               ? (std::fabs(d.x()) > std::fabs(d.z()) ? 0 : 2)
+               : (std::fabs(d.y()) > std::fabs(d.z()) ? 1 : 2);
+    s.kx = (s.kz + 1) % 3;
+    s.ky = (s.kx + 1) % 3;
+    if (d[s.kz] < 0)
+        std::swap(s.kx, s.ky);
+    s.sx = d[s.kx] / d[s.kz];
+    s.sy = d[s.ky] / d[s.kz];
+    s.sz = 1 / d[s.kz];
+    return s;
+}
+
+// corners of a batch of triangles relative to the ray origin, one lane
+//  per triangle, in the sheared ray's axis order
+struct alignas(16) TriangleBatch
+{
+    double x[3][MESH_LEAF_BATCH];
+    double y[3][MESH_LEAF_BATCH];
+    double z[3][MESH_LEAF_BATCH];
+};
+
+// Returns the mask of the first n triangles of the batch that the ray
+//  hits between t_min and t_max, and writes each one's distance to t
+//  and the barycentric weights of its corners to weights.
+// Lanes from n up to the next even lane must hold zeros.
+inline int intersectTriangles(const TriangleBatch &batch, int n, const ShearedRay &s,
+                              double t_min, double t_max,
+                              double *t, double weights[3][MESH_LEAF_BATCH])
+{
+    int mask = 0;
+#if defined(__SSE2__)
+    __m128d sx = _mm_set1_pd(s.sx), sy = _mm_set1_pd(s.sy), sz = _mm_set1_pd(s.sz);
+    __m128d lo = _mm_set1_pd(t_min), hi = _mm_set1_pd(t_max);
+    __m128d zero = _mm_setzero_pd();
+    for (int k = 0; k < n; k += 2)
+    {
+        __m128d az = _mm_load_pd(batch.z[0] + k);
+        __m128d bz = _mm_load_pd(batch.z[1] + k);
+        __m128d cz = _mm_load_pd(batch.z[2] + k);
+        __m128d ax = _mm_sub_pd(_mm_load_pd(batch.x[0] + k), _mm_mul_pd(sx, az));
+        __m128d ay = _mm_sub_pd(_mm_load_pd(batch.y[0] + k), _mm_mul_pd(sy, az));
+        __m128d bx = _mm_sub_pd(_mm_load_pd(batch.x[1] + k), _mm_mul_pd(sx, bz));
+        __m128d by = _mm_sub_pd(_mm_load_pd(batch.y[1] + k), _mm_mul_pd(sy, bz));
+        __m128d cx = _mm_sub_pd(_mm_load_pd(batch.x[2] + k), _mm_mul_pd(sx, cz));
+        __m128d cy = _mm_sub_pd(_mm_load_pd(batch.y[2] + k), _mm_mul_pd(sy, cz));
+
+        __m128d u = _mm_sub_pd(_mm_mul_pd(cx, by), _mm_mul_pd(cy, bx));
+        __m128d v = _mm_sub_pd(_mm_mul_pd(ax, cy), _mm_mul_pd(ay, cx));
+        __m128d w = _mm_sub_pd(_mm_mul_pd(bx, ay), _mm_mul_pd(by, ax));
+        __m128d det = _mm_add_pd(_mm_add_pd(u, v), w);
+        __m128d dist = _mm_div_pd(
+            _mm_mul_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(u, az), _mm_mul_pd(v, bz)),
+                                  _mm_mul_pd(w, cz)),
+                       sz),
+            det);
+
+        __m128d negative = _mm_or_pd(_mm_or_pd(_mm_cmplt_pd(u, zero), _mm_cmplt_pd(v, zero)),
+                                     _mm_cmplt_pd(w, zero));
+        __m128d positive = _mm_or_pd(_mm_or_pd(_mm_cmpgt_pd(u, zero), _mm_cmpgt_pd(v, zero)),
+                                     _mm_cmpgt_pd(w, zero));
+        __m128d valid = _mm_andnot_pd(_mm_and_pd(negative, positive),
+                                      _mm_and_pd(_mm_cmpneq_pd(det, zero),
+                                                 _mm_and_pd(_mm_cmpge_pd(dist, lo),
+                                                            _mm_cmple_pd(dist, hi))));
+        mask |= _mm_movemask_pd(valid) << k;
+        _mm_storeu_pd(t + k, dist);
+        _mm_storeu_pd(weights[0] + k, _mm_div_pd(u, det));
+        _mm_storeu_pd(weights[1] + k, _mm_div_pd(v, det));
+        _mm_storeu_pd(weights[2] + k, _mm_div_pd(w, det));
+    }
+    return mask & ((1 << n) - 1);
+#else
+    for (int k = 0; k < n; ++k)
+    {
+        double az = batch.z[0][k], bz = batch.z[1][k], cz = batch.z[2][k];
+        double ax = batch.x[0][k] - s.sx * az, ay = batch.y[0][k] - s.sy * az;
+        double bx = batch.x[1][k] - s.sx * bz, by = batch.y[1][k] - s.sy * bz;
+        double cx = batch.x[2][k] - s.sx * cz, cy = batch.y[2][k] - s.sy * cz;
+
+        // twice the signed areas seen from the ray, opposite each corner
+        double u = cx * by - cy * bx;
+        double v = ax * cy - ay * cx;
+        double w = bx * ay - by * ax;
+        double det = u + v + w;
+        double dist = (u * az + v * bz + w * cz) * s.sz / det;
+
+        bool negative = u < 0 || v < 0 || w < 0;
+        bool positive = u > 0 || v > 0 || w > 0;
+        if (!(negative && positive) && det != 0 && dist >= t_min && dist <= t_max)
+            mask |= 1 << k;
+        t[k] = dist;
+        weights[0][k] = u / det;
+        weights[1][k] = v / det;
+        weights[2][k] = w / det;
+    }
+    return mask;
+#endif
+}
+
+// The arrays a mesh is made of, wherever they are stored: the vertices,
+//  and the BVH with the corners of every triangle in its leaf order.
+struct TriangleMeshArrays
+{
+    size_t n_vertices = 0, n_triangles = 0, n_nodes = 0;
+    const double *x = nullptr, *y = nullptr, *z = nullptr;
+    const double *nx = nullptr, *ny = nullptr, *nz = nullptr; // or null
+    const double *u = nullptr, *v = nullptr;                  // or null
+    const uint32_t *corner[3] = {nullptr, nullptr, nullptr};
+    const BVHLinearNode *nodes = nullptr;
+};
+
+// the arrays of a mesh built in memory
+struct TriangleMeshBuffers
+{
+    TriangleMeshData vertices;
+    std::vector<uint32_t> corner[3];
+    AlignedVector<BVHLinearNode> nodes;
+};
+
+class TriangleMesh final : public Hittable
+{
+private:
+    TriangleMeshArrays arrays;
+    // keeps the arrays alive: TriangleMeshBuffers, or a mapped file
+    shared_ptr<const void> storage;
+    shared_ptr<Material> mat_ptr;
+
+    // Tests the triangles first to first + count; on a hit between
+    //  t_min and t_max, lowers t_max and sets the triangle and the
+    //  barycentric weights of its three vertices.
+    bool hitLeaf(uint32_t first, uint32_t count, const Ray &r, const ShearedRay &s,
+                 double t_min, double &t_max, uint32_t &triangle, double weights[3]) const;
+
+    Point3 vertex(uint32_t i) const
+    {
+        return Point3(arrays.x[i], arrays.y[i], arrays.z[i]);
+    }
+
+    // Depth-first through the BVH like BVHNode::hit(), calling
+    //  leaf(first, count) on each leaf hit until it returns true;
+    //  leaf may lower t_max.
+    template <typename Leaf>
+    void traverse(const Ray &r, double t_min, double &t_max, Leaf leaf) const;
+
+public:
+    // builds the BVH, and keeps the arrays of `data`
+    TriangleMesh(TriangleMeshData data, shared_ptr<Material> mat_ptr,
+                 const BVHBuildOptions &options = BVHBuildOptions());
+
+    // Uses the arrays as they are, without copying them, for as long
+    //  as the mesh and `storage` live (see mesh_io.hpp).
+    TriangleMesh(const TriangleMeshArrays &arrays, shared_ptr<const void> storage,
+                 shared_ptr<Material> mat_ptr)
+        : arrays(arrays), storage(storage), mat_ptr(mat_ptr) {}
+
+    const TriangleMeshArrays &meshArrays() const { return arrays; }
+    size_t vertexCount() const { return arrays.n_vertices; }
+    size_t triangleCount() const { return arrays.n_triangles; }
+
+    bool hit(const Ray &r, double t_min,
+             double t_max, HitRecord &rec) const override;
+
+    bool occluded(const Ray &r, double t_min, double t_max) const override
+    {
+        auto s = shearRay(r);
+        bool occluded = false;
+        traverse(r, t_min, t_max,
+                 [&](uint32_t first, uint32_t count)
+                 {
+                     uint32_t triangle;
+                     double weights[3];
+                     return occluded = hitLeaf(first, count, r, s, t_min, t_max,
+                                               triangle, weights);
+                 });
+        return occluded;
+    }
+
+    bool boundingBox(double t0, double t1,
+                     AABB &output_box) const override
+    {
+        if (arrays.n_nodes == 0)
+            return false;
+        output_box = arrays.nodes[0].box;
+        return true;
+    }
+
+    size_t memoryUsage() const
+    {
+        int n_attributes = 3 + (arrays.nx ? 3 : 0) + (arrays.u ? 2 : 0);
+        return arrays.n_vertices * n_attributes * sizeof(double) +
+               arrays.n_triangles * 3 * sizeof(uint32_t) +
+               arrays.n_nodes * sizeof(BVHLinearNode);
+    }
+};
+
+TriangleMesh::TriangleMesh(TriangleMeshData data, shared_ptr<Material> mat_ptr,
+                           const BVHBuildOptions &options)
+    : mat_ptr(mat_ptr)
+{
+    auto buffers = make_shared<TriangleMeshBuffers>();
+    storage = buffers;
+    auto &vertices = buffers->vertices;
+    size_t n_vertices = data.x.size();
+    if (data.y.size() != n_vertices || data.z.size() != n_vertices)
+    {
+        std::cerr << "[ERROR]: Vertex positions of different lengths in TriangleMesh.\n";
+        return;
+    }
+    vertices.x = std::move(data.x);
+    vertices.y = std::move(data.y);
+    vertices.z = std::move(data.z);
+    if (data.nx.size() == n_vertices && data.ny.size() == n_vertices &&
+        data.nz.size() == n_vertices)
+    {
+        vertices.nx = std::move(data.nx);
+        vertices.ny = std::move(data.ny);
+        vertices.nz = std::move(data.nz);
+    }
+    else if (!data.nx.empty())
+        std::cerr << "[ERROR]: Not one normal per vertex in TriangleMesh, ignored.\n";
+    if (data.u.size() == n_vertices && data.v.size() == n_vertices)
+    {
+        vertices.u = std::move(data.u);
+        vertices.v = std::move(data.v);
+    }
+    else if (!data.u.empty())
+        std::cerr << "[ERROR]: Not one texture coordinate per vertex in TriangleMesh, ignored.\n";
+
+    arrays.n_vertices = n_vertices;
+    arrays.x = vertices.x.data();
+    arrays.y = vertices.y.data();
+    arrays.z = vertices.z.data();
+    if (!vertices.nx.empty())
+    {
+        arrays.nx = vertices.nx.data();
+        arrays.ny = vertices.ny.data();
+        arrays.nz = vertices.nz.data();
+    }
+    if (!vertices.u.empty())
+    {
+        arrays.u = vertices.u.data();
+        arrays.v = vertices.v.data();
+    }
+
+    // triangles with a vertex out of range are left out
+    const auto &indices = data.indices;
+    size_t n_triangles = indices.size() / 3;
+    std::vector<BVHPrimitive> prims(n_triangles);
+    std::vector<char> in_range(n_triangles);
+#pragma omp parallel for if (n_triangles >= options.parallel_threshold)
+    for (size_t t = 0; t < n_triangles; ++t)
+    {
+        const uint32_t *index = &indices[3 * t];
+        in_range[t] = index[0] < n_vertices && index[1] < n_vertices &&
+                      index[2] < n_vertices;
+        if (!in_range[t])
+            continue;
+        AABB box(vertex(index[0]), vertex(index[0]));
+        box = surroundingBox(box, vertex(index[1]));
+        box = surroundingBox(box, vertex(index[2]));
+        // The slab test rejects a box the ray only touches, so pad the
+        //  boxes: flat ones like the rects, for triangles lying in an
+        //  axis plane, and all by a few ulps more than rounding, for
+        //  rays through a vertex or an edge on the side of a box.
+        Point3 lo = box.min(), hi = box.max();
+        for (int a = 0; a < 3; ++a)
+        {
+            double pad = 1e-9 * std::max(std::fabs(lo[a]), std::fabs(hi[a]));
+            if (hi[a] - lo[a] < 0.0001)
+                pad = std::max(pad, 0.0001);
+            lo[a] -= pad;
+            hi[a] += pad;
+        }
+        box = AABB(lo, hi);
+        prims[t] = {box, box.centroid(), t};
+    }
+    size_t n_kept = 0;
+    for (size_t t = 0; t < n_triangles; ++t)
+        if (in_range[t])
+            prims[n_kept++] = prims[t];
+    if (n_kept < n_triangles)
+        std::cerr << "[ERROR]: " << n_triangles - n_kept
+                  << " triangles with a vertex out of range in TriangleMesh.\n";
+    prims.resize(n_kept);
+    if (prims.empty())
+        return;
+
+    auto &nodes = buffers->nodes;
+    if (options.method == BVHBuildMethod::Morton)
+        LBVHBuilder(prims, options).build(nodes);
+    else
+        BVHBuilder(prims, options).build(nodes);
+
+    for (int k = 0; k < 3; ++k)
+    {
+        auto &corner = buffers->corner[k];
+        corner.resize(prims.size());
+#pragma omp parallel for if (prims.size() >= options.parallel_threshold)
+        for (size_t i = 0; i < prims.size(); ++i)
+            corner[i] = indices[3 * prims[i].index + k];
+        arrays.corner[k] = corner.data();
+    }
+    arrays.n_triangles = prims.size();
+    arrays.nodes = nodes.data();
+    arrays.n_nodes = nodes.size();
+}
+
+bool TriangleMesh::hitLeaf(uint32_t first, uint32_t count, const Ray &r,
+                           const ShearedRay &s, double t_min, double &t_max,
+                           uint32_t &triangle, double weights[3]) const
+{
+    const double *position[3] = {arrays.x, arrays.y, arrays.z};
+    const double *px = position[s.kx], *py = position[s.ky], *pz = position[s.kz];
+    double ox = r.origin()[s.kx], oy = r.origin()[s.ky], oz = r.origin()[s.kz];
+
+    bool hit_anything = false;
+    for (uint32_t start = first; start < first + count; start += MESH_LEAF_BATCH)
+    {
+        int n = std::min<uint32_t>(MESH_LEAF_BATCH, first + count - start);
+        TriangleBatch batch;
+        for (int j = 0; j < 3; ++j)
+        {
+            for (int k = 0; k < n; ++k)
+            {
+                uint32_t i = arrays.corner[j][start + k];
+                batch.x[j][k] = px[i] - ox;
+                batch.y[j][k] = py[i] - oy;
+                batch.z[j][k] = pz[i] - oz;
+            }
+            if (n % 2)
+                batch.x[j][n] = batch.y[j][n] = batch.z[j][n] = 0;
+        }
+
+        double t[MESH_LEAF_BATCH], e[3][MESH_LEAF_BATCH];
+        int mask = intersectTriangles(batch, n, s, t_min, t_max, t, e);
+        for (int k = 0; k < n; ++k)
+        {
+            BVH_STATS_COUNT(primitive_tests);
+            if ((mask >> k & 1) && t[k] <= t_max)
+            {
+                hit_anything = true;
+                t_max = t[k];
+                triangle = start + k;
+                for (int j = 0; j < 3; ++j)
+                    weights[j] = e[j][k];
+            }
+        }
+    }
+    return hit_anything;
+}
+
+template <typename Leaf>
+void TriangleMesh::traverse(const Ray &r, double t_min, double &t_max, Leaf leaf) const
+{
+    if (arrays.n_nodes == 0)
+        return;
+
+    Vec3 inv_d(1 / r.direction().x(),
+               1 / r.direction().y(),
+               1 / r.direction().z());
+    bool dir_neg[3] = {inv_d.x() < 0, inv_d.y() < 0, inv_d.z() < 0};
+
+    uint32_t stack[BVH_STACK_SIZE];
+    int top = 0;
+    uint32_t current = 0;
+    while (true)
+    {
+        const auto &node = arrays.nodes[current];
+        BVH_STATS_COUNT(node_tests);
+        if (node.box.hit(r, inv_d, t_min, t_max))
+        {
+            if (node.count == 0)
+            {
+                // the nearer child first
+                bool second_first = dir_neg[node.axis];
+                stack[top++] = node.offset + !second_first;
+                current = node.offset + second_first;
+                continue;
+            }
+            if (leaf(node.offset, node.count))
+                return;
+        }
+        if (top == 0)
+            return;
+        current = stack[--top];
+    }
+}
+
+bool TriangleMesh::hit(const Ray &r, double t_min,
+                       double t_max, HitRecord &rec) const
+{
+    auto s = shearRay(r);
+    uint32_t triangle;
+    double weights[3];
+    bool hit_anything = false;
+    traverse(r, t_min, t_max,
+             [&](uint32_t first, uint32_t count)
+             {
+                 if (hitLeaf(first, count, r, s, t_min, t_max, triangle, weights))
+                     hit_anything = true;
+                 return false;
+             });
+    if (!hit_anything)
+        return false;
+
+    const auto &corner = arrays.corner;
+    uint32_t a = corner[0][triangle], b = corner[1][triangle], c = corner[2][triangle];
+    auto p0 = vertex(a), p1 = vertex(b), p2 = vertex(c);
+    rec.t = t_max;
+    rec.p = weights[0] * p0 + weights[1] * p1 + weights[2] * p2;
+    rec.setFaceNormal(r, unitVector(cross(p1 - p0, p2 - p0)));
+    if (arrays.nx)
+    {
+        // shading normal, on the side the ray came from
+        const double *nx = arrays.nx, *ny = arrays.ny, *nz = arrays.nz;
+        Vec3 normal(weights[0] * nx[a] + weights[1] * nx[b] + weights[2] * nx[c],
+                    weights[0] * ny[a] + weights[1] * ny[b] + weights[2] * ny[c],
+                    weights[0] * nz[a] + weights[1] * nz[b] + weights[2] * nz[c]);
+        if (normal.lengthSquared() > 0)
+            rec.normal = rec.front_face ? unitVector(normal) : -unitVector(normal);
+    }
+    if (arrays.u)
+    {
+        // IMGTexture counts v from the top row
+        const double *tex_u = arrays.u, *tex_v = arrays.v;
+        rec.u = weights[0] * tex_u[a] + weights[1] * tex_u[b] + weights[2] * tex_u[c];
+        rec.v = 1 - (weights[0] * tex_v[a] + weights[1] * tex_v[b] + weights[2] * tex_v[c]);
+    }
+    else
+    {
+        rec.u = weights[1];
+        rec.v = weights[2];
+    }
+    rec.mat_ptr = mat_ptr;
+    return true;
+}
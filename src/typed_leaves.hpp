@@ -0,0 +1,407 @@
+// Typed BVH leaves: primitives of the common types are copied by value
+//  into one packed array per type, and a run of them in a leaf is
+//  intersected by one loop whose calls the compiler resolves statically.
+//
+// The primitives of each leaf are sorted by type, so a leaf costs one
+//  dispatch per type it holds, almost always just one. Other types keep
+//  their virtual call per primitive.
+
+#pragma once
+
+#include <typeinfo>
+
+#include "raytracer.h"
+#include "hittable.h"
+#include "sphere.hpp"
+#include "aarect.hpp"
+#include "box.hpp"
+#include "bvh_build.hpp"
+#include "bvh_stats.hpp"
+
+enum class LeafType : uint8_t
+{
+    Other, // through shared_ptr<Hittable>
+    Sphere,
+    XYRect,
+    XZRect,
+    YZRect,
+    Box
+};
+const int LEAF_TYPE_COUNT = static_cast<int>(LeafType::Box) + 1;
+
+inline LeafType leafType(const Hittable &object)
+{
+    const auto &type = typeid(object);
+    if (type == typeid(Sphere))
+        return LeafType::Sphere;
+    if (type == typeid(XYRect))
+        return LeafType::XYRect;
+    if (type == typeid(XZRect))
+        return LeafType::XZRect;
+    if (type == typeid(YZRect))
+        return LeafType::YZRect;
+    if (type == typeid(Box))
+        return LeafType::Box;
+    return LeafType::Other;
+}
+
+// one per reference, in leaf order
+struct TypedLeafRef
+{
+    uint32_t index; // into the array of its type, unused for Other
+    uint16_t run;   // references of this type from here to the end of the leaf,
+                    //  or of its piece if longer than UINT16_MAX
+    LeafType type;
+};
+
+class TypedLeaves
+{
+private:
+    std::vector<TypedLeafRef> refs;
+    std::vector<Sphere> spheres;
+    std::vector<XYRect> xy_rects;
+    std::vector<XZRect> xz_rects;
+    std::vector<YZRect> yz_rects;
+    std::vector<Box> boxes;
+
+    // packed copies no reference points at any more, see updateLeaf()
+    size_t dead = 0;
+
+    // a copy of `object` at `index`, which is either in use already or
+    //  just past the end
+    template <typename T>
+    static uint32_t pack(std::vector<T> &packed, const Hittable &object, uint32_t index)
+    {
+        if (index == packed.size())
+            packed.push_back(static_cast<const T &>(object));
+        else
+            packed[index] = static_cast<const T &>(object);
+        return index;
+    }
+
+    template <typename T>
+    static void compact(std::vector<T> &packed, std::vector<TypedLeafRef> &refs, LeafType type)
+    {
+        // in reference order, so every run stays contiguous
+        std::vector<T> live;
+        for (auto &ref : refs)
+            if (ref.type == type)
+            {
+                live.push_back(packed[ref.index]);
+                ref.index = live.size() - 1;
+            }
+        packed.swap(live);
+    }
+
+    size_t packedCount() const
+    {
+        return spheres.size() + xy_rects.size() + xz_rects.size() +
+               yz_rects.size() + boxes.size();
+    }
+
+    template <typename T>
+    static bool hitRun(const std::vector<T> &packed, uint32_t first, uint32_t count,
+                       const Ray &r, double t_min, double &t_max, HitRecord &rec)
+    {
+        bool hit_anything = false;
+        for (uint32_t i = first; i < first + count; ++i)
+        {
+            BVH_STATS_COUNT(primitive_tests);
+            if (packed[i].hit(r, t_min, t_max, rec))
+            {
+                hit_anything = true;
+                t_max = rec.t;
+            }
+        }
+        return hit_anything;
+    }
+
+    static bool hitRun(const std::vector<shared_ptr<Hittable>> &primitives,
+                       uint32_t first, uint32_t count,
+                       const Ray &r, double t_min, double &t_max, HitRecord &rec)
+    {
+        bool hit_anything = false;
+        for (uint32_t i = first; i < first + count; ++i)
+        {
+            BVH_STATS_COUNT(primitive_tests);
+            if (primitives[i]->hit(r, t_min, t_max, rec))
+            {
+                hit_anything = true;
+                t_max = rec.t;
+            }
+        }
+        return hit_anything;
+    }
+
+    template <typename T>
+    static bool occludedRun(const std::vector<T> &packed, uint32_t first, uint32_t count,
+                            const Ray &r, double t_min, double t_max)
+    {
+        for (uint32_t i = first; i < first + count; ++i)
+        {
+            BVH_STATS_COUNT(primitive_tests);
+            if (packed[i].occluded(r, t_min, t_max))
+                return true;
+        }
+        return false;
+    }
+
+    static bool occludedRun(const std::vector<shared_ptr<Hittable>> &primitives,
+                            uint32_t first, uint32_t count,
+                            const Ray &r, double t_min, double t_max)
+    {
+        for (uint32_t i = first; i < first + count; ++i)
+        {
+            BVH_STATS_COUNT(primitive_tests);
+            if (primitives[i]->occluded(r, t_min, t_max))
+                return true;
+        }
+        return false;
+    }
+
+    // sorts primitives[first, end) by type and packs them,
+    //  types[i - first] being the type of primitives[i]; the copies of
+    //  a type go to reuse[type] if they fit, else to the end of its array
+    void packLeaf(std::vector<shared_ptr<Hittable>> &primitives,
+                  uint32_t first, uint32_t end, const LeafType *types,
+                  const std::pair<uint32_t, uint32_t> *reuse = nullptr);
+
+    static std::vector<std::pair<uint32_t, uint32_t>>
+    leafRanges(const AlignedVector<BVHLinearNode> &nodes)
+    {
+        std::vector<std::pair<uint32_t, uint32_t>> leaves;
+        for (const auto &node : nodes)
+            if (node.count > 0)
+                leaves.emplace_back(node.offset, node.offset + node.count);
+        return leaves;
+    }
+
+public:
+    TypedLeaves() {}
+
+    // Sorts the primitives of every leaf of `nodes` by type,
+    //  and packs the ones of known types.
+    TypedLeaves(std::vector<shared_ptr<Hittable>> &primitives,
+                const AlignedVector<BVHLinearNode> &nodes);
+
+    // the same for leaves given as [first, end) ranges of `primitives`,
+    //  e.g. the cells of a grid
+    TypedLeaves(std::vector<shared_ptr<Hittable>> &primitives,
+                const std::vector<std::pair<uint32_t, uint32_t>> &leaves);
+
+    // Packs the leaf [first, end) again after its primitives changed,
+    //  see BVHNode::insert(), and lets go of the references in
+    //  [end, old_end) it no longer holds. The copies of a type are
+    //  written over the ones the leaf held before when they fit; the
+    //  others are counted, and once they outnumber the copies in use
+    //  all arrays are compacted.
+    void updateLeaf(std::vector<shared_ptr<Hittable>> &primitives,
+                    uint32_t first, uint32_t end, uint32_t old_end = 0);
+
+    // bytes of the references and the packed copies
+    size_t memoryUsage() const
+    {
+        return refs.capacity() * sizeof(TypedLeafRef) +
+               spheres.capacity() * sizeof(Sphere) +
+               xy_rects.capacity() * sizeof(XYRect) +
+               xz_rects.capacity() * sizeof(XZRect) +
+               yz_rects.capacity() * sizeof(YZRect) +
+               boxes.capacity() * sizeof(Box);
+    }
+
+    // Intersects the leaf of `count` primitives at `first`,
+    //  shrinking t_max to every hit like a BVH traversal does.
+    bool hit(const std::vector<shared_ptr<Hittable>> &primitives,
+             uint32_t first, uint32_t count,
+             const Ray &r, double t_min, double &t_max, HitRecord &rec) const
+    {
+        if (refs.empty())
+            return hitRun(primitives, first, count, r, t_min, t_max, rec);
+
+        bool hit_anything = false;
+        for (uint32_t i = first; i < first + count; i += refs[i].run)
+        {
+            const auto &ref = refs[i];
+            bool hit = false;
+            switch (ref.type)
+            {
+            case LeafType::Sphere:
+                hit = hitRun(spheres, ref.index, ref.run, r, t_min, t_max, rec);
+                break;
+            case LeafType::XYRect:
+                hit = hitRun(xy_rects, ref.index, ref.run, r, t_min, t_max, rec);
+                break;
+            case LeafType::XZRect:
+                hit = hitRun(xz_rects, ref.index, ref.run, r, t_min, t_max, rec);
+                break;
+            case LeafType::YZRect:
+                hit = hitRun(yz_rects, ref.index, ref.run, r, t_min, t_max, rec);
+                break;
+            case LeafType::Box:
+                hit = hitRun(boxes, ref.index, ref.run, r, t_min, t_max, rec);
+                break;
+            default:
+                hit = hitRun(primitives, i, ref.run, r, t_min, t_max, rec);
+            }
+            hit_anything = hit || hit_anything;
+        }
+        return hit_anything;
+    }
+
+    // whether any primitive of the leaf is hit, see Hittable::occluded
+    bool occluded(const std::vector<shared_ptr<Hittable>> &primitives,
+                  uint32_t first, uint32_t count,
+                  const Ray &r, double t_min, double t_max) const
+    {
+        if (refs.empty())
+            return occludedRun(primitives, first, count, r, t_min, t_max);
+
+        for (uint32_t i = first; i < first + count; i += refs[i].run)
+        {
+            const auto &ref = refs[i];
+            bool hit = false;
+            switch (ref.type)
+            {
+            case LeafType::Sphere:
+                hit = occludedRun(spheres, ref.index, ref.run, r, t_min, t_max);
+                break;
+            case LeafType::XYRect:
+                hit = occludedRun(xy_rects, ref.index, ref.run, r, t_min, t_max);
+                break;
+            case LeafType::XZRect:
+                hit = occludedRun(xz_rects, ref.index, ref.run, r, t_min, t_max);
+                break;
+            case LeafType::YZRect:
+                hit = occludedRun(yz_rects, ref.index, ref.run, r, t_min, t_max);
+                break;
+            case LeafType::Box:
+                hit = occludedRun(boxes, ref.index, ref.run, r, t_min, t_max);
+                break;
+            default:
+                hit = occludedRun(primitives, i, ref.run, r, t_min, t_max);
+            }
+            if (hit)
+                return true;
+        }
+        return false;
+    }
+};
+
+TypedLeaves::TypedLeaves(std::vector<shared_ptr<Hittable>> &primitives,
+                         const AlignedVector<BVHLinearNode> &nodes)
+    : TypedLeaves(primitives, leafRanges(nodes)) {}
+
+TypedLeaves::TypedLeaves(std::vector<shared_ptr<Hittable>> &primitives,
+                         const std::vector<std::pair<uint32_t, uint32_t>> &leaves)
+{
+    std::vector<LeafType> types(primitives.size());
+#pragma omp parallel for if (primitives.size() >= BVHBuildOptions().parallel_threshold)
+    for (size_t i = 0; i < primitives.size(); ++i)
+        if (primitives[i])
+            types[i] = leafType(*primitives[i]);
+
+    refs.resize(primitives.size());
+    for (const auto &range : leaves)
+        if (range.first != range.second)
+            packLeaf(primitives, range.first, range.second, types.data() + range.first);
+}
+
+void TypedLeaves::updateLeaf(std::vector<shared_ptr<Hittable>> &primitives,
+                             uint32_t first, uint32_t end, uint32_t old_end)
+{
+    if (refs.empty())
+        return; // not packing
+    old_end = std::max(old_end, end);
+    refs.resize(std::max<size_t>(primitives.size(), old_end));
+
+    // the copies the leaf held, a contiguous [first, first + count) per type
+    std::pair<uint32_t, uint32_t> held[LEAF_TYPE_COUNT] = {};
+    for (uint32_t i = first; i < old_end; ++i)
+    {
+        auto &ref = refs[i];
+        auto &range = held[static_cast<int>(ref.type)];
+        if (ref.type != LeafType::Other)
+        {
+            range.first = range.second ? std::min(range.first, ref.index) : ref.index;
+            ++range.second;
+        }
+        ref = TypedLeafRef{0, 1, LeafType::Other};
+    }
+
+    std::vector<LeafType> types;
+    uint32_t count[LEAF_TYPE_COUNT] = {};
+    for (uint32_t i = first; i < end; ++i)
+    {
+        types.push_back(leafType(*primitives[i]));
+        ++count[static_cast<int>(types.back())];
+    }
+    for (int t = 1; t < LEAF_TYPE_COUNT; ++t)
+        dead += count[t] <= held[t].second ? held[t].second - count[t] : held[t].second;
+    packLeaf(primitives, first, end, types.data(), held);
+
+    if (dead > packedCount() - dead)
+    {
+        compact(spheres, refs, LeafType::Sphere);
+        compact(xy_rects, refs, LeafType::XYRect);
+        compact(xz_rects, refs, LeafType::XZRect);
+        compact(yz_rects, refs, LeafType::YZRect);
+        compact(boxes, refs, LeafType::Box);
+        dead = 0;
+    }
+}
+
+void TypedLeaves::packLeaf(std::vector<shared_ptr<Hittable>> &primitives,
+                           uint32_t first, uint32_t end, const LeafType *types,
+                           const std::pair<uint32_t, uint32_t> *reuse)
+{
+    std::vector<std::pair<LeafType, shared_ptr<Hittable>>> leaf;
+    for (uint32_t i = first; i < end; ++i)
+        leaf.emplace_back(types[i - first], primitives[i]);
+    std::stable_sort(leaf.begin(), leaf.end(),
+                     [](const std::pair<LeafType, shared_ptr<Hittable>> &a,
+                        const std::pair<LeafType, shared_ptr<Hittable>> &b)
+                     { return a.first < b.first; });
+
+    // where the copies of each type start
+    const size_t sizes[LEAF_TYPE_COUNT] = {0, spheres.size(), xy_rects.size(),
+                                           xz_rects.size(), yz_rects.size(), boxes.size()};
+    uint32_t next[LEAF_TYPE_COUNT];
+    for (int t = 0; t < LEAF_TYPE_COUNT; ++t)
+    {
+        uint32_t count = 0;
+        for (const auto &entry : leaf)
+            count += static_cast<int>(entry.first) == t;
+        next[t] = reuse && count <= reuse[t].second ? reuse[t].first : sizes[t];
+    }
+
+    for (uint32_t i = first; i < end; ++i)
+    {
+        auto type = leaf[i - first].first;
+        const auto &object = *leaf[i - first].second;
+        primitives[i] = leaf[i - first].second;
+
+        auto &ref = refs[i];
+        ref.type = type;
+        ref.index = 0;
+        uint32_t &index = next[static_cast<int>(type)];
+        if (type == LeafType::Sphere)
+            ref.index = pack(spheres, object, index++);
+        else if (type == LeafType::XYRect)
+            ref.index = pack(xy_rects, object, index++);
+        else if (type == LeafType::XZRect)
+            ref.index = pack(xz_rects, object, index++);
+        else if (type == LeafType::YZRect)
+            ref.index = pack(yz_rects, object, index++);
+        else if (type == LeafType::Box)
+            ref.index = pack(boxes, object, index++);
+    }
+
+    // run lengths, counted back from the end of the leaf; grid cells and
+    //  kd leaves have no size limit, so a long run is cut into pieces
+    //  that fit in `run`, each dispatched on its own
+    for (uint32_t i = end; i-- > first;)
+        refs[i].run = i + 1 < end && refs[i + 1].type == refs[i].type &&
+                              refs[i + 1].run < UINT16_MAX
+                          ? refs[i + 1].run + 1
+                          : 1;
+}